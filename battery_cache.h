@@ -0,0 +1,389 @@
+/**
+  Columnar binary cache of parsed discharge logs.
+
+  Each dataset is converted once into a file that later runs memory map
+  in place.  Time and voltage are stored as 64-byte aligned float columns.
+  Current and temperature change slowly or not at all, so they are stored
+  as fixed-point integers (1 mA and 0.01 deg C, the charger's resolution),
+  delta coded and bit-packed in blocks of 64 samples.  A block of constant
+  current takes no bits at all past its first value.
+
+  Each run also stores sparse indexes used to slice it (see battery_slice.h):
+  the charge drawn before each block, its running maximum, and the sample
+  index of every pulse edge.
+
+  The file is written in native byte order (little-endian on x86 and ARM).
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_CACHE_H
+#define BATTERY_CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "battery_log.h"
+#include "battery_coulomb.h"
+
+#define battery_cache_magic "BATCACHE"
+#define battery_cache_version 2
+#define battery_cache_block_len 64 /* samples per bit-packed block */
+#define battery_cache_align 64 /* byte alignment of each column in the file */
+
+/* Current above this fraction of a run's peak current counts as a pulse */
+#define battery_cache_pulse_fraction 0.1f
+
+/* Fixed-point scale factors for the packed columns */
+#define battery_cache_amps_scale 1000.0f /* milliamps */
+#define battery_cache_tempC_scale 100.0f /* hundredths of a degree */
+
+/* Start of one bit-packed block */
+struct battery_cache_block {
+  int32_t first;   /* fixed-point value of the block's first sample */
+  uint32_t bits;   /* width of each zigzag-coded delta that follows */
+  uint64_t offset; /* byte offset of the packed deltas within the column's bit data */
+};
+
+/* A bit-packed fixed-point column, as stored in the file */
+struct battery_cache_packed {
+  float scale;     /* stored integer = round(value*scale) */
+  uint32_t nblocks;
+  uint64_t blocks; /* file offset of the struct battery_cache_block table */
+  uint64_t bits;   /* file offset of the packed delta bits */
+};
+
+/* Table of contents for one run, as stored in the file */
+struct battery_cache_run {
+  struct battery_log_info info;
+  int32_t n;       /* number of samples */
+  int32_t unused;
+  uint64_t time;   /* file offset of the float time column */
+  uint64_t volts;  /* file offset of the float voltage column */
+  struct battery_cache_packed amps, tempC;
+
+  uint64_t charge; /* file offset of float charge drawn before each block (amp-seconds), nblocks+1 */
+  uint64_t charge_max; /* file offset of float running maximum of charge through each block */
+  int32_t npulse;  /* number of pulses (load periods) */
+  int32_t unused2;
+  uint64_t pulse_on;  /* file offset of int32 first sample of each pulse */
+  uint64_t pulse_off; /* file offset of int32 first sample after each pulse */
+};
+
+/* Start of the file, followed by nrun struct battery_cache_run */
+struct battery_cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nrun;
+};
+
+/* A packed column of a mapped run, ready to decode */
+struct battery_cache_column {
+  float scale;
+  int nblocks;
+  const struct battery_cache_block *block;
+  const unsigned char *bits;
+};
+
+/* One run of a mapped cache file.  All pointers point into the mapping. */
+struct battery_cache_view {
+  const struct battery_log_info *info;
+  int n;
+  const float *time;  /* seconds since start of test */
+  const float *volts; /* pack terminal voltage */
+  struct battery_cache_column amps, tempC;
+
+  int nblocks;
+  const float *charge;     /* amp-seconds drawn before the first sample of each block */
+  const float *charge_max; /* most amp-seconds drawn before any sample up to the end of each block */
+  int npulse;
+  const int32_t *pulse_on, *pulse_off; /* sample ranges [on,off) of each pulse */
+};
+
+/* A memory mapped cache file */
+struct battery_cache {
+  const unsigned char *data;
+  size_t len;
+  int nrun;
+  struct battery_cache_view *run;
+};
+
+
+/********* Bit packing ***********/
+
+static inline uint32_t battery_cache_zigzag(int32_t d) { return ((uint32_t)d<<1)^(uint32_t)(d>>31); }
+static inline int32_t battery_cache_unzigzag(uint32_t z) { return (int32_t)(z>>1)^-(int32_t)(z&1); }
+
+/* Decode block b of this column to its fixed-point values */
+static inline void battery_cache_decode_block(const struct battery_cache_column *c,int b,int32_t *out)
+{
+  const struct battery_cache_block *blk=&c->block[b];
+  int32_t v=blk->first;
+  out[0]=v;
+  uint32_t bits=blk->bits;
+  if (bits==0) { // constant block
+    for (int k=1;k<battery_cache_block_len;k++) out[k]=v;
+    return;
+  }
+  const unsigned char *src=c->bits+blk->offset;
+  uint64_t mask=(bits>=32)?0xffffffffu:((1u<<bits)-1);
+  uint64_t pos=0;
+  for (int k=1;k<battery_cache_block_len;k++,pos+=bits) {
+    uint64_t word;
+    memcpy(&word,src+(pos>>3),sizeof(word));
+    v+=battery_cache_unzigzag((uint32_t)((word>>(pos&7))&mask));
+    out[k]=v;
+  }
+}
+
+/* Decode samples [begin,end) of this column to floats in out[0..end-begin) */
+void battery_cache_decode(const struct battery_cache_column *c,int begin,int end,float *out)
+{
+  int32_t tmp[battery_cache_block_len];
+  float inv=1.0f/c->scale;
+  for (int b=begin/battery_cache_block_len;b*battery_cache_block_len<end;b++) {
+    battery_cache_decode_block(c,b,tmp);
+    int lo=b*battery_cache_block_len, hi=lo+battery_cache_block_len;
+    if (lo<begin) lo=begin;
+    if (hi>end) hi=end;
+    for (int i=lo;i<hi;i++) *out++=tmp[i-b*battery_cache_block_len]*inv;
+  }
+}
+
+/* Decode the single sample i of this column */
+float battery_cache_value(const struct battery_cache_column *c,int i)
+{
+  float v;
+  battery_cache_decode(c,i,i+1,&v);
+  return v;
+}
+
+
+/********* Writing ***********/
+
+/* Grows a byte buffer while the file is assembled in memory */
+struct battery_cache_buffer {
+  unsigned char *data;
+  size_t len, max;
+};
+
+/* Append len bytes (zeros if src is null) and return their offset */
+size_t battery_cache_append(struct battery_cache_buffer *b,const void *src,size_t len)
+{
+  if (b->len+len>b->max) {
+    b->max=2*(b->len+len)+4096;
+    b->data=(unsigned char *)realloc(b->data,b->max);
+  }
+  size_t at=b->len;
+  if (src) memcpy(b->data+at,src,len);
+  else memset(b->data+at,0,len);
+  b->len+=len;
+  return at;
+}
+
+/* Pad the buffer out to the column alignment, and return the new end */
+size_t battery_cache_align_to(struct battery_cache_buffer *b)
+{
+  size_t pad=(battery_cache_align-b->len%battery_cache_align)%battery_cache_align;
+  battery_cache_append(b,0,pad);
+  return b->len;
+}
+
+/* Bit-pack n samples of this float column at this scale into the buffer */
+void battery_cache_pack(struct battery_cache_buffer *b,const float *src,int n,float scale,
+  struct battery_cache_packed *out)
+{
+  int nblocks=(n+battery_cache_block_len-1)/battery_cache_block_len;
+  out->scale=scale;
+  out->nblocks=nblocks;
+  struct battery_cache_block *blocks=(struct battery_cache_block *)calloc(nblocks>0?nblocks:1,sizeof(*blocks));
+  struct battery_cache_buffer bits={0,0,0};
+  for (int b=0;b<nblocks;b++) {
+    int32_t v[battery_cache_block_len];
+    for (int k=0;k<battery_cache_block_len;k++) {
+      int i=b*battery_cache_block_len+k;
+      if (i>=n) i=n-1; // pad the last block by repeating the final sample
+      v[k]=(int32_t)lrintf(src[i]*scale);
+    }
+    uint32_t all=0, z[battery_cache_block_len];
+    for (int k=1;k<battery_cache_block_len;k++) { z[k]=battery_cache_zigzag(v[k]-v[k-1]); all|=z[k]; }
+    uint32_t width=all?32-__builtin_clz(all):0;
+    blocks[b].first=v[0];
+    blocks[b].bits=width;
+    blocks[b].offset=bits.len;
+    if (width==0) continue;
+    size_t bytes=((battery_cache_block_len-1)*width+63)/64*8;
+    size_t at=battery_cache_append(&bits,0,bytes);
+    unsigned char *dest=bits.data+at;
+    uint64_t pos=0;
+    for (int k=1;k<battery_cache_block_len;k++,pos+=width) {
+      // deltas never straddle more than 5 bytes, so OR them in a byte at a time
+      uint64_t word=(uint64_t)z[k]<<(pos&7);
+      for (int byte=0;byte<5 && (word>>(8*byte));byte++)
+        dest[(pos>>3)+byte]|=(unsigned char)(word>>(8*byte));
+    }
+  }
+  battery_cache_append(&bits,0,8); // slack for the decoder's 8-byte reads
+
+  out->blocks=battery_cache_align_to(b);
+  battery_cache_append(b,blocks,nblocks*sizeof(*blocks));
+  out->bits=battery_cache_align_to(b);
+  battery_cache_append(b,bits.data,bits.len);
+  free(blocks);
+  free(bits.data);
+}
+
+/* Append the charge and pulse indexes for this log to the buffer.
+   The current of sample i is taken to flow until sample i+1. */
+void battery_cache_index(struct battery_cache_buffer *b,const struct battery_log *log,
+  struct battery_cache_run *run)
+{
+  int n=log->n, nblocks=(n+battery_cache_block_len-1)/battery_cache_block_len;
+  const float *time=log->col[battery_log_time], *amps=log->col[battery_log_amps];
+  float *charge=(float *)malloc((nblocks+1)*sizeof(float));
+  float *charge_max=(float *)malloc((nblocks>0?nblocks:1)*sizeof(float));
+  float *q=(float *)malloc((n>0?n:1)*sizeof(float)); // charge drawn before sample i
+  battery_coulomb_charge(time,amps,n,q,1);
+  float qmax=0;
+  for (int i=0;i<n;i++) {
+    if (i%battery_cache_block_len==0) charge[i/battery_cache_block_len]=q[i];
+    if (q[i]>qmax) qmax=q[i];
+    if (i%battery_cache_block_len==battery_cache_block_len-1 || i==n-1) charge_max[i/battery_cache_block_len]=qmax;
+  }
+  charge[nblocks]=n>0?q[n-1]:0.0f;
+  free(q);
+
+  float peak=0;
+  for (int i=0;i<n;i++) if (amps[i]>peak) peak=amps[i];
+  float on=peak*battery_cache_pulse_fraction, off=on*0.5f; // hysteresis against noise
+  int32_t *pulse_on=(int32_t *)malloc((n/2+1)*sizeof(int32_t)), *pulse_off=(int32_t *)malloc((n/2+1)*sizeof(int32_t));
+  int npulse=0, loaded=0;
+  for (int i=0;i<n;i++) {
+    if (!loaded && amps[i]>on) { loaded=1; pulse_on[npulse]=i; }
+    else if (loaded && amps[i]<off) { loaded=0; pulse_off[npulse++]=i; }
+  }
+  if (loaded) pulse_off[npulse++]=n;
+
+  run->charge=battery_cache_align_to(b);
+  battery_cache_append(b,charge,(nblocks+1)*sizeof(float));
+  run->charge_max=battery_cache_align_to(b);
+  battery_cache_append(b,charge_max,nblocks*sizeof(float));
+  run->npulse=npulse;
+  run->pulse_on=battery_cache_align_to(b);
+  battery_cache_append(b,pulse_on,npulse*sizeof(int32_t));
+  run->pulse_off=battery_cache_align_to(b);
+  battery_cache_append(b,pulse_off,npulse*sizeof(int32_t));
+  free(charge); free(charge_max); free(pulse_on); free(pulse_off);
+}
+
+/* Convert these parsed runs to a cache file.
+   Returns 0 on success, or -1 if the file can't be written. */
+int battery_cache_write(const char *filename,const struct battery_log *runs,int nrun)
+{
+  struct battery_cache_buffer b={0,0,0};
+  struct battery_cache_header head;
+  memset(&head,0,sizeof(head));
+  memcpy(head.magic,battery_cache_magic,8);
+  head.version=battery_cache_version;
+  head.nrun=nrun;
+  battery_cache_append(&b,&head,sizeof(head));
+  size_t toc=battery_cache_append(&b,0,nrun*sizeof(struct battery_cache_run));
+
+  for (int r=0;r<nrun;r++) {
+    const struct battery_log *log=&runs[r];
+    struct battery_cache_run run;
+    memset(&run,0,sizeof(run));
+    run.info=log->info;
+    run.n=log->n;
+    run.time=battery_cache_align_to(&b);
+    battery_cache_append(&b,log->col[battery_log_time],log->n*sizeof(float));
+    run.volts=battery_cache_align_to(&b);
+    battery_cache_append(&b,log->col[battery_log_volts],log->n*sizeof(float));
+    battery_cache_pack(&b,log->col[battery_log_amps],log->n,battery_cache_amps_scale,&run.amps);
+    battery_cache_pack(&b,log->col[battery_log_tempC],log->n,battery_cache_tempC_scale,&run.tempC);
+    battery_cache_index(&b,log,&run);
+    memcpy(b.data+toc+r*sizeof(run),&run,sizeof(run));
+  }
+  battery_cache_align_to(&b);
+
+  FILE *f=fopen(filename,"wb");
+  int ok=f && fwrite(b.data,1,b.len,f)==b.len;
+  if (f && fclose(f)!=0) ok=0;
+  free(b.data);
+  return ok?0:-1;
+}
+
+
+/********* Reading ***********/
+
+void battery_cache_close(struct battery_cache *c)
+{
+  if (c->data) munmap((void *)c->data,c->len);
+  free(c->run);
+  memset(c,0,sizeof(*c));
+}
+
+/* Map this cache file into memory.
+   Returns 0 on success, or -1 if the file is missing, damaged, or from another version. */
+int battery_cache_open(struct battery_cache *c,const char *filename)
+{
+  memset(c,0,sizeof(*c));
+  int fd=open(filename,O_RDONLY);
+  if (fd<0) return -1;
+  struct stat st;
+  if (fstat(fd,&st)!=0 || (size_t)st.st_size<sizeof(struct battery_cache_header)) { close(fd); return -1; }
+  void *map=mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if (map==MAP_FAILED) return -1;
+  c->data=(const unsigned char *)map;
+  c->len=st.st_size;
+
+  const struct battery_cache_header *head=(const struct battery_cache_header *)c->data;
+  size_t toc_end=sizeof(*head)+(size_t)head->nrun*sizeof(struct battery_cache_run);
+  if (memcmp(head->magic,battery_cache_magic,8)!=0 || head->version!=battery_cache_version
+    || toc_end>c->len) { battery_cache_close(c); return -1; }
+
+  c->nrun=head->nrun;
+  c->run=(struct battery_cache_view *)calloc(c->nrun>0?c->nrun:1,sizeof(struct battery_cache_view));
+  const struct battery_cache_run *toc=(const struct battery_cache_run *)(head+1);
+  for (int r=0;r<c->nrun;r++) {
+    const struct battery_cache_run *run=&toc[r];
+    struct battery_cache_view *v=&c->run[r];
+    const struct battery_cache_packed *packed[2]={&run->amps,&run->tempC};
+    struct battery_cache_column *column[2]={&v->amps,&v->tempC};
+    int nblocks=(run->n+battery_cache_block_len-1)/battery_cache_block_len;
+    int bad=run->n<0 || run->time+run->n*sizeof(float)>c->len || run->volts+run->n*sizeof(float)>c->len
+      || run->charge+(nblocks+1)*sizeof(float)>c->len || run->charge_max+nblocks*sizeof(float)>c->len
+      || run->npulse<0 || run->pulse_on+run->npulse*sizeof(int32_t)>c->len
+      || run->pulse_off+run->npulse*sizeof(int32_t)>c->len;
+    for (int p=0;p<2;p++) {
+      const struct battery_cache_packed *src=packed[p];
+      if (src->nblocks!=(uint32_t)nblocks
+        || src->blocks+src->nblocks*sizeof(struct battery_cache_block)>c->len
+        || src->bits>c->len) bad=1;
+      column[p]->scale=src->scale;
+      column[p]->nblocks=src->nblocks;
+      column[p]->block=(const struct battery_cache_block *)(c->data+src->blocks);
+      column[p]->bits=c->data+src->bits;
+    }
+    if (bad) { battery_cache_close(c); return -1; }
+    v->info=&run->info;
+    v->n=run->n;
+    v->time=(const float *)(c->data+run->time);
+    v->volts=(const float *)(c->data+run->volts);
+    v->nblocks=nblocks;
+    v->charge=(const float *)(c->data+run->charge);
+    v->charge_max=(const float *)(c->data+run->charge_max);
+    v->npulse=run->npulse;
+    v->pulse_on=(const int32_t *)(c->data+run->pulse_on);
+    v->pulse_off=(const int32_t *)(c->data+run->pulse_off);
+  }
+  return 0;
+}
+
+#endif
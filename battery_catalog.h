@@ -0,0 +1,374 @@
+/**
+  Catalog of the recorded discharge datasets.
+
+  File names like "1800mah)(Neg10degC)(1.0C-rate.csv" or
+  "350mah)(6degC)(2.5C-rate)(run1.csv" encode the test conditions, and
+  each CSV preamble adds the cell count, sample rate and pulse timing.
+  The catalog is built once over the archive, reading only the preamble
+  of each log, and is kept sorted by capacity, temperature and C-rate so
+  queries like "all 1.8 Ah runs between -10 and 5 C at >=2C" never touch
+  the data itself.  Dropbox "conflicted copy" duplicates are marked.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_CATALOG_H
+#define BATTERY_CATALOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include "battery_log.h"
+#include "battery_zip.h"
+
+/* File formats of catalogued datasets */
+enum {
+  battery_catalog_csv=0, /* charger CSV log, readable by battery_log.h */
+  battery_catalog_xlsx   /* Excel copy, as used by the MATLAB scripts */
+};
+
+/* One dataset */
+struct battery_catalog_entry {
+  char name[192];   /* file name, without directory */
+  char path[256];   /* archive member path, or file path */
+  int member;       /* index of the archive member, or -1 for a plain file */
+  int format;       /* battery_catalog_csv or battery_catalog_xlsx */
+
+  float capacity_Ah; /* rated capacity of the cells */
+  float tempC;      /* nominal test temperature (deg C), NAN if not part of the name */
+  float crate;      /* discharge current / capacity; NAN if not known */
+  float amps;       /* constant test current (amps) if known, else 0 */
+  int run;          /* run number from "(runN)", or 0 */
+  int scenario;     /* 1 for usage scenario logs rather than lab discharge tests */
+  int conflicted;   /* 1 if this is a sync "conflicted copy" of another file */
+  int duplicate_of; /* catalog index of the file this is a copy of, or -1 */
+
+  int has_info;     /* 1 if info was read from the CSV preamble */
+  struct battery_log_info info;
+  float first_tempC; /* first logged temperature, NAN if the probe wasn't connected */
+};
+
+/* All datasets, sorted by capacity, then temperature, then C-rate */
+struct battery_catalog {
+  int n, max;
+  struct battery_catalog_entry *entry;
+};
+
+/* Query ranges: an entry matches if every field lies in its closed range.
+   Entries with an unknown (NAN) temperature or C-rate only match an
+   unbounded range for that field. */
+struct battery_catalog_query {
+  float min_Ah, max_Ah;
+  float min_tempC, max_tempC;
+  float min_crate, max_crate;
+  int csv_only;        /* skip the Excel copies */
+  int with_conflicted; /* include conflicted copies */
+  int with_scenarios;  /* include usage scenario logs */
+};
+
+/* A query that matches every original lab dataset */
+void battery_catalog_query_init(struct battery_catalog_query *q)
+{
+  q->min_Ah=q->min_tempC=q->min_crate=-INFINITY;
+  q->max_Ah=q->max_tempC=q->max_crate=INFINITY;
+  q->csv_only=0;
+  q->with_conflicted=0;
+  q->with_scenarios=1;
+}
+
+
+/********* File names ***********/
+
+/* Parse the number at the start of this token, or return NAN */
+float battery_catalog_number(const char *tok,const char **end)
+{
+  char *e;
+  float v=strtof(tok,&e);
+  if (end) *end=e;
+  return e==tok?NAN:v;
+}
+
+/* Fill in the test conditions encoded in this dataset file name */
+void battery_catalog_parse_name(struct battery_catalog_entry *e,const char *name)
+{
+  e->tempC=e->crate=NAN;
+  e->capacity_Ah=e->amps=0;
+  char buf[192];
+  snprintf(buf,sizeof(buf),"%s",name);
+  char *dot=strrchr(buf,'.');
+  if (dot) {
+    e->format=strcasecmp(dot,".xlsx")?battery_catalog_csv:battery_catalog_xlsx;
+    *dot=0;
+  }
+  if (strstr(buf,"conflicted copy")) e->conflicted=1;
+
+  for (char *tok=strtok(buf,"()_ ");tok;tok=strtok(0,"()_ ")) {
+    char lower[64];
+    int len=0;
+    for (;tok[len] && len<63;len++) lower[len]=tolower((unsigned char)tok[len]);
+    lower[len]=0;
+    const char *rest;
+    if (!strncmp(lower,"usage",5)) e->scenario=1;
+    else if (!strncmp(lower,"run",3) && isdigit((unsigned char)lower[3])) e->run=atoi(lower+3);
+    else if (strstr(lower,"degc")) { // "12degC", "Neg10degC"
+      int neg=!strncmp(lower,"neg",3);
+      float t=battery_catalog_number(lower+(neg?3:0),0);
+      if (t==t) e->tempC=neg?-t:t;
+    }
+    else if (strstr(lower,"c-rate")) e->crate=battery_catalog_number(lower,0);
+    else {
+      float v=battery_catalog_number(lower,&rest);
+      if (v!=v) continue;
+      if (!strcmp(rest,"mah")) e->capacity_Ah=v/1000.0f;
+      else if (!strcmp(rest,"ah")) e->capacity_Ah=v;
+      else if (!strcmp(rest,"ma")) e->amps=v/1000.0f; // "100ma" rate
+    }
+  }
+  if (e->crate!=e->crate && e->amps>0 && e->capacity_Ah>0) e->crate=e->amps/e->capacity_Ah;
+}
+
+/* Return 1 if this file name looks like a cell dataset */
+int battery_catalog_is_dataset(const char *name)
+{
+  size_t len=strlen(name);
+  if (len<5) return 0;
+  if (strcasecmp(name+len-4,".csv") && strcasecmp(name+len-5,".xlsx")) return 0;
+  struct battery_catalog_entry e;
+  memset(&e,0,sizeof(e));
+  battery_catalog_parse_name(&e,name);
+  return e.capacity_Ah>0;
+}
+
+/* Name of the file that this conflicted copy duplicates:
+   "x (isaac-PC's conflicted copy 2018-02-06).xlsx" -> "x.xlsx" */
+void battery_catalog_original_name(char *dest,int len,const char *name)
+{
+  const char *open=strstr(name," (");
+  const char *close=open?strchr(open,')'):0;
+  if (!open || !close || !strstr(open,"conflicted copy")) { snprintf(dest,len,"%s",name); return; }
+  snprintf(dest,len,"%.*s%s",(int)(open-name),name,close+1);
+}
+
+
+/********* Preambles ***********/
+
+/* Stops reading a log once its first sample row is parsed */
+int battery_catalog_preamble_chunk(void *user,const char *buf,size_t len)
+{
+  struct battery_zip_stream *s=(struct battery_zip_stream *)user;
+  battery_zip_stream_chunk(s,buf,len);
+  return s->parser.nlog>0 && s->parser.log[0].n>0;
+}
+
+/* Copy the preamble and first sample from this parser into the entry */
+void battery_catalog_take_preamble(struct battery_catalog_entry *e,struct battery_log_parser *p)
+{
+  e->first_tempC=NAN;
+  if (p->nlog==0) return;
+  struct battery_log *log=&p->log[0];
+  e->has_info=1;
+  e->info=log->info;
+  if (log->n>0 && battery_log_temp_valid(log->col[battery_log_tempC][0]))
+    e->first_tempC=log->col[battery_log_tempC][0];
+  if (!log->info.test_power && log->info.test_current>0 && e->amps==0) e->amps=log->info.test_current;
+  if (e->crate!=e->crate && e->amps>0 && e->capacity_Ah>0) e->crate=e->amps/e->capacity_Ah;
+  if (e->capacity_Ah==0) e->capacity_Ah=log->info.rated_Ah;
+}
+
+/* Read just the preamble of archive member e into this entry */
+void battery_catalog_read_preamble(struct battery_catalog_entry *e,const struct battery_zip *zip)
+{
+  struct battery_zip_stream *s=(struct battery_zip_stream *)calloc(1,sizeof(struct battery_zip_stream));
+  battery_log_parser_init(&s->parser);
+  battery_zip_read(zip,e->member,battery_catalog_preamble_chunk,s);
+  battery_catalog_take_preamble(e,&s->parser);
+  struct battery_log *runs;
+  battery_log_free(runs,battery_log_parser_finish(&s->parser,&runs));
+  free(s->buf);
+  free(s);
+}
+
+/* Read just the preamble of this CSV file into this entry */
+void battery_catalog_read_file_preamble(struct battery_catalog_entry *e)
+{
+  FILE *f=fopen(e->path,"rb");
+  if (!f) return;
+  size_t head=battery_log_window;
+  char *buf=(char *)malloc(head);
+  size_t len=fread(buf,1,head,f);
+  fclose(f);
+  struct battery_log_parser *p=(struct battery_log_parser *)malloc(sizeof(*p));
+  battery_log_parser_init(p);
+  battery_log_parse_lines(p,buf,len);
+  battery_catalog_take_preamble(e,p);
+  struct battery_log *runs;
+  battery_log_free(runs,battery_log_parser_finish(p,&runs));
+  free(p);
+  free(buf);
+}
+
+
+/********* Building ***********/
+
+/* Sort order: capacity, temperature (unknown last), C-rate, then name */
+int battery_catalog_compare(const void *a,const void *b)
+{
+  const struct battery_catalog_entry *x=(const struct battery_catalog_entry *)a;
+  const struct battery_catalog_entry *y=(const struct battery_catalog_entry *)b;
+  if (x->capacity_Ah!=y->capacity_Ah) return x->capacity_Ah<y->capacity_Ah?-1:1;
+  float xt=x->tempC==x->tempC?x->tempC:INFINITY, yt=y->tempC==y->tempC?y->tempC:INFINITY;
+  if (xt!=yt) return xt<yt?-1:1;
+  float xc=x->crate==x->crate?x->crate:INFINITY, yc=y->crate==y->crate?y->crate:INFINITY;
+  if (xc!=yc) return xc<yc?-1:1;
+  return strcmp(x->name,y->name);
+}
+
+/* Append a new entry for this dataset file */
+struct battery_catalog_entry *battery_catalog_add(struct battery_catalog *cat,const char *path,int member)
+{
+  if (cat->n>=cat->max) {
+    cat->max=cat->max?2*cat->max:64;
+    cat->entry=(struct battery_catalog_entry *)realloc(cat->entry,cat->max*sizeof(struct battery_catalog_entry));
+  }
+  struct battery_catalog_entry *e=&cat->entry[cat->n++];
+  memset(e,0,sizeof(*e));
+  const char *slash=strrchr(path,'/');
+  snprintf(e->name,sizeof(e->name),"%s",slash?slash+1:path);
+  snprintf(e->path,sizeof(e->path),"%s",path);
+  e->member=member;
+  e->first_tempC=NAN;
+  battery_catalog_parse_name(e,e->name);
+  return e;
+}
+
+/* Sort the entries and link each conflicted copy to its original */
+void battery_catalog_finish(struct battery_catalog *cat)
+{
+  qsort(cat->entry,cat->n,sizeof(struct battery_catalog_entry),battery_catalog_compare);
+  for (int i=0;i<cat->n;i++) {
+    struct battery_catalog_entry *e=&cat->entry[i];
+    e->duplicate_of=-1;
+    if (!e->conflicted) continue;
+    char original[192];
+    battery_catalog_original_name(original,sizeof(original),e->name);
+    for (int j=0;j<cat->n;j++)
+      if (j!=i && !strcmp(cat->entry[j].name,original)) e->duplicate_of=j;
+  }
+}
+
+/* Catalog every dataset in this zip archive.
+   Returns 0 on success, or -1 if the archive can't be read. */
+int battery_catalog_build(struct battery_catalog *cat,const char *zipname)
+{
+  memset(cat,0,sizeof(*cat));
+  struct battery_zip zip;
+  if (battery_zip_open(&zip,zipname)!=0) return -1;
+  for (int m=0;m<zip.n;m++) {
+    const char *name=battery_zip_basename(&zip.entry[m]);
+    if (!battery_catalog_is_dataset(name)) continue;
+    struct battery_catalog_entry *e=battery_catalog_add(cat,zip.entry[m].name,m);
+    if (e->format==battery_catalog_csv) battery_catalog_read_preamble(e,&zip);
+  }
+  battery_zip_close(&zip);
+  battery_catalog_finish(cat);
+  return 0;
+}
+
+void battery_catalog_free(struct battery_catalog *cat)
+{
+  free(cat->entry);
+  memset(cat,0,sizeof(*cat));
+}
+
+/* Save the catalog, so later jobs can load it instead of rebuilding.
+   Returns 0 on success, or -1 if the file can't be written. */
+#define battery_catalog_magic "BATCAT01"
+int battery_catalog_write(const struct battery_catalog *cat,const char *filename)
+{
+  FILE *f=fopen(filename,"wb");
+  if (!f) return -1;
+  int32_t n=cat->n;
+  int ok=fwrite(battery_catalog_magic,8,1,f)==1 && fwrite(&n,sizeof(n),1,f)==1
+    && fwrite(cat->entry,sizeof(struct battery_catalog_entry),n,f)==(size_t)n;
+  if (fclose(f)!=0) ok=0;
+  return ok?0:-1;
+}
+
+/* Load a catalog saved by battery_catalog_write.
+   Returns 0 on success, or -1 if the file is missing or damaged. */
+int battery_catalog_read(struct battery_catalog *cat,const char *filename)
+{
+  memset(cat,0,sizeof(*cat));
+  FILE *f=fopen(filename,"rb");
+  if (!f) return -1;
+  char magic[8];
+  int32_t n=0;
+  int ok=fread(magic,8,1,f)==1 && !memcmp(magic,battery_catalog_magic,8)
+    && fread(&n,sizeof(n),1,f)==1 && n>=0;
+  if (ok) {
+    cat->entry=(struct battery_catalog_entry *)malloc((n>0?n:1)*sizeof(struct battery_catalog_entry));
+    ok=fread(cat->entry,sizeof(struct battery_catalog_entry),n,f)==(size_t)n;
+    cat->n=cat->max=n;
+  }
+  fclose(f);
+  if (!ok) { battery_catalog_free(cat); return -1; }
+  return 0;
+}
+
+
+/********* Queries ***********/
+
+/* Index of the first entry at or after this capacity and temperature */
+int battery_catalog_lower_bound(const struct battery_catalog *cat,float Ah,float tempC)
+{
+  int lo=0, hi=cat->n;
+  while (lo<hi) {
+    int mid=(lo+hi)/2;
+    const struct battery_catalog_entry *e=&cat->entry[mid];
+    float t=e->tempC==e->tempC?e->tempC:INFINITY;
+    if (e->capacity_Ah<Ah || (e->capacity_Ah==Ah && t<tempC)) lo=mid+1;
+    else hi=mid;
+  }
+  return lo;
+}
+
+/* Return 1 if v is in [lo,hi]; unknown values only match an unbounded range */
+static inline int battery_catalog_in(float v,float lo,float hi)
+{
+  if (v!=v) return lo==-INFINITY && hi==INFINITY;
+  return v>=lo && v<=hi;
+}
+
+/* Store the catalog indexes of entries matching q into out (up to max).
+   Returns the number of matches. */
+int battery_catalog_query(const struct battery_catalog *cat,const struct battery_catalog_query *q,int *out,int max)
+{
+  int found=0;
+  int i=battery_catalog_lower_bound(cat,q->min_Ah,q->min_tempC);
+  while (i<cat->n && cat->entry[i].capacity_Ah<=q->max_Ah) {
+    const struct battery_catalog_entry *e=&cat->entry[i];
+    float t=e->tempC==e->tempC?e->tempC:INFINITY;
+    if (t>q->max_tempC && q->max_tempC!=INFINITY)
+    { // past the temperature range: skip ahead to the next capacity
+      float Ah=e->capacity_Ah;
+      while (i<cat->n && cat->entry[i].capacity_Ah==Ah) i++;
+      if (i<cat->n) i=battery_catalog_lower_bound(cat,cat->entry[i].capacity_Ah,q->min_tempC);
+      continue;
+    }
+    if (battery_catalog_in(e->tempC,q->min_tempC,q->max_tempC)
+      && battery_catalog_in(e->crate,q->min_crate,q->max_crate)
+      && (!q->csv_only || e->format==battery_catalog_csv)
+      && (q->with_conflicted || !e->conflicted)
+      && (q->with_scenarios || !e->scenario))
+    {
+      if (found<max) out[found]=i;
+      found++;
+    }
+    i++;
+  }
+  return found;
+}
+
+#endif
@@ -0,0 +1,157 @@
+/**
+  Checkpointed replay, for re-scoring a run quickly after a few table
+  entries change.
+
+  Changing a table node can only change a run from the first sample whose
+  lookup touches that node: before then, the replay never reads it.  So a
+  recorded replay keeps a checkpoint every interval samples (the whole
+  replay state and the score so far), and for every table node, the first
+  checkpoint interval that touches it.  Re-evaluating after an edit
+  restarts from the checkpoint before the earliest touch of any changed
+  node, instead of from t=0.  Runs that never reach the edited nodes (say,
+  a -20 degC test when the 20 degC row is edited) cost nothing.
+
+  Recording steps the replay one sample at a time to see which nodes each
+  sample reads; re-evaluation replays at full speed.  Checkpoints are
+  only valid for the thermal constants they were recorded with.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_CHECKPOINT_H
+#define BATTERY_CHECKPOINT_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "battery_log.h"
+#include "battery_replay.h"
+#include "battery_score.h"
+#include "battery_gradient.h"
+
+#define battery_checkpoint_interval 256 /* samples between checkpoints */
+
+/* Replay state before one sample */
+struct battery_checkpoint {
+  struct battery_replay replay;
+  struct battery_score score; /* of the samples before it */
+};
+
+/* A recorded replay of one run */
+struct battery_checkpoint_run {
+  const struct battery_log *log;
+  int ncheck; /* checkpoint c is before sample c*battery_checkpoint_interval */
+  struct battery_checkpoint *check;
+  int first[battery_model_table_temps][battery_model_table_SOCs]; /* first checkpoint interval touching each node, or ncheck */
+  struct battery_score score; /* of the whole run */
+};
+
+/* Table nodes that changed: 1 if any parameter at that node did */
+struct battery_checkpoint_edit {
+  unsigned char node[battery_model_table_temps][battery_model_table_SOCs];
+};
+
+/* Get ready to record replays of this run.  Returns 0, or -1 if there
+   isn't memory for its checkpoints. */
+int battery_checkpoint_init(struct battery_checkpoint_run *cr,const struct battery_log *log)
+{
+  memset(cr,0,sizeof(*cr));
+  cr->log=log;
+  cr->ncheck=(log->n+battery_checkpoint_interval-1)/battery_checkpoint_interval;
+  cr->check=(struct battery_checkpoint *)malloc((cr->ncheck>0?cr->ncheck:1)*sizeof(struct battery_checkpoint));
+  return cr->check?0:-1;
+}
+
+void battery_checkpoint_free(struct battery_checkpoint_run *cr)
+{
+  free(cr->check);
+  cr->check=0;
+  cr->ncheck=0;
+}
+
+/* Replay from checkpoint c (which must hold a valid state, or c=0) to the
+   end, recording checkpoints and node touches from there on. */
+void battery_checkpoint_record_from(struct battery_checkpoint_run *cr,int c,
+  const struct battery_replay_lut *lut,const struct battery_replay_config *config,
+  const struct battery_score_config *bands)
+{
+  const struct battery_log *log=cr->log;
+  struct battery_replay r;
+  struct battery_score score;
+  if (c==0) {
+    battery_replay_start(&r,lut,config,&log->info);
+    battery_score_init(&score,bands);
+  } else {
+    r=cr->check[c].replay;
+    r.lut=lut;
+    score=cr->check[c].score;
+  }
+  for (int t=0;t<battery_model_table_temps;t++)
+    for (int s=0;s<battery_model_table_SOCs;s++)
+      if (cr->first[t][s]>=c) cr->first[t][s]=cr->ncheck;
+
+  const float *time=log->col[battery_log_time], *amps=log->col[battery_log_amps];
+  const float *tempC=log->col[battery_log_tempC], *cellV=log->col[battery_log_cellV];
+  for (int i=c*battery_checkpoint_interval;i<log->n;i++) {
+    int k=i/battery_checkpoint_interval;
+    if (i%battery_checkpoint_interval==0) {
+      cr->check[k].replay=r;
+      cr->check[k].score=score;
+    }
+    battery_replay_run(&r,time+i,amps+i,tempC+i,cellV+i,1,0,0,&score);
+    struct battery_gradient_cell cell;
+    battery_gradient_find(lut,r.battery.SOC,r.battery.cellT,&cell);
+    int *f=&cr->first[cell.t0][cell.s0];
+    if (*f>k) *f=k;
+    f=&cr->first[cell.t0][cell.s1]; if (*f>k) *f=k;
+    f=&cr->first[cell.t1][cell.s0]; if (*f>k) *f=k;
+    f=&cr->first[cell.t1][cell.s1]; if (*f>k) *f=k;
+  }
+  cr->score=score;
+}
+
+/* Record a whole replay of the run with these tables */
+void battery_checkpoint_record(struct battery_checkpoint_run *cr,
+  const struct battery_replay_lut *lut,const struct battery_replay_config *config,
+  const struct battery_score_config *bands)
+{
+  battery_checkpoint_record_from(cr,0,lut,config,bands);
+}
+
+/* First checkpoint interval that reads any edited node, or ncheck if none does */
+int battery_checkpoint_first(const struct battery_checkpoint_run *cr,const struct battery_checkpoint_edit *e)
+{
+  int c=cr->ncheck;
+  for (int t=0;t<battery_model_table_temps;t++)
+    for (int s=0;s<battery_model_table_SOCs;s++)
+      if (e->node[t][s] && cr->first[t][s]<c) c=cr->first[t][s];
+  return c;
+}
+
+/* Score the run with edited tables lut, which differ from the recorded
+   ones only at the nodes in e.  The thermal constants are those it was
+   recorded with, kept in its checkpoints.  Returns the number of samples
+   replayed. */
+long battery_checkpoint_evaluate(const struct battery_checkpoint_run *cr,
+  const struct battery_replay_lut *lut,const struct battery_checkpoint_edit *e,struct battery_score *score)
+{
+  int c=battery_checkpoint_first(cr,e);
+  if (c>=cr->ncheck) { *score=cr->score; return 0; }
+  const struct battery_log *log=cr->log;
+  struct battery_replay r=cr->check[c].replay;
+  r.lut=lut;
+  *score=cr->check[c].score;
+  int i=c*battery_checkpoint_interval;
+  battery_replay_run(&r,log->col[battery_log_time]+i,log->col[battery_log_amps]+i,
+    log->col[battery_log_tempC]+i,log->col[battery_log_cellV]+i,log->n-i,0,0,score);
+  return log->n-i;
+}
+
+/* The edit was kept: re-record from the first checkpoint it changes */
+void battery_checkpoint_update(struct battery_checkpoint_run *cr,
+  const struct battery_replay_lut *lut,const struct battery_replay_config *config,
+  const struct battery_checkpoint_edit *e)
+{
+  int c=battery_checkpoint_first(cr,e);
+  if (c<cr->ncheck) battery_checkpoint_record_from(cr,c,lut,config,&cr->score.config);
+}
+
+#endif
@@ -0,0 +1,197 @@
+/**
+  CMA-ES: covariance matrix adaptation evolution strategy, a derivative
+  free minimizer for a handful of parameters.
+
+  Each generation samples a population of candidate points from a
+  multivariate normal distribution, and the caller scores all of them
+  (at once, so they can be evaluated in parallel).  The best half pull the
+  mean toward them, and stretch the distribution's covariance along the
+  directions that worked, so it learns the problem's scaling and
+  correlations as it goes.  This is the (mu/mu_w, lambda) variant with
+  rank-one and rank-mu covariance updates and cumulative step size
+  control, with the default constants from Hansen's CMA-ES tutorial.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_CMAES_H
+#define BATTERY_CMAES_H
+
+#include <math.h>
+#include <string.h>
+
+#define battery_cmaes_max_n 8 /* parameters */
+#define battery_cmaes_max_lambda 64 /* population */
+
+struct battery_cmaes {
+  int n, lambda, mu, generation;
+  double weight[battery_cmaes_max_lambda], mueff;
+  double cc, cs, c1, cmu, damps, chiN; /* learning rates */
+  double mean[battery_cmaes_max_n], sigma; /* distribution: mean + sigma * N(0,C) */
+  double C[battery_cmaes_max_n][battery_cmaes_max_n];
+  double B[battery_cmaes_max_n][battery_cmaes_max_n], D[battery_cmaes_max_n]; /* C=B diag(D^2) B' */
+  double pc[battery_cmaes_max_n], ps[battery_cmaes_max_n]; /* evolution paths */
+  unsigned long long rng;
+  double best[battery_cmaes_max_n], best_f; /* best point seen */
+};
+
+/* Uniform random number in (0,1) (xorshift64*) */
+static inline double battery_cmaes_uniform(struct battery_cmaes *es)
+{
+  es->rng^=es->rng>>12; es->rng^=es->rng<<25; es->rng^=es->rng>>27;
+  return ((es->rng*2685821657736338717ULL>>11)+0.5)*(1.0/9007199254740992.0);
+}
+
+/* Standard normal random number (Box-Muller) */
+static inline double battery_cmaes_normal(struct battery_cmaes *es)
+{
+  return sqrt(-2.0*log(battery_cmaes_uniform(es)))*cos(2.0*M_PI*battery_cmaes_uniform(es));
+}
+
+/* Start searching n parameters around x0, with step size sigma in every
+   direction and this population size (0 for the default 4+3 ln n). */
+void battery_cmaes_init(struct battery_cmaes *es,int n,const double *x0,double sigma,int lambda,unsigned long long seed)
+{
+  memset(es,0,sizeof(*es));
+  if (n>battery_cmaes_max_n) n=battery_cmaes_max_n;
+  if (lambda<=0) lambda=4+(int)(3.0*log((double)n));
+  if (lambda>battery_cmaes_max_lambda) lambda=battery_cmaes_max_lambda;
+  if (lambda<2) lambda=2;
+  es->n=n;
+  es->lambda=lambda;
+  es->mu=lambda/2;
+  double sum=0, sum_sq=0;
+  for (int i=0;i<es->mu;i++) {
+    es->weight[i]=log(es->mu+0.5)-log(i+1.0);
+    sum+=es->weight[i];
+  }
+  for (int i=0;i<es->mu;i++) { es->weight[i]/=sum; sum_sq+=es->weight[i]*es->weight[i]; }
+  es->mueff=1.0/sum_sq;
+  es->cc=(4.0+es->mueff/n)/(n+4.0+2.0*es->mueff/n);
+  es->cs=(es->mueff+2.0)/(n+es->mueff+5.0);
+  es->c1=2.0/((n+1.3)*(n+1.3)+es->mueff);
+  es->cmu=fmin(1.0-es->c1,2.0*(es->mueff-2.0+1.0/es->mueff)/((n+2.0)*(n+2.0)+es->mueff));
+  es->damps=1.0+2.0*fmax(0.0,sqrt((es->mueff-1.0)/(n+1.0))-1.0)+es->cs;
+  es->chiN=sqrt((double)n)*(1.0-1.0/(4.0*n)+1.0/(21.0*n*n));
+  for (int i=0;i<n;i++) {
+    es->mean[i]=es->best[i]=x0[i];
+    es->C[i][i]=es->B[i][i]=es->D[i]=1.0;
+  }
+  es->sigma=sigma;
+  es->best_f=INFINITY;
+  es->rng=seed?seed:0x9E3779B97F4A7C15ULL;
+}
+
+/* Sample the next generation: lambda points of n values each, into x */
+void battery_cmaes_sample(struct battery_cmaes *es,double *x)
+{
+  int n=es->n;
+  for (int k=0;k<es->lambda;k++) {
+    double z[battery_cmaes_max_n];
+    for (int i=0;i<n;i++) z[i]=es->D[i]*battery_cmaes_normal(es);
+    for (int i=0;i<n;i++) {
+      double y=0;
+      for (int j=0;j<n;j++) y+=es->B[i][j]*z[j];
+      x[k*n+i]=es->mean[i]+es->sigma*y;
+    }
+  }
+}
+
+/* Eigenvectors B and square root eigenvalues D of C, by Jacobi rotations */
+void battery_cmaes_eigen(struct battery_cmaes *es)
+{
+  int n=es->n;
+  double A[battery_cmaes_max_n][battery_cmaes_max_n];
+  memcpy(A,es->C,sizeof(A));
+  for (int i=0;i<n;i++)
+    for (int j=0;j<n;j++) es->B[i][j]=i==j;
+  for (int sweep=0;sweep<50;sweep++) {
+    double off=0;
+    for (int p=0;p<n;p++)
+      for (int q=p+1;q<n;q++) off+=A[p][q]*A[p][q];
+    if (off<1.0e-30) break;
+    for (int p=0;p<n;p++)
+      for (int q=p+1;q<n;q++) {
+        if (A[p][q]==0.0) continue;
+        double theta=(A[q][q]-A[p][p])/(2.0*A[p][q]);
+        double t=(theta>=0?1.0:-1.0)/(fabs(theta)+sqrt(theta*theta+1.0));
+        double c=1.0/sqrt(t*t+1.0), s=t*c;
+        for (int k=0;k<n;k++) { // A=J' A J
+          double akp=A[k][p], akq=A[k][q];
+          A[k][p]=c*akp-s*akq;
+          A[k][q]=s*akp+c*akq;
+        }
+        for (int k=0;k<n;k++) {
+          double apk=A[p][k], aqk=A[q][k];
+          A[p][k]=c*apk-s*aqk;
+          A[q][k]=s*apk+c*aqk;
+        }
+        for (int k=0;k<n;k++) {
+          double bkp=es->B[k][p], bkq=es->B[k][q];
+          es->B[k][p]=c*bkp-s*bkq;
+          es->B[k][q]=s*bkp+c*bkq;
+        }
+      }
+  }
+  for (int i=0;i<n;i++) es->D[i]=sqrt(fmax(A[i][i],1.0e-20));
+}
+
+/* Update the distribution from the scores f (lower is better) of the
+   points x that battery_cmaes_sample returned.  Non-finite scores rank last. */
+void battery_cmaes_update(struct battery_cmaes *es,const double *x,const double *f)
+{
+  int n=es->n, order[battery_cmaes_max_lambda];
+  for (int k=0;k<es->lambda;k++) { // insertion sort by score
+    int j=k;
+    while (j>0 && (isfinite(f[k]) && (!isfinite(f[order[j-1]]) || f[k]<f[order[j-1]]))) { order[j]=order[j-1]; j--; }
+    order[j]=k;
+  }
+  if (isfinite(f[order[0]]) && f[order[0]]<es->best_f) {
+    es->best_f=f[order[0]];
+    memcpy(es->best,&x[order[0]*n],n*sizeof(double));
+  }
+
+  // steps of the best mu, in units of sigma, and their weighted mean
+  double y[battery_cmaes_max_lambda][battery_cmaes_max_n], yw[battery_cmaes_max_n];
+  for (int i=0;i<n;i++) yw[i]=0;
+  for (int k=0;k<es->mu;k++)
+    for (int i=0;i<n;i++) {
+      y[k][i]=(x[order[k]*n+i]-es->mean[i])/es->sigma;
+      yw[i]+=es->weight[k]*y[k][i];
+    }
+  for (int i=0;i<n;i++) es->mean[i]+=es->sigma*yw[i];
+
+  // step size path, through C^-1/2 = B diag(1/D) B'
+  double t[battery_cmaes_max_n], ps_len=0;
+  for (int j=0;j<n;j++) {
+    double v=0;
+    for (int i=0;i<n;i++) v+=es->B[i][j]*yw[i];
+    t[j]=v/es->D[j];
+  }
+  double a=sqrt(es->cs*(2.0-es->cs)*es->mueff);
+  for (int i=0;i<n;i++) {
+    double v=0;
+    for (int j=0;j<n;j++) v+=es->B[i][j]*t[j];
+    es->ps[i]=(1.0-es->cs)*es->ps[i]+a*v;
+    ps_len+=es->ps[i]*es->ps[i];
+  }
+  ps_len=sqrt(ps_len);
+  es->generation++;
+  int hsig=ps_len/sqrt(1.0-pow(1.0-es->cs,2.0*es->generation))/es->chiN < 1.4+2.0/(n+1.0);
+
+  // covariance: rank-one update from the evolution path, rank-mu from the best steps
+  double b=sqrt(es->cc*(2.0-es->cc)*es->mueff);
+  for (int i=0;i<n;i++) es->pc[i]=(1.0-es->cc)*es->pc[i]+(hsig?b*yw[i]:0.0);
+  double lost=(1.0-hsig)*es->cc*(2.0-es->cc);
+  for (int i=0;i<n;i++)
+    for (int j=0;j<n;j++) {
+      double rank_mu=0;
+      for (int k=0;k<es->mu;k++) rank_mu+=es->weight[k]*y[k][i]*y[k][j];
+      es->C[i][j]=(1.0-es->c1-es->cmu)*es->C[i][j]
+        +es->c1*(es->pc[i]*es->pc[j]+lost*es->C[i][j])
+        +es->cmu*rank_mu;
+    }
+  es->sigma*=exp((es->cs/es->damps)*(ps_len/es->chiN-1.0));
+  battery_cmaes_eigen(es);
+}
+
+#endif
@@ -0,0 +1,197 @@
+/**
+  Extended Kalman filter for the state of charge of many cells at once.
+
+  The process model is the cell model itself: SOC falls by the coulombs
+  drawn, and C1's charge relaxes through R1 toward amps*R1*C1,
+      SOC' = SOC - amps*dt/capacity
+      C1Q' = amps*tau + (C1Q - amps*tau)*exp(-dt/tau),  tau = R1*C1
+  (the exact step for current held over dt, so any dt is stable), and the
+  measurement is the terminal voltage
+      V = Em(SOC,T) - C1Q/C1 - R0*amps
+  with the parameters interpolated from the tables like
+  battery_model_get_parameters.  The filter state is (SOC, C1Q) with a
+  2x2 covariance.  The measurement's Jacobian needs dEm/dSOC, which
+  within a table cell is the slope of Em along the SOC segment,
+  interpolated in temperature, so the slopes are precomputed with the
+  tables into one interleaved lookup of five values per node.  The
+  Jacobian leaves out how R0 and C1 change with SOC; they move the
+  voltage much less than Em does.
+
+  Cells are stored as a structure of arrays, and one call steps every
+  cell through one sample: a pack controller or fleet backend updates all
+  of its cells each second with one call.  Each cell does one table
+  lookup per step: the update's parameters also give the next predict's
+  R1*C1.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_EKF_H
+#define BATTERY_EKF_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "battery_replay.h"
+
+/* Values interleaved per table node: the replay's four parameters, then Em's slope */
+#define battery_ekf_slope battery_replay_params
+#define battery_ekf_values (battery_replay_params+1)
+
+/* Parameter tables, with dEm/dSOC of the SOC segment starting at each node */
+struct battery_ekf_tables {
+  float v[battery_model_table_temps][battery_model_table_SOCs][battery_ekf_values];
+  float inv_spacing[battery_model_table_temps];
+};
+
+/* Noise and starting estimate */
+struct battery_ekf_config {
+  float SOC;         /* initial estimate */
+  float SOC_sigma;   /* its standard deviation */
+  float SOC_noise;   /* process noise: SOC random walk per sqrt(second), e.g. current sensor error */
+  float C1Q_noise;   /* process noise: C1 charge random walk per sqrt(second) (coulombs) */
+  float volts_noise; /* measurement noise and model error, per cell (volts) */
+};
+
+/* Defaults: a cell that may be anywhere from empty to full, and about
+   the model's voltage error on the warmer tests */
+void battery_ekf_config_init(struct battery_ekf_config *c)
+{
+  c->SOC=0.5f;
+  c->SOC_sigma=0.5f;
+  c->SOC_noise=1.0e-4f;
+  c->C1Q_noise=0.01f;
+  c->volts_noise=0.05f;
+}
+
+/* Every cell's filter state, as a structure of arrays */
+struct battery_ekf {
+  int n;
+  const struct battery_ekf_tables *tables;
+  float SOC_var_rate, C1Q_var_rate, volts_var; /* noise variances */
+  float *SOC, *C1Q;             /* state estimates */
+  float *P_SS, *P_SQ, *P_QQ;    /* covariance of (SOC, C1Q) */
+  float *tau;                   /* R1*C1 at the last update */
+  float *last_amps;             /* current since the last update */
+  float *inv_capacity;          /* 1/amp-seconds */
+  float *mem;
+};
+
+/* Interleave these tables with Em's slopes */
+void battery_ekf_tables_init(struct battery_ekf_tables *e,const struct battery_replay_lut *lut)
+{
+  for (int t=0;t<battery_model_table_temps;t++)
+    for (int s=0;s<battery_model_table_SOCs;s++) {
+      for (int p=0;p<battery_replay_params;p++) e->v[t][s][p]=lut->v[t][s][p];
+      e->v[t][s][battery_ekf_slope]=s+1<battery_model_table_SOCs
+        ?(lut->v[t][s+1][battery_replay_Em]-lut->v[t][s][battery_replay_Em])*(battery_model_table_SOCs-1)
+        :0.0f; // the lookup clamps at SOC 1
+    }
+  memcpy(e->inv_spacing,lut->inv_spacing,sizeof(e->inv_spacing));
+}
+
+/* Look up the four parameters, and dEm/dSOC, at this SOC and temperature.
+   If slope isn't 0 it gets all four parameters' slopes along SOC too. */
+static inline void battery_ekf_lookup(const struct battery_ekf_tables *e,float SOC,float cellT,
+  float *param,float *slope)
+{
+  float SOC_number=SOC*(battery_model_table_SOCs-1);
+  if (!(SOC_number>0.0f)) SOC_number=0.0f;
+  if (SOC_number>battery_model_table_SOCs-1) SOC_number=battery_model_table_SOCs-1;
+  int s0=(int)SOC_number, s1=s0+1<battery_model_table_SOCs?s0+1:s0;
+  float s=SOC_number-s0;
+  int t0=0;
+  while (t0+1<battery_model_table_temps && battery_model_temperatures[t0+1]<=cellT) t0++;
+  int t1=t0+1<battery_model_table_temps?t0+1:t0;
+  float t=t1>t0?(cellT-battery_model_temperatures[t0])*e->inv_spacing[t0]:0.0f;
+  const float *II=e->v[t0][s0], *IN=e->v[t0][s1], *TI=e->v[t1][s0], *TN=e->v[t1][s1];
+  for (int k=0;k<battery_replay_params;k++) {
+    float lo=IN[k]-II[k], hi=TN[k]-TI[k];
+    float I=II[k]+lo*s, T=TI[k]+hi*s;
+    param[k]=I+(T-I)*t;
+    if (slope) slope[k]=(lo+(hi-lo)*t)*(battery_model_table_SOCs-1);
+  }
+  // the slope is constant along the SOC segment: interpolate in temperature only
+  param[battery_ekf_slope]=II[battery_ekf_slope]+(TI[battery_ekf_slope]-II[battery_ekf_slope])*t;
+}
+
+/* Set up filters for n cells of capacityAh amp hours each, with C1 at
+   rest.  Returns 0, or -1 if out of memory. */
+int battery_ekf_init(struct battery_ekf *f,int n,const struct battery_ekf_tables *tables,
+  float capacityAh,const struct battery_ekf_config *config)
+{
+  memset(f,0,sizeof(*f));
+  f->mem=(float *)malloc((size_t)8*(n>0?n:1)*sizeof(float));
+  if (!f->mem) return -1;
+  f->n=n;
+  f->tables=tables;
+  f->SOC_var_rate=config->SOC_noise*config->SOC_noise;
+  f->C1Q_var_rate=config->C1Q_noise*config->C1Q_noise;
+  f->volts_var=config->volts_noise*config->volts_noise;
+  float *p=f->mem;
+  f->SOC=p; p+=n;
+  f->C1Q=p; p+=n;
+  f->P_SS=p; p+=n;
+  f->P_SQ=p; p+=n;
+  f->P_QQ=p; p+=n;
+  f->tau=p; p+=n;
+  f->last_amps=p; p+=n;
+  f->inv_capacity=p;
+  for (int i=0;i<n;i++) {
+    f->SOC[i]=config->SOC;
+    f->C1Q[i]=0.0f;
+    f->P_SS[i]=config->SOC_sigma*config->SOC_sigma;
+    f->P_SQ[i]=f->P_QQ[i]=0.0f;
+    f->tau[i]=1.0f;
+    f->last_amps[i]=0.0f;
+    f->inv_capacity[i]=1.0f/(capacityAh*3600.0f);
+  }
+  return 0;
+}
+
+void battery_ekf_free(struct battery_ekf *f)
+{
+  free(f->mem);
+  memset(f,0,sizeof(*f));
+}
+
+/* Step every cell dt seconds on from its last measurement (dt=0 for the
+   first), and correct it with these new measurements of current (amps),
+   per-cell voltage and cell temperature (deg C). */
+void battery_ekf_step(struct battery_ekf *f,float dt,
+  const float *restrict amps,const float *restrict volts,const float *restrict tempC)
+{
+  const struct battery_ekf_tables *e=f->tables;
+  float SOC_var=f->SOC_var_rate*dt, C1Q_var=f->C1Q_var_rate*dt, R=f->volts_var;
+  float *restrict SOC=f->SOC, *restrict C1Q=f->C1Q;
+  float *restrict P_SS=f->P_SS, *restrict P_SQ=f->P_SQ, *restrict P_QQ=f->P_QQ;
+  float *restrict tau=f->tau, *restrict last_amps=f->last_amps;
+  const float *restrict inv_capacity=f->inv_capacity;
+  for (int i=0;i<f->n;i++) {
+    // predict: the last current, held for dt
+    float I=last_amps[i], a=expf(-dt/tau[i]), settled=I*tau[i];
+    float S=SOC[i]-I*dt*inv_capacity[i];
+    float Q=settled+(C1Q[i]-settled)*a;
+    float pSS=P_SS[i]+SOC_var, pSQ=P_SQ[i]*a, pQQ=P_QQ[i]*a*a+C1Q_var;
+
+    // update with the measured voltage
+    float param[battery_ekf_values];
+    battery_ekf_lookup(e,S,tempC[i],param,0);
+    float inv_C1=1.0f/param[battery_replay_C1];
+    float err=volts[i]-(param[battery_replay_Em]-Q*inv_C1-param[battery_replay_R0]*amps[i]);
+    float h0=param[battery_ekf_slope], h1=-inv_C1;
+    float PH0=pSS*h0+pSQ*h1, PH1=pSQ*h0+pQQ*h1;
+    float inv_S=1.0f/(h0*PH0+h1*PH1+R);
+    float K0=PH0*inv_S, K1=PH1*inv_S;
+    // past the ends of the tables the voltage says nothing more about SOC
+    S+=K0*err;
+    SOC[i]=S<0.0f?0.0f:S>1.0f?1.0f:S;
+    C1Q[i]=Q+K1*err;
+    P_SS[i]=fmaxf(pSS-K0*PH0,0.0f);
+    P_SQ[i]=pSQ-K0*PH1;
+    P_QQ[i]=fmaxf(pQQ-K1*PH1,0.0f);
+    tau[i]=param[battery_replay_R1]*param[battery_replay_C1];
+    last_amps[i]=amps[i];
+  }
+}
+
+#endif
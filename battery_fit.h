@@ -0,0 +1,526 @@
+/**
+  Fit the model's lookup tables to recorded discharge tests.
+
+  The 264 table entries (Em, R0, R1 and C1 at 6 temperatures x 11 SOCs)
+  are adjusted to minimize the replay voltage error over a set of loaded
+  datasets (battery_validate.h).  The objective is the mean over runs of
+  each run's MSE, so long and short runs count equally.  Normally every
+  row is fit to every run at once, since a test between two table
+  temperatures depends on both rows; battery_fit_select_row instead fits
+  one row to the tests nearest it, as the tables were first calibrated.
+
+  Each iteration takes the gradient of every run by the adjoint method
+  (battery_gradient.h), one run per thread at a time, then a backtracking
+  line search steps downhill.  R0, R1 and C1 must stay positive and span
+  orders of magnitude, so they are fitted as logarithms; Em is fitted in
+  volts.
+
+  battery_fit_lm_iterate instead takes Levenberg-Marquardt steps, from
+  Gauss-Newton normal equations accumulated sparse row by sparse row
+  (battery_jacobian.h).  It usually needs far fewer iterations.
+
+  battery_fit_sweep tries each entry on its own, a step up or down, and
+  keeps steps that help.  Each try only changes one table node, so runs
+  are re-scored from checkpoints (battery_checkpoint.h) rather than from
+  the start.
+
+  battery_fit_difference finds the same gradient by forward differences,
+  one replay of every run per table entry, for checking the adjoint.
+  Those (entry, run) replays are all independent, so they are spread
+  over threads one replay at a time, like every objective evaluation.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_FIT_H
+#define BATTERY_FIT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "battery_replay.h"
+#include "battery_validate.h"
+#include "battery_gradient.h"
+#include "battery_jacobian.h"
+#include "battery_checkpoint.h"
+
+#define battery_fit_entries (battery_replay_params*battery_model_table_temps*battery_model_table_SOCs) /* 264 */
+#define battery_fit_step 1.0e-3 /* forward difference step, in fit coordinates */
+#define battery_fit_tolerance 1.0e-6 /* converged once an iteration improves the objective by less than this fraction */
+
+/* Fitting state */
+struct battery_fit {
+  struct battery_validate *data; /* datasets to fit to */
+  int nrun, *run;  /* the runs of data being fit (indices into data->run) */
+  struct battery_replay_config config; /* thermal constants, held fixed */
+  struct battery_replay_lut lut; /* current tables */
+  unsigned char active[battery_fit_entries]; /* 1 if the entry may change */
+  double objective; /* at lut */
+  double gradient[battery_fit_entries]; /* of objective, in fit coordinates */
+  double rate;      /* last successful line search step length (0 before the first) */
+  double lambda;    /* Levenberg-Marquardt damping */
+  double coordinate[battery_fit_entries]; /* battery_fit_sweep's step for each entry (0 before the first) */
+  long samples;     /* samples replayed by battery_fit_sweep, and ... */
+  long full_samples; /* ... how many full replays would have taken */
+  long replays;     /* run replays done so far */
+  int nthreads;
+};
+
+/* Table entry k, with k=(param*temps+temp)*SOCs+SOC */
+static inline float *battery_fit_entry(struct battery_replay_lut *lut,int k)
+{
+  int s=k%battery_model_table_SOCs, t=(k/battery_model_table_SOCs)%battery_model_table_temps;
+  int p=k/(battery_model_table_SOCs*battery_model_table_temps);
+  return &lut->v[t][s][p];
+}
+
+/* The same entry of a gradient table (battery_gradient.lut) */
+static inline double *battery_fit_entry_in(double g[battery_model_table_temps][battery_model_table_SOCs][battery_replay_params],int k)
+{
+  int s=k%battery_model_table_SOCs, t=(k/battery_model_table_SOCs)%battery_model_table_temps;
+  int p=k/(battery_model_table_SOCs*battery_model_table_temps);
+  return &g[t][s][p];
+}
+
+/* Which parameter (battery_replay_Em..C1) entry k belongs to */
+static inline int battery_fit_param(int k) { return k/(battery_model_table_SOCs*battery_model_table_temps); }
+
+/* Fit coordinate of entry k: volts for Em, log of the value otherwise */
+static inline double battery_fit_get(struct battery_replay_lut *lut,int k)
+{
+  float v=*battery_fit_entry(lut,k);
+  return battery_fit_param(k)==battery_replay_Em?v:log(v);
+}
+
+static inline void battery_fit_set(struct battery_replay_lut *lut,int k,double x)
+{
+  *battery_fit_entry(lut,k)=battery_fit_param(k)==battery_replay_Em?x:exp(x);
+}
+
+
+/********* Parallel objective ***********/
+
+/* A batch of candidate tables, each replayed over every run */
+struct battery_fit_batch {
+  struct battery_fit *fit;
+  const struct battery_replay_lut *lut; /* ncandidate tables */
+  int ncandidate;
+  double *mse; /* [candidate*nrun+run] */
+  int next; /* next (candidate, run) pair to claim (atomic) */
+};
+
+void *battery_fit_worker(void *arg)
+{
+  struct battery_fit_batch *b=(struct battery_fit_batch *)arg;
+  struct battery_fit *fit=b->fit;
+  int total=b->ncandidate*fit->nrun, i;
+  while ((i=__atomic_fetch_add(&b->next,1,__ATOMIC_RELAXED))<total) {
+    int c=i/fit->nrun, r=fit->run[i%fit->nrun];
+    const struct battery_log *log=fit->data->run[r].log;
+    struct battery_replay_config config;
+    battery_validate_run_config(fit->data,r,&fit->config,&config);
+    struct battery_replay replay;
+    struct battery_score score;
+    battery_replay_start(&replay,&b->lut[c],&config,&log->info);
+    battery_score_init(&score,&fit->data->bands);
+    battery_replay_run(&replay,log->col[battery_log_time],log->col[battery_log_amps],
+      log->col[battery_log_tempC],log->col[battery_log_cellV],log->n,0,0,&score);
+    b->mse[i]=battery_score_mse(&score.all);
+  }
+  return 0;
+}
+
+/* Evaluate the objective for each of these candidate tables */
+void battery_fit_evaluate(struct battery_fit *fit,const struct battery_replay_lut *lut,int ncandidate,double *objective)
+{
+  struct battery_fit_batch b={fit,lut,ncandidate,0,0};
+  b.mse=(double *)malloc((ncandidate*fit->nrun>0?ncandidate*fit->nrun:1)*sizeof(double));
+  int nthreads=battery_validate_threads(fit->nthreads,ncandidate*fit->nrun);
+  pthread_t thread[nthreads];
+  for (int t=1;t<nthreads;t++) pthread_create(&thread[t],0,battery_fit_worker,&b);
+  battery_fit_worker(&b);
+  for (int t=1;t<nthreads;t++) pthread_join(thread[t],0);
+  for (int c=0;c<ncandidate;c++) {
+    double sum=0;
+    for (int r=0;r<fit->nrun;r++) sum+=b.mse[c*fit->nrun+r];
+    objective[c]=fit->nrun?sum/fit->nrun:0.0;
+  }
+  fit->replays+=(long)ncandidate*fit->nrun;
+  free(b.mse);
+}
+
+
+/********* Fitting ***********/
+
+/* Start fitting these tables to every run of these datasets, with every entry active */
+void battery_fit_init(struct battery_fit *fit,struct battery_validate *data,
+  const struct battery_replay_lut *lut,const struct battery_replay_config *config,int nthreads)
+{
+  memset(fit,0,sizeof(*fit));
+  fit->data=data;
+  fit->lut=*lut;
+  fit->config=*config;
+  fit->nthreads=nthreads;
+  memset(fit->active,1,sizeof(fit->active));
+  fit->lambda=1.0e-3;
+  fit->run=(int *)malloc((data->nrun>0?data->nrun:1)*sizeof(int));
+  fit->nrun=data->nrun;
+  for (int r=0;r<data->nrun;r++) fit->run[r]=r;
+  battery_fit_evaluate(fit,&fit->lut,1,&fit->objective);
+}
+
+/* Go back to fitting every entry to every run */
+void battery_fit_select_all(struct battery_fit *fit)
+{
+  memset(fit->active,1,sizeof(fit->active));
+  fit->nrun=fit->data->nrun;
+  for (int r=0;r<fit->nrun;r++) fit->run[r]=r;
+  fit->rate=0.0;
+  fit->lambda=1.0e-3;
+  battery_fit_evaluate(fit,&fit->lut,1,&fit->objective);
+}
+
+void battery_fit_free(struct battery_fit *fit)
+{
+  free(fit->run);
+  fit->run=0;
+  fit->nrun=0;
+}
+
+/* Table row nearest this temperature (deg C) */
+int battery_fit_nearest_row(float tempC)
+{
+  int best=0;
+  for (int t=1;t<battery_model_table_temps;t++)
+    if (fabsf(battery_model_temperatures[t]-tempC)<fabsf(battery_model_temperatures[best]-tempC)) best=t;
+  return best;
+}
+
+/* Fit only table row t, to only the runs of tests nearer that row's
+   temperature than any other, the way the tables were first calibrated.
+   Returns the number of runs selected. */
+int battery_fit_select_row(struct battery_fit *fit,int t)
+{
+  struct battery_validate *v=fit->data;
+  for (int k=0;k<battery_fit_entries;k++)
+    fit->active[k]=(k/battery_model_table_SOCs)%battery_model_table_temps==t;
+  fit->nrun=0;
+  for (int r=0;r<v->nrun;r++) {
+    float tempC=v->dataset[v->run[r].dataset].entry.tempC;
+    if (tempC==tempC && battery_fit_nearest_row(tempC)==t) fit->run[fit->nrun++]=r;
+  }
+  fit->rate=0.0;
+  fit->lambda=1.0e-3;
+  battery_fit_evaluate(fit,&fit->lut,1,&fit->objective);
+  return fit->nrun;
+}
+
+/* Gradient of each run, by the adjoint method */
+struct battery_fit_runs {
+  struct battery_fit *fit;
+  struct battery_gradient *gradient; /* per fitted run */
+  int failed;
+  int next; /* next run to claim (atomic) */
+};
+
+void *battery_fit_gradient_worker(void *arg)
+{
+  struct battery_fit_runs *w=(struct battery_fit_runs *)arg;
+  struct battery_fit *fit=w->fit;
+  int r;
+  while ((r=__atomic_fetch_add(&w->next,1,__ATOMIC_RELAXED))<fit->nrun) {
+    struct battery_replay_config config;
+    battery_validate_run_config(fit->data,fit->run[r],&fit->config,&config);
+    battery_gradient_init(&w->gradient[r]);
+    if (battery_gradient_run(&w->gradient[r],&fit->lut,&config,fit->data->run[fit->run[r]].log)!=0)
+      __atomic_store_n(&w->failed,1,__ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+/* Gradient of the objective at fit->lut, in fit coordinates.
+   Returns 0, or -1 if a run couldn't be differentiated. */
+int battery_fit_gradient(struct battery_fit *fit)
+{
+  struct battery_fit_runs w={fit,0,0,0};
+  w.gradient=(struct battery_gradient *)malloc((fit->nrun>0?fit->nrun:1)*sizeof(struct battery_gradient));
+  int nthreads=battery_validate_threads(fit->nthreads,fit->nrun);
+  pthread_t thread[nthreads];
+  for (int t=1;t<nthreads;t++) pthread_create(&thread[t],0,battery_fit_gradient_worker,&w);
+  battery_fit_gradient_worker(&w);
+  for (int t=1;t<nthreads;t++) pthread_join(thread[t],0);
+  fit->replays+=fit->nrun;
+
+  // objective is the mean of each run's sum_sq/n
+  for (int k=0;k<battery_fit_entries;k++) {
+    double sum=0;
+    if (fit->active[k])
+      for (int r=0;r<fit->nrun;r++)
+        if (w.gradient[r].error.n) sum+=*battery_fit_entry_in(w.gradient[r].lut,k)/w.gradient[r].error.n;
+    double g=fit->nrun?sum/fit->nrun:0.0;
+    if (battery_fit_param(k)!=battery_replay_Em) g*=*battery_fit_entry(&fit->lut,k); // d/d log(x) = x d/dx
+    fit->gradient[k]=isfinite(g)?g:0.0;
+  }
+  free(w.gradient);
+  return w.failed?-1:0;
+}
+
+/* Forward difference gradient of the objective at fit->lut, in fit coordinates */
+void battery_fit_difference(struct battery_fit *fit,double *gradient)
+{
+  int map[battery_fit_entries], n=0;
+  for (int k=0;k<battery_fit_entries;k++) {
+    gradient[k]=0.0;
+    if (fit->active[k]) map[n++]=k;
+  }
+  struct battery_replay_lut *lut=(struct battery_replay_lut *)calloc(n>0?n:1,sizeof(struct battery_replay_lut));
+  double *objective=(double *)malloc((n>0?n:1)*sizeof(double));
+  for (int i=0;i<n;i++) {
+    lut[i]=fit->lut;
+    battery_fit_set(&lut[i],map[i],battery_fit_get(&fit->lut,map[i])+battery_fit_step);
+  }
+  battery_fit_evaluate(fit,lut,n,objective);
+  for (int i=0;i<n;i++) {
+    double g=(objective[i]-fit->objective)/battery_fit_step;
+    gradient[map[i]]=isfinite(g)?g:0.0;
+  }
+  free(objective);
+  free(lut);
+}
+
+/* Tables one step of this length along -gradient from fit->lut */
+void battery_fit_move(const struct battery_fit *fit,double rate,struct battery_replay_lut *out)
+{
+  *out=fit->lut;
+  for (int k=0;k<battery_fit_entries;k++)
+    if (fit->active[k] && fit->gradient[k]!=0.0) {
+      struct battery_replay_lut *lut=(struct battery_replay_lut *)&fit->lut;
+      battery_fit_set(out,k,battery_fit_get(lut,k)-rate*fit->gradient[k]);
+    }
+}
+
+/* One iteration: take the gradient, then backtrack along it until the
+   objective drops enough (Armijo condition).  Returns 1 if it improved,
+   0 if no step along the gradient helps (converged) or there wasn't
+   memory to take the gradient. */
+int battery_fit_iterate(struct battery_fit *fit)
+{
+  if (battery_fit_gradient(fit)!=0) return 0;
+  double g2=0, gmax=0;
+  for (int k=0;k<battery_fit_entries;k++) {
+    g2+=fit->gradient[k]*fit->gradient[k];
+    if (fabs(fit->gradient[k])>gmax) gmax=fabs(fit->gradient[k]);
+  }
+  if (g2==0.0) return 0;
+  double rate=fit->rate*2.0; // try a longer step than last time worked
+  if (fit->rate==0.0) rate=0.1/gmax; // first step: move the steepest entry by 0.1
+  for (int tries=0;tries<40;tries++,rate*=0.5) {
+    struct battery_replay_lut trial;
+    double objective;
+    battery_fit_move(fit,rate,&trial);
+    battery_fit_evaluate(fit,&trial,1,&objective);
+    if (objective<=fit->objective-1.0e-4*rate*g2) {
+      fit->lut=trial;
+      fit->objective=objective;
+      fit->rate=rate;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Normal equations, accumulated by each thread into its own copy */
+struct battery_fit_normal {
+  struct battery_fit *fit;
+  int next; /* next run to claim (atomic) */
+};
+
+void *battery_fit_normal_worker(void *arg)
+{
+  struct battery_fit_normal *w=(struct battery_fit_normal *)arg;
+  struct battery_fit *fit=w->fit;
+  struct battery_jacobian *j=(struct battery_jacobian *)malloc(sizeof(struct battery_jacobian));
+  struct battery_jacobian_work *work=(struct battery_jacobian_work *)calloc(1,sizeof(struct battery_jacobian_work));
+  if (!j || !work) { free(j); free(work); return 0; }
+  battery_jacobian_init(j);
+  int r;
+  while ((r=__atomic_fetch_add(&w->next,1,__ATOMIC_RELAXED))<fit->nrun) {
+    const struct battery_log *log=fit->data->run[fit->run[r]].log;
+    struct battery_replay_config config;
+    battery_validate_run_config(fit->data,fit->run[r],&fit->config,&config);
+    if (log->n>0) // objective is the mean of each run's sum_sq/n
+      battery_jacobian_run(j,work,&fit->lut,&config,log,1.0/((double)fit->nrun*log->n));
+  }
+  free(work);
+  return j;
+}
+
+/* One Levenberg-Marquardt iteration: accumulate the normal equations
+   at fit->lut, then solve for damped Gauss-Newton steps, raising the
+   damping until a step lowers the objective.  Each thread claims whole
+   runs and sums them into its own J'J, and the threads' sums are added
+   once at the end, so all temperature rows are solved together at the
+   cost of one pass over the data.
+   Returns 1 if it improved, 0 if no damping helps (converged) or there
+   wasn't memory. */
+int battery_fit_lm_iterate(struct battery_fit *fit)
+{
+  struct battery_fit_normal w={fit,0};
+  int nthreads=battery_validate_threads(fit->nthreads,fit->nrun);
+  pthread_t thread[nthreads];
+  for (int t=1;t<nthreads;t++) pthread_create(&thread[t],0,battery_fit_normal_worker,&w);
+  struct battery_jacobian *j=(struct battery_jacobian *)battery_fit_normal_worker(&w);
+  int failed=!j;
+  for (int t=1;t<nthreads;t++) {
+    void *part;
+    pthread_join(thread[t],&part);
+    if (!part) { failed=1; continue; }
+    if (j) battery_jacobian_merge(j,(struct battery_jacobian *)part);
+    free(part);
+  }
+  fit->replays+=fit->nrun;
+  if (failed) { free(j); return 0; }
+
+  // into fit coordinates: d/d log(x) = x d/dx
+  double D[battery_fit_entries], x[battery_fit_entries], step[battery_fit_entries];
+  for (int k=0;k<battery_fit_entries;k++) {
+    D[k]=battery_fit_param(k)==battery_replay_Em?1.0:*battery_fit_entry(&fit->lut,k);
+    if (!fit->active[k]) D[k]=0.0;
+    x[k]=battery_fit_get(&fit->lut,k);
+  }
+  for (int a=0;a<battery_fit_entries;a++) {
+    for (int b=0;b<battery_fit_entries;b++) j->JTJ[a][b]*=D[a]*D[b];
+    j->JTr[a]*=D[a];
+    fit->gradient[a]=2.0*j->JTr[a];
+  }
+
+  int improved=0;
+  while (!improved && fit->lambda<1.0e10) {
+    if (battery_jacobian_solve((const double (*)[battery_jacobian_entries])j->JTJ,j->JTr,fit->lambda,step,battery_fit_entries)==0) {
+      struct battery_replay_lut trial=fit->lut;
+      for (int k=0;k<battery_fit_entries;k++)
+        if (D[k]!=0.0 && step[k]!=0.0) battery_fit_set(&trial,k,x[k]-step[k]);
+      double objective;
+      battery_fit_evaluate(fit,&trial,1,&objective);
+      if (objective<fit->objective) {
+        fit->lut=trial;
+        fit->objective=objective;
+        fit->lambda*=0.3;
+        improved=1;
+        break;
+      }
+    }
+    fit->lambda*=4.0;
+  }
+  free(j);
+  return improved;
+}
+
+/* Checkpointed runs, scored or re-recorded in parallel */
+struct battery_fit_checkpoints {
+  struct battery_fit *fit;
+  struct battery_checkpoint_run *run; /* per fitted run */
+  const struct battery_replay_lut *lut;
+  const struct battery_checkpoint_edit *edit; /* 0 to record from scratch */
+  int update;  /* 1 to re-record after keeping an edit */
+  double *mse; /* per fitted run (evaluating) */
+  long samples; /* replayed (atomic) */
+  int next; /* next run to claim (atomic) */
+};
+
+void *battery_fit_checkpoint_worker(void *arg)
+{
+  struct battery_fit_checkpoints *w=(struct battery_fit_checkpoints *)arg;
+  struct battery_fit *fit=w->fit;
+  int r;
+  while ((r=__atomic_fetch_add(&w->next,1,__ATOMIC_RELAXED))<fit->nrun) {
+    struct battery_checkpoint_run *cr=&w->run[r];
+    struct battery_replay_config config;
+    battery_validate_run_config(fit->data,fit->run[r],&fit->config,&config);
+    if (!w->edit) battery_checkpoint_record(cr,w->lut,&config,&fit->data->bands);
+    else if (w->update) battery_checkpoint_update(cr,w->lut,&config,w->edit);
+    else {
+      struct battery_score score;
+      long n=battery_checkpoint_evaluate(cr,w->lut,w->edit,&score);
+      __atomic_fetch_add(&w->samples,n,__ATOMIC_RELAXED);
+      w->mse[r]=battery_score_mse(&score.all);
+    }
+  }
+  return 0;
+}
+
+void battery_fit_checkpoints(struct battery_fit_checkpoints *w)
+{
+  w->next=0;
+  int nthreads=battery_validate_threads(w->fit->nthreads,w->fit->nrun);
+  pthread_t thread[nthreads];
+  for (int t=1;t<nthreads;t++) pthread_create(&thread[t],0,battery_fit_checkpoint_worker,w);
+  battery_fit_checkpoint_worker(w);
+  for (int t=1;t<nthreads;t++) pthread_join(thread[t],0);
+}
+
+/* One coordinate descent sweep: for each active entry, try a step up,
+   then down, keeping the first that lowers the objective and doubling
+   that entry's step, or halving the step if neither helps.
+   Returns the number of steps kept, or -1 if there wasn't memory. */
+int battery_fit_sweep(struct battery_fit *fit)
+{
+  struct battery_fit_checkpoints w;
+  memset(&w,0,sizeof(w));
+  w.fit=fit;
+  w.run=(struct battery_checkpoint_run *)calloc(fit->nrun>0?fit->nrun:1,sizeof(struct battery_checkpoint_run));
+  w.mse=(double *)malloc((fit->nrun>0?fit->nrun:1)*sizeof(double));
+  int err=!w.run || !w.mse;
+  long run_samples=0;
+  for (int r=0;r<fit->nrun && !err;r++) {
+    const struct battery_log *log=fit->data->run[fit->run[r]].log;
+    if (battery_checkpoint_init(&w.run[r],log)!=0) err=1;
+    run_samples+=log->n;
+  }
+  int kept=0;
+  if (!err) {
+    w.lut=&fit->lut;
+    battery_fit_checkpoints(&w);
+    fit->replays+=fit->nrun;
+  }
+  for (int k=0;k<battery_fit_entries && !err;k++) {
+    if (!fit->active[k]) continue;
+    if (fit->coordinate[k]==0.0) fit->coordinate[k]=battery_fit_param(k)==battery_replay_Em?0.01:0.05; // 10 mV, 5%
+    struct battery_checkpoint_edit edit;
+    memset(&edit,0,sizeof(edit));
+    edit.node[(k/battery_model_table_SOCs)%battery_model_table_temps][k%battery_model_table_SOCs]=1;
+    double x=battery_fit_get(&fit->lut,k);
+    int improved=0;
+    for (int dir=1;dir>=-1 && !improved;dir-=2) {
+      struct battery_replay_lut trial=fit->lut;
+      battery_fit_set(&trial,k,x+dir*fit->coordinate[k]);
+      w.lut=&trial;
+      w.edit=&edit;
+      w.update=0;
+      w.samples=0;
+      battery_fit_checkpoints(&w);
+      fit->samples+=w.samples;
+      fit->full_samples+=run_samples;
+      double sum=0;
+      for (int r=0;r<fit->nrun;r++) sum+=w.mse[r];
+      double objective=fit->nrun?sum/fit->nrun:0.0;
+      if (objective<fit->objective) {
+        fit->lut=trial;
+        fit->objective=objective;
+        w.lut=&fit->lut;
+        w.update=1;
+        battery_fit_checkpoints(&w);
+        improved=1;
+      }
+    }
+    fit->coordinate[k]*=improved?2.0:0.5;
+    kept+=improved;
+  }
+  for (int r=0;r<fit->nrun && w.run;r++) battery_checkpoint_free(&w.run[r]);
+  free(w.run);
+  free(w.mse);
+  return err?-1:kept;
+}
+
+#endif
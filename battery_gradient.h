@@ -0,0 +1,203 @@
+/**
+  Gradient of a run's replay error with respect to every parameter table
+  entry and thermal constant, by reverse-mode (adjoint) differentiation.
+
+  Finite differences need one replay per table entry.  The adjoint gets
+  all 264 table derivatives and the 5 thermal ones from one replay plus
+  one backward sweep, because only two pieces of model state depend on
+  the parameters: the charge on C1 and the cell temperature.  SOC is set
+  by the logged current alone.  So the sweep carries just two adjoints
+  back through time, through battery_model_voltage (V=Em-C1Q/C1-R0*I),
+  battery_model_electrical (C1 charge and heat), battery_model_thermal
+  and the bilinear table lookup, which scatters each sample's parameter
+  adjoints onto its four neighbouring table entries and passes their
+  slope in temperature on to the cell temperature adjoint.
+
+  The forward pass is battery_replay_run itself, fed one sample at a
+  time, so the gradient is of exactly the arithmetic that gets scored.
+  Its states are kept (20 bytes per sample) for the backward sweep.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_GRADIENT_H
+#define BATTERY_GRADIENT_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "battery_log.h"
+#include "battery_replay.h"
+#include "battery_score.h"
+
+/* Thermal constants, in battery_replay_config */
+enum {
+  battery_gradient_specific_heat=0,
+  battery_gradient_mass, /* each run's cell mass, whether from the config or its log */
+  battery_gradient_Rvalue,
+  battery_gradient_area,
+  battery_gradient_heat_volts,
+  battery_gradient_thermals
+};
+
+/* Replay error, and its derivative with respect to each parameter */
+struct battery_gradient {
+  struct battery_score_stats error; /* model minus measured volts */
+  double lut[battery_model_table_temps][battery_model_table_SOCs][battery_replay_params]; /* d error.sum_sq / d table entry */
+  double thermal[battery_gradient_thermals]; /* d error.sum_sq / d constant */
+};
+
+void battery_gradient_init(struct battery_gradient *g)
+{
+  memset(g,0,sizeof(*g));
+}
+
+/* Add src's errors and derivatives into dest */
+void battery_gradient_merge(struct battery_gradient *dest,const struct battery_gradient *src)
+{
+  battery_score_stats_merge(&dest->error,&src->error);
+  double *d=&dest->lut[0][0][0];
+  const double *s=&src->lut[0][0][0];
+  for (unsigned k=0;k<sizeof(dest->lut)/sizeof(double);k++) d[k]+=s[k];
+  for (int k=0;k<battery_gradient_thermals;k++) dest->thermal[k]+=src->thermal[k];
+}
+
+/* The table cell battery_replay_lookup interpolates in: rows t0,t1 and
+   columns s0,s1, with fractions t and s of the way to the next ones. */
+struct battery_gradient_cell {
+  int t0, t1, s0, s1;
+  float t, s;
+};
+
+static inline void battery_gradient_find(const struct battery_replay_lut *lut,
+  float SOC,float cellT,struct battery_gradient_cell *c)
+{
+  float SOC_number=SOC*(battery_model_table_SOCs-1);
+  int SOC_index=(int)SOC_number;
+  if (SOC_number<0) { SOC_number=SOC_index=0; }
+  if (SOC_index>=battery_model_table_SOCs) { SOC_number=SOC_index=battery_model_table_SOCs-1; }
+  c->s0=SOC_index;
+  c->s1=SOC_index+1<battery_model_table_SOCs?SOC_index+1:SOC_index;
+  c->s=SOC_number-SOC_index;
+
+  int T_index=0;
+  while (T_index+1<battery_model_table_temps
+      && battery_model_temperatures[T_index+1]<=cellT)
+      T_index++;
+  c->t0=c->t1=T_index;
+  c->t=0.0f;
+  if (T_index+1<battery_model_table_temps) {
+    c->t=(cellT-battery_model_temperatures[T_index])*lut->inv_spacing[T_index];
+    c->t1=T_index+1;
+  }
+}
+
+/* Replay this run, adding its errors and their gradient into g.
+   Returns 0, or -1 if there isn't memory to keep the run's states. */
+int battery_gradient_run(struct battery_gradient *g,const struct battery_replay_lut *lut,
+  const struct battery_replay_config *config,const struct battery_log *log)
+{
+  int n=log->n;
+  if (n<=0) return 0;
+  const float *time=log->col[battery_log_time], *amps=log->col[battery_log_amps];
+  const float *tempC=log->col[battery_log_tempC], *cellV=log->col[battery_log_cellV];
+  float *state=(float *)malloc(5*(size_t)n*sizeof(float));
+  if (!state) return -1;
+  float *SOC=state, *cellT=state+n, *C1Q=state+2*n, *ambientT=state+3*n, *err=state+4*n;
+
+  // Forward: the ordinary replay, keeping the state after each sample
+  struct battery_replay r;
+  battery_replay_start(&r,lut,config,&log->info);
+  for (int i=0;i<n;i++) {
+    float V;
+    battery_replay_run(&r,time+i,amps+i,tempC+i,cellV+i,1,&V,0,0);
+    SOC[i]=r.battery.SOC;
+    cellT[i]=r.battery.cellT;
+    C1Q[i]=r.battery.C1Q;
+    ambientT[i]=r.ambientT;
+    err[i]=0.0f; // past the model's SOC 0 isn't scored (battery_score_sample)
+    if (SOC[i]>=0.0f) battery_score_stats_add(&g->error,err[i]=V-cellV[i]);
+  }
+
+  // Backward: adjoints of C1Q and cellT at the sample after this one
+  double h=r.inv_heat_capacity, k=r.conductance, heat_volts=r.heat_volts;
+  double adj_C1Q=0, adj_cellT=0, adj_h=0, adj_k=0, adj_volts=0;
+  for (int i=n-1;i>=0;i--) {
+    float param[battery_replay_params];
+    battery_replay_lookup(lut,SOC[i],cellT[i],param);
+    double R0=param[battery_replay_R0], R1=param[battery_replay_R1], C1=param[battery_replay_C1];
+    double I=amps[i], C1V=C1Q[i]/C1, R1I=C1V/R1;
+    double adj_param[battery_replay_params]={0,0,0,0};
+    double adj_C1V=0, next_C1Q=0, next_cellT=0;
+
+    // battery_model_voltage
+    double e2=2.0*err[i];
+    adj_param[battery_replay_Em]+=e2;
+    adj_param[battery_replay_R0]-=e2*I;
+    adj_C1V-=e2;
+
+    if (i+1<n)
+    { // the step to sample i+1, holding this sample's current
+      float dt=time[i+1]-time[i];
+      double heat=(R0*I*I + C1V*R1I + heat_volts*I)*dt;
+      double cool=(cellT[i]-ambientT[i])*k*dt;
+      // battery_model_thermal
+      next_cellT+=adj_cellT*(1.0-k*dt*h);
+      double adj_heat=adj_cellT*h;
+      adj_k-=adj_cellT*h*(cellT[i]-ambientT[i])*dt;
+      adj_h+=adj_cellT*(heat-cool);
+      adj_volts+=adj_heat*I*dt;
+      adj_param[battery_replay_R0]+=adj_heat*I*I*dt;
+      adj_C1V+=adj_heat*2.0*R1I*dt;
+      adj_param[battery_replay_R1]-=adj_heat*R1I*R1I*dt;
+      // battery_model_electrical, explicit or relaxed like the replay
+      float tau=param[battery_replay_R1]*param[battery_replay_C1];
+      if (dt<=tau) {
+        next_C1Q+=adj_C1Q;
+        adj_C1V-=adj_C1Q*dt/R1;
+        adj_param[battery_replay_R1]+=adj_C1Q*R1I/R1*dt;
+      } else {
+        double e=exp(-dt/(double)tau);
+        next_C1Q+=adj_C1Q*e;
+        double adj_tau=adj_C1Q*(I*(1.0-e) + (C1Q[i]-I*tau)*e*dt/((double)tau*tau));
+        adj_param[battery_replay_R1]+=adj_tau*C1;
+        adj_param[battery_replay_C1]+=adj_tau*R1;
+      }
+    }
+    // C1V=C1Q/C1
+    next_C1Q+=adj_C1V/C1;
+    adj_param[battery_replay_C1]-=adj_C1V*C1V/C1;
+
+    // battery_replay_lookup: scatter onto the four table entries, and
+    // pass the slope in temperature on to the cell temperature
+    struct battery_gradient_cell c;
+    battery_gradient_find(lut,SOC[i],cellT[i],&c);
+    double s=c.s, t=c.t;
+    double w00=(1-s)*(1-t), w01=s*(1-t), w10=(1-s)*t, w11=s*t;
+    for (int p=0;p<battery_replay_params;p++) {
+      double a=adj_param[p];
+      g->lut[c.t0][c.s0][p]+=a*w00;
+      g->lut[c.t0][c.s1][p]+=a*w01;
+      g->lut[c.t1][c.s0][p]+=a*w10;
+      g->lut[c.t1][c.s1][p]+=a*w11;
+      if (c.t1!=c.t0) {
+        double lo=lut->v[c.t0][c.s0][p]+(lut->v[c.t0][c.s1][p]-lut->v[c.t0][c.s0][p])*s;
+        double hi=lut->v[c.t1][c.s0][p]+(lut->v[c.t1][c.s1][p]-lut->v[c.t1][c.s0][p])*s;
+        next_cellT+=a*(hi-lo)*lut->inv_spacing[c.t0];
+      }
+    }
+    adj_C1Q=next_C1Q;
+    adj_cellT=next_cellT;
+  }
+  free(state);
+
+  // h=1/(specific_heat*mass), k=area/Rvalue
+  double mass=1.0/(h*config->specific_heat);
+  g->thermal[battery_gradient_specific_heat]-=adj_h*h/config->specific_heat;
+  g->thermal[battery_gradient_mass]-=adj_h*h/mass;
+  g->thermal[battery_gradient_Rvalue]-=adj_k*k/config->Rvalue;
+  g->thermal[battery_gradient_area]+=adj_k/config->Rvalue;
+  g->thermal[battery_gradient_heat_volts]+=adj_volts;
+  return 0;
+}
+
+#endif
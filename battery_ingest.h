@@ -0,0 +1,401 @@
+/**
+  Batch ingestion of large directories of discharge logs.
+
+  One reader thread keeps many whole-file reads in flight at once through
+  io_uring, so thousands of small field logs cost one ring submission per
+  batch rather than a blocking read per file.  Each completed buffer goes
+  straight onto a bounded queue feeding the parser threads.  If io_uring
+  isn't available (old kernel, or blocked by a container's seccomp policy)
+  a pool of pread threads feeds the same queue instead; if the ring fails
+  part way, or the kernel turns down its read requests, the pread threads
+  pick up every file the ring hadn't finished.
+
+  io_uring is driven through its raw system calls, so no liburing is needed.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_INGEST_H
+#define BATTERY_INGEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+#include "battery_log.h"
+#include "battery_zip.h"
+#include "battery_threads.h"
+
+#define battery_ingest_depth 64 /* file reads in flight at once */
+#define battery_ingest_read_max (1<<30) /* largest single read request (bytes) */
+
+/* Where the bytes came from */
+enum {
+  battery_ingest_uring=0, /* io_uring batch reads */
+  battery_ingest_pread    /* thread pool of pread calls */
+};
+
+/* The logs parsed from one file */
+struct battery_ingest_result {
+  const char *path;
+  int nrun;  /* number of runs, or -1 if the file couldn't be read */
+  struct battery_log *runs;
+  size_t bytes;
+};
+
+/* How far a file has got */
+enum {
+  battery_ingest_unread=0, /* not opened yet */
+  battery_ingest_opened,   /* open, with its buffer allocated and file->done bytes read */
+  battery_ingest_handed    /* on the parse queue (or failed) */
+};
+
+/* A file on its way from disk to the parsers */
+struct battery_ingest_file {
+  int state;
+  int fd;
+  char *buf;
+  size_t len, done;
+};
+
+/* Shared state of one ingest job */
+struct battery_ingest {
+  int n; /* number of files */
+  struct battery_ingest_result *result;
+  struct battery_ingest_file *file;
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  int *queue;  /* ring of file indexes read and waiting to be parsed */
+  int qhead, qcount, qmax;
+  int buffers, max_buffers; /* file buffers allocated but not yet parsed */
+  int next_read; /* next file for a pread thread to claim (atomic) */
+};
+
+
+/********* Parse queue ***********/
+
+/* Wait until another file buffer may be allocated, and count it */
+void battery_ingest_claim_buffer(struct battery_ingest *in)
+{
+  pthread_mutex_lock(&in->lock);
+  while (in->buffers>=in->max_buffers) pthread_cond_wait(&in->changed,&in->lock);
+  in->buffers++;
+  pthread_mutex_unlock(&in->lock);
+}
+
+/* Hand file f (or -1 to stop one parser) to the parser threads */
+void battery_ingest_push(struct battery_ingest *in,int f)
+{
+  pthread_mutex_lock(&in->lock);
+  if (f>=0) in->file[f].state=battery_ingest_handed;
+  in->queue[(in->qhead+in->qcount++)%in->qmax]=f;
+  pthread_cond_broadcast(&in->changed);
+  pthread_mutex_unlock(&in->lock);
+}
+
+void *battery_ingest_parser(void *arg)
+{
+  struct battery_ingest *in=(struct battery_ingest *)arg;
+  struct battery_log_parser *p=(struct battery_log_parser *)malloc(sizeof(struct battery_log_parser));
+  while (1) {
+    pthread_mutex_lock(&in->lock);
+    while (in->qcount==0) pthread_cond_wait(&in->changed,&in->lock);
+    int f=in->queue[in->qhead];
+    in->qhead=(in->qhead+1)%in->qmax;
+    in->qcount--;
+    pthread_mutex_unlock(&in->lock);
+    if (f<0) break;
+
+    struct battery_ingest_file *file=&in->file[f];
+    struct battery_ingest_result *r=&in->result[f];
+    if (r->nrun>=0) {
+      battery_log_parser_init(p);
+      battery_log_parse(p,file->buf,file->done);
+      r->nrun=battery_log_parser_finish(p,&r->runs);
+      r->bytes=file->done;
+    }
+    free(file->buf);
+    file->buf=0;
+
+    pthread_mutex_lock(&in->lock);
+    in->buffers--;
+    pthread_cond_broadcast(&in->changed);
+    pthread_mutex_unlock(&in->lock);
+  }
+  free(p);
+  return 0;
+}
+
+/* Open file f and allocate its buffer.  Returns 0, or -1 (and marks the
+   result failed) if it can't be opened. */
+int battery_ingest_open(struct battery_ingest *in,int f)
+{
+  struct battery_ingest_file *file=&in->file[f];
+  struct stat st;
+  file->fd=open(in->result[f].path,O_RDONLY);
+  if (file->fd<0 || fstat(file->fd,&st)!=0) {
+    if (file->fd>=0) close(file->fd);
+    in->result[f].nrun=-1;
+    return -1;
+  }
+  file->len=st.st_size;
+  file->done=0;
+  file->buf=(char *)malloc(file->len?file->len:1);
+  file->state=battery_ingest_opened;
+  return 0;
+}
+
+
+/********* pread backend ***********/
+
+void *battery_ingest_preader(void *arg)
+{
+  struct battery_ingest *in=(struct battery_ingest *)arg;
+  int f;
+  while ((f=__atomic_fetch_add(&in->next_read,1,__ATOMIC_RELAXED))<in->n) {
+    struct battery_ingest_file *file=&in->file[f];
+    if (file->state==battery_ingest_handed) continue; // the ring finished it
+    if (file->state==battery_ingest_unread) {
+      battery_ingest_claim_buffer(in);
+      if (battery_ingest_open(in,f)!=0) { battery_ingest_push(in,f); continue; }
+    }
+    // a file the ring opened carries on from what it read
+    while (file->done<file->len) {
+      ssize_t got=pread(file->fd,file->buf+file->done,file->len-file->done,file->done);
+      if (got<0 && errno==EINTR) continue;
+      if (got<=0) { in->result[f].nrun=-1; break; }
+      file->done+=got;
+    }
+    close(file->fd);
+    battery_ingest_push(in,f);
+  }
+  return 0;
+}
+
+
+/********* io_uring backend ***********/
+
+#ifdef __linux__
+/* A minimal io_uring: the mapped submission and completion rings */
+struct battery_ingest_ring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  void *sq_map, *cq_map;
+  size_t sq_len, cq_len, sqe_len;
+  unsigned to_submit;
+};
+
+void battery_ingest_ring_close(struct battery_ingest_ring *r)
+{
+  if (r->sqe) munmap(r->sqe,r->sqe_len);
+  if (r->cq_map && r->cq_map!=r->sq_map) munmap(r->cq_map,r->cq_len);
+  if (r->sq_map) munmap(r->sq_map,r->sq_len);
+  if (r->fd>=0) close(r->fd);
+  memset(r,0,sizeof(*r));
+  r->fd=-1;
+}
+
+/* Set up a ring with room for this many requests.  Returns 0, or -1 if
+   io_uring isn't available here. */
+int battery_ingest_ring_open(struct battery_ingest_ring *r,unsigned entries)
+{
+  memset(r,0,sizeof(*r));
+  struct io_uring_params p;
+  memset(&p,0,sizeof(p));
+  r->fd=syscall(__NR_io_uring_setup,entries,&p);
+  if (r->fd<0) return -1;
+  r->sq_len=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+  r->cq_len=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+  int single=(p.features&IORING_FEAT_SINGLE_MMAP)!=0;
+  if (single && r->cq_len>r->sq_len) r->sq_len=r->cq_len;
+  r->sq_map=mmap(0,r->sq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQ_RING);
+  if (r->sq_map==MAP_FAILED) { r->sq_map=0; battery_ingest_ring_close(r); return -1; }
+  r->cq_map=single?r->sq_map:mmap(0,r->cq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_CQ_RING);
+  if (r->cq_map==MAP_FAILED) { r->cq_map=0; battery_ingest_ring_close(r); return -1; }
+  r->sqe_len=p.sq_entries*sizeof(struct io_uring_sqe);
+  r->sqe=(struct io_uring_sqe *)mmap(0,r->sqe_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQES);
+  if (r->sqe==MAP_FAILED) { r->sqe=0; battery_ingest_ring_close(r); return -1; }
+
+  char *sq=(char *)r->sq_map, *cq=(char *)r->cq_map;
+  r->sq_head=(unsigned *)(sq+p.sq_off.head);
+  r->sq_tail=(unsigned *)(sq+p.sq_off.tail);
+  r->sq_mask=(unsigned *)(sq+p.sq_off.ring_mask);
+  r->sq_array=(unsigned *)(sq+p.sq_off.array);
+  r->cq_head=(unsigned *)(cq+p.cq_off.head);
+  r->cq_tail=(unsigned *)(cq+p.cq_off.tail);
+  r->cq_mask=(unsigned *)(cq+p.cq_off.ring_mask);
+  r->cqe=(struct io_uring_cqe *)(cq+p.cq_off.cqes);
+  return 0;
+}
+
+/* Queue a read of the rest of file f */
+void battery_ingest_ring_read(struct battery_ingest_ring *r,struct battery_ingest_file *file,int f)
+{
+  unsigned tail=*r->sq_tail, idx=tail&*r->sq_mask;
+  struct io_uring_sqe *sqe=&r->sqe[idx];
+  memset(sqe,0,sizeof(*sqe));
+  size_t len=file->len-file->done;
+  if (len>battery_ingest_read_max) len=battery_ingest_read_max;
+  sqe->opcode=IORING_OP_READ;
+  sqe->fd=file->fd;
+  sqe->addr=(uint64_t)(uintptr_t)(file->buf+file->done);
+  sqe->len=len;
+  sqe->off=file->done;
+  sqe->user_data=f;
+  r->sq_array[idx]=idx;
+  __atomic_store_n(r->sq_tail,tail+1,__ATOMIC_RELEASE);
+  r->to_submit++;
+}
+
+/* Submit queued reads and wait for at least one to complete.
+   Returns 0, or -1 if the ring failed. */
+int battery_ingest_ring_wait(struct battery_ingest_ring *r)
+{
+  while (1) {
+    int ret=syscall(__NR_io_uring_enter,r->fd,r->to_submit,1,IORING_ENTER_GETEVENTS,0,0);
+    if (ret>=0) { r->to_submit-=ret<(int)r->to_submit?ret:(int)r->to_submit; return 0; }
+    if (errno!=EINTR) return -1;
+  }
+}
+
+/* Read every file through the ring, pushing each to the parsers as it completes.
+   Returns 0, or -1 if io_uring failed or turned down a read: files it
+   didn't finish are left unread or opened for the pread threads. */
+int battery_ingest_uring_reader(struct battery_ingest *in)
+{
+  struct battery_ingest_ring r;
+  if (battery_ingest_ring_open(&r,battery_ingest_depth)!=0) return -1;
+  int next=0, inflight=0, failed=0;
+  while ((next<in->n && !failed) || inflight>0) {
+    while (next<in->n && inflight<battery_ingest_depth && !failed)
+    { // start another file
+      int f=next++;
+      battery_ingest_claim_buffer(in);
+      if (battery_ingest_open(in,f)!=0) { battery_ingest_push(in,f); continue; }
+      if (in->file[f].len==0) { close(in->file[f].fd); battery_ingest_push(in,f); continue; }
+      battery_ingest_ring_read(&r,&in->file[f],f);
+      inflight++;
+    }
+    if (inflight==0) continue;
+    // reads still in flight when the ring fails land the same bytes the pread threads will
+    if (battery_ingest_ring_wait(&r)!=0) { failed=1; break; }
+    unsigned head=*r.cq_head;
+    while (head!=__atomic_load_n(r.cq_tail,__ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe=&r.cqe[head&*r.cq_mask];
+      int f=(int)cqe->user_data;
+      struct battery_ingest_file *file=&in->file[f];
+      // a kernel without IORING_OP_READ turns down every read: use pread
+      if (cqe->res==-EINVAL || cqe->res==-EOPNOTSUPP) failed=1;
+      if (cqe->res>0) file->done+=cqe->res;
+      if (cqe->res==-EINVAL || cqe->res==-EOPNOTSUPP || (cqe->res>0 && file->done<file->len && failed))
+        inflight--; // left opened for the pread threads
+      else if (cqe->res>0 && file->done<file->len) battery_ingest_ring_read(&r,file,f); // short read: ask for the rest
+      else {
+        if (cqe->res<0) in->result[f].nrun=-1;
+        close(file->fd);
+        battery_ingest_push(in,f);
+        inflight--;
+      }
+      head++;
+    }
+    __atomic_store_n(r.cq_head,head,__ATOMIC_RELEASE);
+  }
+  battery_ingest_ring_close(&r);
+  return failed?-1:0;
+}
+#else
+int battery_ingest_uring_reader(struct battery_ingest *in) { (void)in; return -1; }
+#endif
+
+
+/********* Interface ***********/
+
+/* Read and parse these n files, using nthreads parser threads (0 for one per core).
+   backend is battery_ingest_uring (falls back to pread if unavailable) or battery_ingest_pread.
+   Returns the backend actually used; results are stored to *results in path order. */
+int battery_ingest_files(const char **paths,int n,int nthreads,int backend,
+  struct battery_ingest_result **results)
+{
+  struct battery_ingest in;
+  memset(&in,0,sizeof(in));
+  in.n=n;
+  in.result=(struct battery_ingest_result *)calloc(n>0?n:1,sizeof(struct battery_ingest_result));
+  in.file=(struct battery_ingest_file *)calloc(n>0?n:1,sizeof(struct battery_ingest_file));
+  for (int f=0;f<n;f++) in.result[f].path=paths[f];
+  if (nthreads<1) nthreads=battery_threads_default();
+  in.max_buffers=battery_ingest_depth+2*nthreads;
+  in.qmax=in.max_buffers+nthreads+1;
+  in.queue=(int *)malloc(in.qmax*sizeof(int));
+  pthread_mutex_init(&in.lock,0);
+  pthread_cond_init(&in.changed,0);
+
+  pthread_t parser[nthreads];
+  for (int t=0;t<nthreads;t++) pthread_create(&parser[t],0,battery_ingest_parser,&in);
+
+  if (backend==battery_ingest_uring && battery_ingest_uring_reader(&in)!=0)
+    backend=battery_ingest_pread;
+  if (backend==battery_ingest_pread) {
+    // resume from the first file the ring didn't finish
+    while (in.next_read<n && in.file[in.next_read].state==battery_ingest_handed) in.next_read++;
+    int nreaders=nthreads<4?4:nthreads; // pread blocks, so overlap a few per core
+    pthread_t reader[nreaders];
+    for (int t=0;t<nreaders;t++) pthread_create(&reader[t],0,battery_ingest_preader,&in);
+    for (int t=0;t<nreaders;t++) pthread_join(reader[t],0);
+  }
+
+  for (int t=0;t<nthreads;t++) battery_ingest_push(&in,-1);
+  for (int t=0;t<nthreads;t++) pthread_join(parser[t],0);
+  pthread_mutex_destroy(&in.lock);
+  pthread_cond_destroy(&in.changed);
+  free(in.queue);
+  free(in.file);
+  *results=in.result;
+  return backend;
+}
+
+/* Free results from battery_ingest_files */
+void battery_ingest_free(struct battery_ingest_result *results,int n)
+{
+  for (int f=0;f<n;f++)
+    if (results[f].nrun>0) battery_log_free(results[f].runs,results[f].nrun);
+  free(results);
+}
+
+/* List the .csv files in this directory into *paths (each path malloc'd).
+   Returns the number of files, or -1 if the directory can't be read. */
+int battery_ingest_list(const char *dirname,char ***paths)
+{
+  DIR *dir=opendir(dirname);
+  *paths=0;
+  if (!dir) return -1;
+  int n=0, max=0;
+  struct dirent *d;
+  while ((d=readdir(dir))) {
+    size_t len=strlen(d->d_name);
+    if (len<=4 || strcasecmp(d->d_name+len-4,".csv")) continue;
+    if (n>=max) { max=max?2*max:256; *paths=(char **)realloc(*paths,max*sizeof(char *)); }
+    size_t plen=strlen(dirname)+len+2;
+    (*paths)[n]=(char *)malloc(plen);
+    snprintf((*paths)[n],plen,"%s/%s",dirname,d->d_name);
+    n++;
+  }
+  closedir(dir);
+  return n;
+}
+
+#endif
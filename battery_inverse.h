@@ -0,0 +1,143 @@
+/**
+  State of charge from a rested cell's voltage, by an inverse Em table.
+
+  battery_model_init needs the SOC, but a cell in the field only shows
+  its voltage and temperature.  Once it has rested (C1 discharged, no
+  current) the voltage is Em(SOC,T), so SOC is Em's inverse there.
+
+  Em is only invertible where it rises with SOC.  Fitted or measured
+  tables (battery_ocv) can dip between nodes, so each temperature's row
+  is first made non-decreasing by a running maximum: the voltage on a
+  flat stretch maps to the lowest SOC that reaches it.  Between table
+  temperatures the lookup interpolates Em linearly in T, so the exact
+  inverse at any (V,T) is a scan of the ten SOC segments of that
+  interpolated row (battery_inverse_exact).
+
+  For speed, that exact inverse is sampled once onto a uniform grid of
+  voltage and temperature, and each lookup is then a bilinear
+  interpolation with no search or branches: the batch version does
+  eight cells per AVX2 gather.  Voltages past the ends of the tables
+  give SOC 0 or 1; temperatures past them use the end rows.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_INVERSE_H
+#define BATTERY_INVERSE_H
+
+#include <string.h>
+#include <math.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include "battery_replay.h"
+
+#define battery_inverse_volts 256 /* voltage steps in the inverse table */
+#define battery_inverse_temps 161 /* temperature steps, a quarter degree apart over the tables' -20 to 20 C */
+
+/* Monotone Em rows, and SOC sampled on a uniform voltage and temperature grid */
+struct battery_inverse {
+  float Em[battery_model_table_temps][battery_model_table_SOCs]; /* non-decreasing along SOC */
+  float inv_spacing[battery_model_table_temps];
+  float lo_volts, volts_scale; /* grid column of voltage V is (V-lo_volts)*volts_scale */
+  float lo_temp, temp_scale;   /* grid row of temperature T is (T-lo_temp)*temp_scale */
+  float SOC[battery_inverse_temps][battery_inverse_volts];
+};
+
+/* SOC where the monotone Em rows, interpolated to temperature tempC, reach volts */
+float battery_inverse_exact(const struct battery_inverse *v,float volts,float tempC)
+{
+  int t0=0;
+  while (t0+1<battery_model_table_temps && battery_model_temperatures[t0+1]<=tempC) t0++;
+  int t1=t0+1<battery_model_table_temps?t0+1:t0;
+  float t=t1>t0?(tempC-battery_model_temperatures[t0])*v->inv_spacing[t0]:0.0f;
+  if (t<0.0f) t=0.0f; // below the coldest row
+  const float *lo=v->Em[t0], *hi=v->Em[t1];
+  float last=lo[0]+(hi[0]-lo[0])*t;
+  if (!(volts>last)) return 0.0f;
+  for (int s=1;s<battery_model_table_SOCs;s++) {
+    float Em=lo[s]+(hi[s]-lo[s])*t;
+    if (volts<=Em && Em>last) return (s-1+(volts-last)/(Em-last))*(1.0f/(battery_model_table_SOCs-1));
+    last=Em;
+  }
+  return 1.0f;
+}
+
+/* Build the inverse of lut's Em tables.  Returns the number of table
+   nodes that had to be raised to make Em non-decreasing in SOC. */
+int battery_inverse_init(struct battery_inverse *v,const struct battery_replay_lut *lut)
+{
+  int raised=0;
+  float lo=0, hi=0;
+  for (int t=0;t<battery_model_table_temps;t++) {
+    float top=lut->v[t][0][battery_replay_Em];
+    for (int s=0;s<battery_model_table_SOCs;s++) {
+      float Em=lut->v[t][s][battery_replay_Em];
+      if (Em<top) { Em=top; raised++; }
+      v->Em[t][s]=top=Em;
+    }
+    if (t==0 || v->Em[t][0]<lo) lo=v->Em[t][0];
+    if (t==0 || top>hi) hi=top;
+  }
+  memcpy(v->inv_spacing,lut->inv_spacing,sizeof(v->inv_spacing));
+  float coldest=battery_model_temperatures[0], hottest=battery_model_temperatures[battery_model_table_temps-1];
+  v->lo_volts=lo;
+  v->volts_scale=hi>lo?(battery_inverse_volts-1)/(hi-lo):0.0f;
+  v->lo_temp=coldest;
+  v->temp_scale=(battery_inverse_temps-1)/(hottest-coldest);
+  for (int j=0;j<battery_inverse_temps;j++) {
+    float T=coldest+j/v->temp_scale;
+    for (int i=0;i<battery_inverse_volts;i++)
+      v->SOC[j][i]=battery_inverse_exact(v,lo+(hi-lo)*i/(battery_inverse_volts-1),T);
+  }
+  return raised;
+}
+
+/* SOC of one rested cell at this voltage and temperature (deg C) */
+static inline float battery_inverse_SOC(const struct battery_inverse *v,float volts,float tempC)
+{
+  float x=(volts-v->lo_volts)*v->volts_scale, y=(tempC-v->lo_temp)*v->temp_scale;
+  x=fminf(fmaxf(x,0.0f),battery_inverse_volts-1);
+  y=fminf(fmaxf(y,0.0f),battery_inverse_temps-1);
+  int i=(int)x, j=(int)y;
+  if (i>battery_inverse_volts-2) i=battery_inverse_volts-2;
+  if (j>battery_inverse_temps-2) j=battery_inverse_temps-2;
+  float fx=x-i, fy=y-j;
+  const float *row=v->SOC[j]+i;
+  float lo=row[0]+(row[1]-row[0])*fx;
+  float hi=row[battery_inverse_volts]+(row[battery_inverse_volts+1]-row[battery_inverse_volts])*fx;
+  return lo+(hi-lo)*fy;
+}
+
+/* SOC[i] of n rested cells from their voltages and temperatures */
+void battery_inverse_batch(const struct battery_inverse *v,int n,
+  const float *restrict volts,const float *restrict tempC,float *restrict SOC)
+{
+  int i=0;
+#if defined(__AVX2__)
+  const float *grid=&v->SOC[0][0];
+  __m256 lo_volts=_mm256_set1_ps(v->lo_volts), volts_scale=_mm256_set1_ps(v->volts_scale);
+  __m256 lo_temp=_mm256_set1_ps(v->lo_temp), temp_scale=_mm256_set1_ps(v->temp_scale);
+  __m256 zero=_mm256_setzero_ps();
+  __m256 max_x=_mm256_set1_ps(battery_inverse_volts-1), max_y=_mm256_set1_ps(battery_inverse_temps-1);
+  __m256i max_i=_mm256_set1_epi32(battery_inverse_volts-2), max_j=_mm256_set1_epi32(battery_inverse_temps-2);
+  __m256i stride=_mm256_set1_epi32(battery_inverse_volts), one=_mm256_set1_epi32(1);
+  for (;i+8<=n;i+=8) {
+    __m256 x=_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(volts+i),lo_volts),volts_scale);
+    __m256 y=_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(tempC+i),lo_temp),temp_scale);
+    x=_mm256_min_ps(_mm256_max_ps(x,zero),max_x);
+    y=_mm256_min_ps(_mm256_max_ps(y,zero),max_y);
+    __m256i xi=_mm256_min_epi32(_mm256_cvttps_epi32(x),max_i);
+    __m256i yj=_mm256_min_epi32(_mm256_cvttps_epi32(y),max_j);
+    __m256 fx=_mm256_sub_ps(x,_mm256_cvtepi32_ps(xi)), fy=_mm256_sub_ps(y,_mm256_cvtepi32_ps(yj));
+    __m256i at=_mm256_add_epi32(_mm256_mullo_epi32(yj,stride),xi), up=_mm256_add_epi32(at,stride);
+    __m256 a=_mm256_i32gather_ps(grid,at,4), b=_mm256_i32gather_ps(grid,_mm256_add_epi32(at,one),4);
+    __m256 c=_mm256_i32gather_ps(grid,up,4), d=_mm256_i32gather_ps(grid,_mm256_add_epi32(up,one),4);
+    __m256 lo=_mm256_add_ps(a,_mm256_mul_ps(_mm256_sub_ps(b,a),fx));
+    __m256 hi=_mm256_add_ps(c,_mm256_mul_ps(_mm256_sub_ps(d,c),fx));
+    _mm256_storeu_ps(SOC+i,_mm256_add_ps(lo,_mm256_mul_ps(_mm256_sub_ps(hi,lo),fy)));
+  }
+#endif
+  for (;i<n;i++) SOC[i]=battery_inverse_SOC(v,volts[i],tempC[i]);
+}
+
+#endif
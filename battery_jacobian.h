@@ -0,0 +1,316 @@
+/**
+  Gauss-Newton normal equations of the replay error, for least-squares
+  calibration of the parameter tables.
+
+  Each sample's residual depends directly on only the table entries
+  around its (SOC, temperature): four nodes of each parameter.  It also
+  depends on earlier parameters through the two model states that carry
+  memory, the C1 charge and the cell temperature.  So the residual's
+  Jacobian row is built from the sensitivities of those two states to
+  every table entry, carried forward sample by sample like the states
+  themselves.  The sensitivities are sparse vectors: they start empty,
+  gain the entries the run passes through, and drop entries whose effect
+  has decayed below a tolerance.  The C1 charge forgets on the R1*C1 time
+  scale, so only recently visited nodes stay in it.
+
+  The rows are never stored, not even for one sample as a dense
+  264-column vector.  Each sparse row is folded straight into J'J and J'r
+  as it is made, so memory is the same for a minute of data or a day.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_JACOBIAN_H
+#define BATTERY_JACOBIAN_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "battery_log.h"
+#include "battery_replay.h"
+#include "battery_score.h"
+#include "battery_gradient.h"
+
+#define battery_jacobian_entries (battery_replay_params*battery_model_table_temps*battery_model_table_SOCs) /* 264 */
+
+/* Sensitivity entries are dropped once a 100% change of their table entry
+   would move C1's voltage or the cell temperature by less than this. */
+#define battery_jacobian_tolerance_V 1.0e-9f
+#define battery_jacobian_tolerance_T 1.0e-7f
+
+/* Index of a table entry, with parameters outermost, then temperature rows */
+static inline int battery_jacobian_index(int param,int t,int s)
+{
+  return (param*battery_model_table_temps+t)*battery_model_table_SOCs+s;
+}
+
+/* Accumulated normal equations: J'J and J'r over some samples,
+   each run weighted as it was added */
+struct battery_jacobian {
+  struct battery_score_stats error; /* unweighted residuals */
+  double JTJ[battery_jacobian_entries][battery_jacobian_entries];
+  double JTr[battery_jacobian_entries];
+};
+
+void battery_jacobian_init(struct battery_jacobian *j)
+{
+  memset(j,0,sizeof(*j));
+}
+
+/* Add src's normal equations into dest */
+void battery_jacobian_merge(struct battery_jacobian *dest,const struct battery_jacobian *src)
+{
+  battery_score_stats_merge(&dest->error,&src->error);
+  for (int a=0;a<battery_jacobian_entries;a++) {
+    for (int b=0;b<battery_jacobian_entries;b++) dest->JTJ[a][b]+=src->JTJ[a][b];
+    dest->JTr[a]+=src->JTr[a];
+  }
+}
+
+
+/********* Sparse vectors over table entries ***********/
+
+/* Values are stored densely by entry, with a list of the nonzero ones */
+struct battery_jacobian_sparse {
+  int n;
+  int index[battery_jacobian_entries];
+  unsigned char used[battery_jacobian_entries];
+  double value[battery_jacobian_entries];
+};
+
+static inline void battery_jacobian_sparse_add(struct battery_jacobian_sparse *v,int k,double x)
+{
+  if (!v->used[k]) { v->used[k]=1; v->index[v->n++]=k; v->value[k]=0.0; }
+  v->value[k]+=x;
+}
+
+static inline void battery_jacobian_sparse_clear(struct battery_jacobian_sparse *v)
+{
+  for (int i=0;i<v->n;i++) v->used[v->index[i]]=0;
+  v->n=0;
+}
+
+/* v+=a*x */
+static inline void battery_jacobian_sparse_axpy(struct battery_jacobian_sparse *v,double a,const struct battery_jacobian_sparse *x)
+{
+  if (a==0.0) return;
+  for (int i=0;i<x->n;i++) battery_jacobian_sparse_add(v,x->index[i],a*x->value[x->index[i]]);
+}
+
+/* Drop entries where |value*scale[k]|<tolerance */
+static inline void battery_jacobian_sparse_prune(struct battery_jacobian_sparse *v,const float *scale,double tolerance)
+{
+  int n=0;
+  for (int i=0;i<v->n;i++) {
+    int k=v->index[i];
+    if (fabs(v->value[k]*scale[k])<tolerance) v->used[k]=0;
+    else v->index[n++]=k;
+  }
+  v->n=n;
+}
+
+/* A derivative, as a combination of the C1 charge and cell temperature
+   sensitivities and the four parameters' own table weights at this sample */
+struct battery_jacobian_d {
+  double C1Q, cellT;
+  double param[battery_replay_params];
+};
+
+/* d=a*x+b*y */
+static inline struct battery_jacobian_d battery_jacobian_d_sum(double a,struct battery_jacobian_d x,double b,struct battery_jacobian_d y)
+{
+  struct battery_jacobian_d d;
+  d.C1Q=a*x.C1Q+b*y.C1Q;
+  d.cellT=a*x.cellT+b*y.cellT;
+  for (int p=0;p<battery_replay_params;p++) d.param[p]=a*x.param[p]+b*y.param[p];
+  return d;
+}
+
+/* Write out derivative d as a sparse vector over table entries */
+static inline void battery_jacobian_expand(struct battery_jacobian_sparse *out,const struct battery_jacobian_d *d,
+  const struct battery_jacobian_sparse *dC1Q,const struct battery_jacobian_sparse *dcellT,
+  const struct battery_gradient_cell *c)
+{
+  battery_jacobian_sparse_clear(out);
+  battery_jacobian_sparse_axpy(out,d->C1Q,dC1Q);
+  battery_jacobian_sparse_axpy(out,d->cellT,dcellT);
+  double s=c->s, t=c->t;
+  for (int p=0;p<battery_replay_params;p++) {
+    double a=d->param[p];
+    if (a==0.0) continue;
+    battery_jacobian_sparse_add(out,battery_jacobian_index(p,c->t0,c->s0),a*(1-s)*(1-t));
+    battery_jacobian_sparse_add(out,battery_jacobian_index(p,c->t0,c->s1),a*s*(1-t));
+    battery_jacobian_sparse_add(out,battery_jacobian_index(p,c->t1,c->s0),a*(1-s)*t);
+    battery_jacobian_sparse_add(out,battery_jacobian_index(p,c->t1,c->s1),a*s*t);
+  }
+}
+
+
+/********* Accumulating a run ***********/
+
+/* One sample, linearized: the derivatives of its voltage, and of the C1
+   charge and cell temperature at the next sample */
+struct battery_jacobian_sample {
+  struct battery_gradient_cell c; /* table cell the sample looks up */
+  struct battery_jacobian_d V, C1Q, cellT;
+};
+
+/* Linearize the sample replay r has just run, drawing I amps, with the
+   next sample dt seconds later (dt<0 if this is the last sample) */
+void battery_jacobian_linearize(const struct battery_replay_lut *lut,const struct battery_replay *r,
+  float I,float dt,struct battery_jacobian_sample *out)
+{
+  // derivatives of the parameters at this sample: their own table
+  // weights, plus their slope in temperature times the cell temperature's
+  struct battery_gradient_cell *c=&out->c;
+  battery_gradient_find(lut,r->battery.SOC,r->battery.cellT,c);
+  struct battery_jacobian_d param[battery_replay_params];
+  memset(param,0,sizeof(param));
+  for (int p=0;p<battery_replay_params;p++) {
+    param[p].param[p]=1.0;
+    if (c->t1!=c->t0) {
+      double lo=lut->v[c->t0][c->s0][p]+(lut->v[c->t0][c->s1][p]-lut->v[c->t0][c->s0][p])*c->s;
+      double hi=lut->v[c->t1][c->s0][p]+(lut->v[c->t1][c->s1][p]-lut->v[c->t1][c->s0][p])*c->s;
+      param[p].cellT=(hi-lo)*lut->inv_spacing[c->t0];
+    }
+  }
+  double R1=r->param[battery_replay_R1], C1=r->param[battery_replay_C1];
+  double C1V=r->C1V, R1I=r->R1I;
+  struct battery_jacobian_d charge={1.0,0.0,{0,0,0,0}};
+  struct battery_jacobian_d d_C1V=battery_jacobian_d_sum(1.0/C1,charge,-C1V/C1,param[battery_replay_C1]);
+  struct battery_jacobian_d d_R1I=battery_jacobian_d_sum(1.0/R1,d_C1V,-R1I/R1,param[battery_replay_R1]);
+
+  // battery_model_voltage
+  out->V=battery_jacobian_d_sum(1.0,param[battery_replay_Em],-1.0,d_C1V);
+  out->V=battery_jacobian_d_sum(1.0,out->V,-I,param[battery_replay_R0]);
+  if (dt<0) { // no next sample
+    memset(&out->C1Q,0,sizeof(out->C1Q));
+    memset(&out->cellT,0,sizeof(out->cellT));
+    return;
+  }
+
+  // the step to the next sample, holding this sample's current
+  double h=r->inv_heat_capacity, k=r->conductance;
+  struct battery_jacobian_d d_heat=battery_jacobian_d_sum(I*I*dt,param[battery_replay_R0],2.0*R1I*dt,d_C1V);
+  d_heat=battery_jacobian_d_sum(1.0,d_heat,-R1I*R1I*dt,param[battery_replay_R1]);
+  float tau=r->param[battery_replay_R1]*r->param[battery_replay_C1];
+  if (dt<=tau) out->C1Q=battery_jacobian_d_sum(1.0,charge,-dt,d_R1I);
+  else {
+    double e=exp(-dt/(double)tau);
+    double A=I*(1.0-e) + (r->battery.C1Q-I*tau)*e*dt/((double)tau*tau);
+    struct battery_jacobian_d d_tau=battery_jacobian_d_sum(C1,param[battery_replay_R1],R1,param[battery_replay_C1]);
+    out->C1Q=battery_jacobian_d_sum(e,charge,A,d_tau);
+  }
+  struct battery_jacobian_d temperature={0.0,1.0,{0,0,0,0}};
+  out->cellT=battery_jacobian_d_sum(1.0-k*dt*h,temperature,h,d_heat);
+}
+
+/* Scratch space for one run: the state sensitivities, and a row */
+struct battery_jacobian_work {
+  struct battery_jacobian_sparse dC1Q, dcellT, next_C1Q, next_cellT, row;
+};
+
+/* Replay this run, adding weight*J'J and weight*J'r for its residuals
+   (model minus measured volts) with respect to the table entries into j.
+   work is scratch space, reused between runs. */
+void battery_jacobian_run(struct battery_jacobian *j,struct battery_jacobian_work *work,
+  const struct battery_replay_lut *lut,const struct battery_replay_config *config,
+  const struct battery_log *log,double weight)
+{
+  int n=log->n;
+  if (n<=0) return;
+  const float *time=log->col[battery_log_time], *amps=log->col[battery_log_amps];
+  const float *tempC=log->col[battery_log_tempC], *cellV=log->col[battery_log_cellV];
+  float scale[battery_jacobian_entries]; // size of each entry, for pruning
+  for (int p=0;p<battery_replay_params;p++)
+    for (int t=0;t<battery_model_table_temps;t++)
+      for (int s=0;s<battery_model_table_SOCs;s++)
+        scale[battery_jacobian_index(p,t,s)]=fabsf(lut->v[t][s][p]);
+  struct battery_jacobian_sparse *dC1Q=&work->dC1Q, *dcellT=&work->dcellT, *row=&work->row;
+  struct battery_jacobian_sparse *next_C1Q=&work->next_C1Q, *next_cellT=&work->next_cellT;
+  battery_jacobian_sparse_clear(dC1Q);
+  battery_jacobian_sparse_clear(dcellT);
+
+  struct battery_replay r;
+  battery_replay_start(&r,lut,config,&log->info);
+  for (int i=0;i<n;i++) {
+    float V;
+    battery_replay_run(&r,time+i,amps+i,tempC+i,cellV+i,1,&V,0,0);
+    float err=V-cellV[i];
+    int scored=r.battery.SOC>=0.0f; // past the model's SOC 0 isn't scored (battery_score_sample)
+    if (scored) battery_score_stats_add(&j->error,err);
+    struct battery_jacobian_sample d;
+    battery_jacobian_linearize(lut,&r,amps[i],i+1<n?time[i+1]-time[i]:-1.0f,&d);
+
+    // this sample's row
+    if (scored) battery_jacobian_expand(row,&d.V,dC1Q,dcellT,&d.c);
+    else battery_jacobian_sparse_clear(row);
+    for (int a=0;a<row->n;a++) {
+      int ka=row->index[a];
+      double wa=weight*row->value[ka];
+      j->JTr[ka]+=wa*err;
+      double *JTJ=j->JTJ[ka];
+      for (int b=0;b<row->n;b++) JTJ[row->index[b]]+=wa*row->value[row->index[b]];
+    }
+    if (i+1==n) break;
+
+    battery_jacobian_expand(next_C1Q,&d.C1Q,dC1Q,dcellT,&d.c);
+    battery_jacobian_expand(next_cellT,&d.cellT,dC1Q,dcellT,&d.c);
+    battery_jacobian_sparse_prune(next_C1Q,scale,battery_jacobian_tolerance_V*r.param[battery_replay_C1]);
+    battery_jacobian_sparse_prune(next_cellT,scale,battery_jacobian_tolerance_T);
+    struct battery_jacobian_sparse *swap=dC1Q; dC1Q=next_C1Q; next_C1Q=swap;
+    swap=dcellT; dcellT=next_cellT; next_cellT=swap;
+  }
+}
+
+/* Solve (A+lambda*diag(A)) x = b for x, by Cholesky factorization of a
+   copy of A (n x n, row stride battery_jacobian_entries).  Entries whose
+   diagonal is below battery_jacobian_untouched of the largest (no sample
+   really depends on them) get x=0, and the damping of the rest is at
+   least battery_jacobian_min_damping of the largest diagonal, so barely
+   touched entries can't take huge steps.
+   Returns 0, or -1 if the damped matrix isn't positive definite. */
+#define battery_jacobian_untouched 1.0e-12
+#define battery_jacobian_min_damping 1.0e-6
+int battery_jacobian_solve(const double A[][battery_jacobian_entries],const double *b,double lambda,double *x,int n)
+{
+  double (*L)[battery_jacobian_entries]=(double (*)[battery_jacobian_entries])malloc(sizeof(double)*battery_jacobian_entries*n);
+  if (!L) return -1;
+  double largest=0;
+  for (int r=0;r<n;r++) if (A[r][r]>largest) largest=A[r][r];
+  unsigned char used[battery_jacobian_entries];
+  for (int r=0;r<n;r++) used[r]=A[r][r]>battery_jacobian_untouched*largest;
+  for (int r=0;r<n;r++)
+    for (int c=0;c<n;c++) {
+      double a=used[r] && used[c]?A[r][c]:0.0;
+      if (r==c) a=used[r]?A[r][r]+lambda*fmax(A[r][r],battery_jacobian_min_damping*largest):1.0;
+      L[r][c]=a;
+    }
+  int err=0;
+  for (int c=0;c<n && !err;c++) {
+    double d=L[c][c];
+    for (int k=0;k<c;k++) d-=L[c][k]*L[c][k];
+    if (!(d>0)) { err=1; break; }
+    L[c][c]=sqrt(d);
+    for (int r=c+1;r<n;r++) {
+      double v=L[r][c];
+      for (int k=0;k<c;k++) v-=L[r][k]*L[c][k];
+      L[r][c]=v/L[c][c];
+    }
+  }
+  if (!err) {
+    for (int r=0;r<n;r++) { // L y = b
+      double v=used[r]?b[r]:0.0;
+      for (int k=0;k<r;k++) v-=L[r][k]*x[k];
+      x[r]=v/L[r][r];
+    }
+    for (int r=n-1;r>=0;r--) { // L' x = y
+      double v=x[r];
+      for (int k=r+1;k<n;k++) v-=L[k][r]*x[k];
+      x[r]=v/L[r][r];
+    }
+  }
+  free(L);
+  return err?-1:0;
+}
+
+#endif
@@ -0,0 +1,476 @@
+/**
+  Fast reader for the charger's discharge-log CSV format.
+
+  Each log starts with a metadata preamble (Rated Capacity, Cells, Sample Rate,
+  Test Current, Period On/Off, ...) written as pairs of key and value lines,
+  then a "Test,Time,Voltage,..." header line and one quoted row per sample.
+  Some files hold several logs back to back, so a file parses to an array
+  of runs.
+
+  Rows are split 64 bytes at a time: SIMD compares build bitmasks of commas,
+  quotes and newlines, a prefix-xor of the quote mask hides separators inside
+  quoted fields, and the remaining separator bits are walked with ctz.
+  Numbers are parsed straight into float columns without strtod.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_LOG_H
+#define BATTERY_LOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Logged temperatures outside this range mean the probe was not connected
+   (the charger writes values like 539.61 or 3624.11 deg C). */
+#define battery_log_temp_min -60.0f
+#define battery_log_temp_max 150.0f
+#define battery_log_temp_valid(t) ((t)>battery_log_temp_min && (t)<battery_log_temp_max)
+#define battery_log_temp_offset 30.0f /* logged temperatures further than this from the chamber (deg C) are sensor glitches */
+
+/* 1 if this logged temperature is plausible for a cell in a chamber at ambientT */
+static inline int battery_log_temp_plausible(float tempC,float ambientT)
+{
+  return battery_log_temp_valid(tempC) && fabsf(tempC-ambientT)<battery_log_temp_offset;
+}
+
+/* The chamber temperature to check a run's n readings against: nominalT
+   where it's known (not NAN), else the first valid reading, else fallback */
+static inline float battery_log_nominal_temp(const float *tempC,int n,float nominalT,float fallback)
+{
+  if (nominalT==nominalT) return nominalT;
+  for (int i=0;i<n;i++) if (battery_log_temp_valid(tempC[i])) return tempC[i];
+  return fallback;
+}
+
+/* Metadata from the preamble of one log */
+struct battery_log_info {
+  char test[64];  /* contents of the "Test" column, e.g. "1.8ah, 2.5C-rate, 20*C" */
+  char date[16];  /* date the test started, as written by the charger */
+  char start[16]; /* time of day the test started */
+  float total_s;  /* Test Total Time (seconds) */
+  float rated_Ah; /* Rated Capacity (amp hours) */
+  float tested_Ah; /* Tested Capacity (amp hours) */
+  int cells;      /* cells stacked in series */
+  char type[16];  /* Battery Type, e.g. "Li-poly" */
+  float weight_kg; /* Battery Weight (kilograms) */
+  float sample_s; /* Sample Rate (seconds per sample) */
+  float test_current; /* Test Current setting: amps, or watts if test_power */
+  int test_power; /* 1 if the test held constant power instead of constant current */
+  float on_s;     /* Period On: seconds of load per pulse (0 if not pulsed) */
+  float off_s;    /* Period Off: seconds of rest between pulses */
+};
+
+/* Sample columns of a log */
+enum {
+  battery_log_time=0, /* seconds since start of test */
+  battery_log_volts,  /* pack terminal voltage (volts) */
+  battery_log_cellV,  /* average voltage per cell (volts) */
+  battery_log_amps,   /* discharge current (amps, positive while discharging) */
+  battery_log_tempC,  /* logged temperature (deg C), see battery_log_temp_valid */
+  battery_log_columns
+};
+
+/* One discharge run: preamble metadata plus typed sample columns */
+struct battery_log {
+  struct battery_log_info info;
+  int n;   /* number of samples */
+  int max; /* allocated length of each column */
+  float *col[battery_log_columns];
+};
+
+/* Each sample's cell temperature for a run in a chamber at ambientT: the
+   logged one where it's plausible, else the last plausible one (ambientT
+   before the first). */
+void battery_log_cell_temps(const struct battery_log *log,float ambientT,float *cellT)
+{
+  const float *tempC=log->col[battery_log_tempC];
+  float T=ambientT;
+  for (int i=0;i<log->n;i++) {
+    if (battery_log_temp_plausible(tempC[i],ambientT)) T=tempC[i];
+    cellT[i]=T;
+  }
+}
+
+#define battery_log_max_fields 16 /* fields per line we look at */
+#define battery_log_window 65536 /* bytes indexed per pass (longest line allowed) */
+
+/* Incremental parser state */
+struct battery_log_parser {
+  int nlog, maxlog;
+  struct battery_log *log; /* runs parsed so far; log[nlog-1] is being filled */
+
+  int in_data; /* 1 while reading sample rows */
+  int data_col[battery_log_columns]; /* field index of each column, or -1 if absent */
+  int test_col; /* field index of the "Test" label column */
+
+  int nkeys; /* preamble key line waiting for its value line */
+  char keys[battery_log_max_fields][32];
+
+  uint32_t sep[battery_log_window]; /* separator offsets within one window */
+};
+
+
+/********* Field parsing ***********/
+
+/* Powers of ten exactly representable as doubles */
+static const double battery_log_pow10[23]={
+  1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,
+  1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+
+/* Parse a decimal number from the field [s,end), skipping quotes and spaces.
+   Up to 15 significant digits are computed exactly in integer math, so the
+   division by a power of ten rounds the same way strtod does.
+   Returns 0.0 for an empty field. */
+float battery_log_float(const char *s,const char *end)
+{
+  while (s<end && (*s=='"' || *s==' ')) s++;
+  const char *start=s;
+  int neg=0;
+  if (s<end && (*s=='-' || *s=='+')) { neg=(*s=='-'); s++; }
+  uint64_t mant=0;
+  int digits=0, frac=0;
+  while (s<end && (unsigned)(*s-'0')<10) { mant=mant*10+(*s++-'0'); digits++; }
+  if (s<end && *s=='.') {
+    s++;
+    while (s<end && (unsigned)(*s-'0')<10) { mant=mant*10+(*s++-'0'); digits++; frac++; }
+  }
+  if (digits>15 || (s<end && (*s=='e' || *s=='E')))
+  { // rare: hand the field to the C library
+    char tmp[64];
+    size_t len=end-start;
+    if (len>=sizeof(tmp)) len=sizeof(tmp)-1;
+    memcpy(tmp,start,len); tmp[len]=0;
+    return (float)strtod(tmp,0);
+  }
+  double v=(double)mant/battery_log_pow10[frac];
+  return (float)(neg?-v:v);
+}
+
+/* Copy the text of the field [s,end) into dest, without quotes or trailing CR */
+void battery_log_string(char *dest,int destlen,const char *s,const char *end)
+{
+  while (s<end && (*s=='"' || *s==' ')) s++;
+  while (end>s && (end[-1]=='"' || end[-1]=='\r' || end[-1]==' ')) end--;
+  int len=end-s;
+  if (len>=destlen) len=destlen-1;
+  memcpy(dest,s,len);
+  dest[len]=0;
+}
+
+/* Parse a duration like "(hh:mm:ss): 2:54:38" to seconds */
+float battery_log_hms(const char *str)
+{
+  const char *s=strstr(str,": ");
+  s=s?s+2:str;
+  float total=0;
+  while (*s) {
+    total=total*60+battery_log_float(s,s+strcspn(s,":"));
+    s+=strcspn(s,":");
+    if (*s==':') s++;
+  }
+  return total;
+}
+
+
+/********* Line scanning ***********/
+
+/* Build bitmasks of the commas, quotes, and newlines in this 64-byte block */
+static inline void battery_log_masks(const char *p,uint64_t *comma,uint64_t *quote,uint64_t *newline)
+{
+#if defined(__AVX2__)
+  __m256i lo=_mm256_loadu_si256((const __m256i *)p);
+  __m256i hi=_mm256_loadu_si256((const __m256i *)(p+32));
+#define battery_log_mask(c) ( (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo,_mm256_set1_epi8(c))) \
+    | ((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi,_mm256_set1_epi8(c)))<<32) )
+  *comma=battery_log_mask(',');
+  *quote=battery_log_mask('"');
+  *newline=battery_log_mask('\n');
+#undef battery_log_mask
+#elif defined(__SSE2__)
+  uint64_t m[3]={0,0,0};
+  const char chars[3]={',','"','\n'};
+  for (int q=0;q<4;q++) {
+    __m128i v=_mm_loadu_si128((const __m128i *)(p+16*q));
+    for (int c=0;c<3;c++)
+      m[c]|=(uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v,_mm_set1_epi8(chars[c])))<<(16*q);
+  }
+  *comma=m[0]; *quote=m[1]; *newline=m[2];
+#else
+  uint64_t c=0,q=0,n=0;
+  for (int i=0;i<64;i++) {
+    c|=(uint64_t)(p[i]==',')<<i;
+    q|=(uint64_t)(p[i]=='"')<<i;
+    n|=(uint64_t)(p[i]=='\n')<<i;
+  }
+  *comma=c; *quote=q; *newline=n;
+#endif
+}
+
+/* Bit i of the result is the xor of bits 0..i of x:
+   set for every byte between an opening and closing quote. */
+static inline uint64_t battery_log_prefix_xor(uint64_t x)
+{
+  x^=x<<1; x^=x<<2; x^=x<<4; x^=x<<8; x^=x<<16; x^=x<<32;
+  return x;
+}
+
+/* Record the offset of every field separator (a comma or newline outside
+   quotes) in buf[0..len) into sep.  len must be at most battery_log_window.
+   Returns the number of separators found. */
+int battery_log_index(const char *buf,int len,uint32_t *sep)
+{
+  int nsep=0;
+  uint64_t inquote=0; // all ones if the previous block ended inside quotes
+  for (int base=0;base<len;base+=64) {
+    uint64_t comma,quote,newline;
+    if (base+64<=len) battery_log_masks(buf+base,&comma,&quote,&newline);
+    else { // last partial block: copy to a padded buffer
+      char tail[64];
+      memset(tail,' ',64);
+      memcpy(tail,buf+base,len-base);
+      battery_log_masks(tail,&comma,&quote,&newline);
+    }
+    uint64_t quoted=battery_log_prefix_xor(quote)^inquote;
+    inquote=(uint64_t)((int64_t)quoted>>63);
+    uint64_t bits=(comma|newline)&~quoted;
+    while (bits) {
+      sep[nsep++]=base+__builtin_ctzll(bits);
+      bits&=bits-1;
+    }
+  }
+  return nsep;
+}
+
+
+/********* Runs and preamble ***********/
+
+/* Make room for at least n samples in each column of this log */
+void battery_log_reserve(struct battery_log *log,int n)
+{
+  if (n<=log->max) return;
+  int max=log->max?log->max:4096;
+  while (max<n) max*=2;
+  for (int c=0;c<battery_log_columns;c++)
+    log->col[c]=(float *)realloc(log->col[c],max*sizeof(float));
+  log->max=max;
+}
+
+/* Start a new empty run at the end of the parser's list */
+struct battery_log *battery_log_parser_new_run(struct battery_log_parser *p)
+{
+  if (p->nlog>=p->maxlog) {
+    p->maxlog=p->maxlog?2*p->maxlog:4;
+    p->log=(struct battery_log *)realloc(p->log,p->maxlog*sizeof(struct battery_log));
+  }
+  struct battery_log *log=&p->log[p->nlog++];
+  memset(log,0,sizeof(*log));
+  log->info.cells=1;
+  log->info.sample_s=1.0f;
+  return log;
+}
+
+/* Store one preamble value under its key */
+void battery_log_set_info(struct battery_log_info *info,const char *key,const char *value)
+{
+  if (!strcmp(key,"Date")) snprintf(info->date,sizeof(info->date),"%s",value);
+  else if (!strcmp(key,"Time")) snprintf(info->start,sizeof(info->start),"%s",value);
+  else if (!strcmp(key,"Test Total Time")) info->total_s=battery_log_hms(value);
+  else if (!strcmp(key,"Rated Capacity")) info->rated_Ah=battery_log_float(value,value+strlen(value));
+  else if (!strcmp(key,"Tested Capacity")) info->tested_Ah=battery_log_float(value,value+strlen(value));
+  else if (!strcmp(key,"Cells")) info->cells=(int)battery_log_float(value,value+strlen(value));
+  else if (!strcmp(key,"Battery Type")) snprintf(info->type,sizeof(info->type),"%s",value);
+  else if (!strcmp(key,"Battery Weight")) info->weight_kg=battery_log_float(value,value+strlen(value));
+  else if (!strcmp(key,"Sample Rate")) info->sample_s=battery_log_float(value,value+strlen(value));
+  else if (!strcmp(key,"Test Current")) {
+    info->test_current=battery_log_float(value,value+strlen(value));
+    info->test_power=(strstr(value,"Power")!=0);
+  }
+  else if (!strcmp(key,"Period On")) info->on_s=battery_log_float(value,value+strlen(value));
+  else if (!strcmp(key,"Period Off")) info->off_s=battery_log_float(value,value+strlen(value));
+  if (info->cells<1) info->cells=1;
+  if (!(info->sample_s>0)) info->sample_s=1.0f;
+}
+
+/* Handle one non-sample line, split into nf fields. */
+void battery_log_preamble_line(struct battery_log_parser *p,int nf,char field[][32])
+{
+  int empty=1;
+  for (int f=0;f<nf;f++) if (field[f][0]) empty=0;
+  if (empty) { p->nkeys=0; return; }
+
+  if (nf>=2 && !strcmp(field[0],"Test") && !strcmp(field[1],"Time"))
+  { // column header: samples follow
+    if (p->nlog==0) battery_log_parser_new_run(p);
+    static const char *names[battery_log_columns]={"Time","Voltage","Avg v/cell","Current","Temp (C)"};
+    for (int c=0;c<battery_log_columns;c++) {
+      p->data_col[c]=-1;
+      for (int f=0;f<nf;f++) if (!strcmp(field[f],names[c])) p->data_col[c]=f;
+    }
+    p->test_col=0;
+    p->in_data=1;
+    p->nkeys=0;
+    return;
+  }
+
+  if (!strcmp(field[0],"Date")) battery_log_parser_new_run(p); // every log starts with its date
+  else if (p->nlog==0) battery_log_parser_new_run(p);
+
+  if (p->nkeys>0)
+  { // value line under the previous key line
+    struct battery_log *log=&p->log[p->nlog-1];
+    for (int f=0;f<nf && f<p->nkeys;f++)
+      if (p->keys[f][0] && field[f][0])
+        battery_log_set_info(&log->info,p->keys[f],field[f]);
+    p->nkeys=0;
+  }
+  else
+  { // key line
+    for (int f=0;f<nf;f++) strcpy(p->keys[f],field[f]);
+    p->nkeys=nf;
+  }
+}
+
+/* Fast path: append the sample in this line, whose fields end at sep[0..nf) */
+static inline void battery_log_data_line(struct battery_log_parser *p,
+  const char *line,const char *buf,const uint32_t *sep,int nf)
+{
+  struct battery_log *log=&p->log[p->nlog-1];
+  if (log->n>=log->max) battery_log_reserve(log,log->n+1);
+  int i=log->n++;
+  for (int c=0;c<battery_log_columns;c++) {
+    int f=p->data_col[c];
+    float v=0.0f;
+    if (f>=0 && f<nf) {
+      const char *start=f?buf+sep[f-1]+1:line;
+      v=battery_log_float(start,buf+sep[f]);
+    }
+    log->col[c][i]=v;
+  }
+  if (p->data_col[battery_log_cellV]<0) // no per-cell column in this log
+    log->col[battery_log_cellV][i]=log->col[battery_log_volts][i]/log->info.cells;
+  if (i==0 && nf>p->test_col) {
+    const char *start=p->test_col?buf+sep[p->test_col-1]+1:line;
+    battery_log_string(log->info.test,sizeof(log->info.test),start,buf+sep[p->test_col]);
+  }
+}
+
+/* Parse one complete line whose fields end at the separators sep[0..nf).
+   The last separator is the line's newline (or the end of the buffer). */
+void battery_log_line(struct battery_log_parser *p,const char *line,const char *buf,const uint32_t *sep,int nf)
+{
+  if (p->in_data) {
+    const char *first_end=buf+sep[0];
+    if (first_end-line>0 && !(first_end-line==1 && *line=='\r'))
+    { // sample row
+      battery_log_data_line(p,line,buf,sep,nf);
+      return;
+    }
+    p->in_data=0; // empty first field: end of samples
+  }
+  char field[battery_log_max_fields][32];
+  if (nf>battery_log_max_fields) nf=battery_log_max_fields;
+  for (int f=0;f<nf;f++)
+    battery_log_string(field[f],sizeof(field[f]),f?buf+sep[f-1]+1:line,buf+sep[f]);
+  battery_log_preamble_line(p,nf,field);
+}
+
+
+/********* Parser interface ***********/
+
+void battery_log_parser_init(struct battery_log_parser *p)
+{
+  memset(p,0,sizeof(*p));
+}
+
+/* Parse all the complete lines in buf[0..len).
+   Returns the number of bytes consumed, which ends just after the last newline. */
+size_t battery_log_parse_lines(struct battery_log_parser *p,const char *buf,size_t len)
+{
+  size_t done=0;
+  while (done<len) {
+    int window=(len-done>battery_log_window)?battery_log_window:(int)(len-done);
+    const char *w=buf+done;
+    int nsep=battery_log_index(w,window,p->sep);
+
+    int line_sep=0, last_end=0; // first separator of current line, offset past last newline
+    for (int s=0;s<nsep;s++) {
+      if (w[p->sep[s]]!='\n') continue;
+      battery_log_line(p,w+last_end,w,p->sep+line_sep,s-line_sep+1);
+      line_sep=s+1;
+      last_end=p->sep[s]+1;
+    }
+    if (last_end==0) { // no newline in a whole window
+      if (window==battery_log_window) last_end=window; // absurdly long line: skip it
+      else break; // incomplete line at the end of the buffer
+    }
+    done+=last_end;
+  }
+  return done;
+}
+
+/* Parse this entire buffer, treating its end as the end of the last line. */
+void battery_log_parse(struct battery_log_parser *p,const char *buf,size_t len)
+{
+  size_t done=battery_log_parse_lines(p,buf,len);
+  if (done<len)
+  { // final line without a newline
+    int rest=len-done;
+    if (rest>=battery_log_window) return;
+    int nsep=battery_log_index(buf+done,rest,p->sep);
+    p->sep[nsep++]=rest; // the end of the buffer ends the line
+    battery_log_line(p,buf+done,buf+done,p->sep,nsep);
+  }
+}
+
+/* Hand the parsed runs to the caller (who owns them afterwards).
+   Runs without any samples are dropped.  Returns the number of runs. */
+int battery_log_parser_finish(struct battery_log_parser *p,struct battery_log **runs)
+{
+  int n=0;
+  for (int r=0;r<p->nlog;r++) {
+    if (p->log[r].n>0) p->log[n++]=p->log[r];
+    else for (int c=0;c<battery_log_columns;c++) free(p->log[r].col[c]);
+  }
+  *runs=p->log;
+  p->log=0; p->nlog=p->maxlog=0;
+  return n;
+}
+
+/* Free an array of runs */
+void battery_log_free(struct battery_log *runs,int n)
+{
+  for (int r=0;r<n;r++)
+    for (int c=0;c<battery_log_columns;c++) free(runs[r].col[c]);
+  free(runs);
+}
+
+/* Read and parse this CSV file.
+   Returns the number of runs stored to *runs, or -1 if the file can't be read. */
+int battery_log_read(const char *filename,struct battery_log **runs)
+{
+  *runs=0;
+  FILE *f=fopen(filename,"rb");
+  if (!f) return -1;
+  fseek(f,0,SEEK_END);
+  long len=ftell(f);
+  fseek(f,0,SEEK_SET);
+  char *buf=(char *)malloc(len>0?len:1);
+  if (len<0 || fread(buf,1,len,f)!=(size_t)len) { free(buf); fclose(f); return -1; }
+  fclose(f);
+
+  struct battery_log_parser *p=(struct battery_log_parser *)malloc(sizeof(struct battery_log_parser));
+  battery_log_parser_init(p);
+  battery_log_parse(p,buf,len);
+  int n=battery_log_parser_finish(p,runs);
+  free(p);
+  free(buf);
+  return n;
+}
+
+#endif
@@ -0,0 +1,307 @@
+/**
+  Moving-horizon estimation of the state of charge, for going back over
+  logs: fit the state at the start of a window of samples, and the
+  cell's capacity, so the replayed voltage matches the logged voltage
+  over the whole window.
+
+  The unknowns are x = (SOC, C1Q, capacity factor), where the factor
+  scales the rated amp-seconds.  The cost is
+      sum over the window of (V_model - V_logged)^2 / volts_noise^2
+      + sum over x of (x - prior)^2 / sigma^2
+  where the prior (the arrival cost) is where the last window said this
+  one starts.  It's minimized by Levenberg-Marquardt over the three
+  unknowns: a step that raises the cost is dropped, and retried shorter
+  from the best point so far.
+
+  Each iteration is one replay of the window through battery_replay_run,
+  one sample at a time, carrying the derivatives of SOC and C1Q with
+  respect to x alongside, like battery_jacobian does for table entries:
+      dSOC' = dSOC + [0, 0, I dt/(capacity*factor^2)]
+      dC1Q' = a dC1Q + A dtau,  tau = R1*C1
+  with a and A from the same exact or explicit step the replay takes,
+  and dtau, dEm, dR0 and dC1 from the tables' slopes along SOC.  The
+  cell temperature's small dependence on the state is left out.  The
+  voltage derivative rows then fold straight into 3x3 normal equations.
+
+  Windows slide on by a stride of samples.  The best replay of each
+  window is kept at the next window's first sample, so the next window
+  starts from it exactly (thermal state included) and usually needs only
+  two or three replays.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_MHE_H
+#define BATTERY_MHE_H
+
+#include <string.h>
+#include <math.h>
+#include "battery_log.h"
+#include "battery_replay.h"
+#include "battery_gradient.h"
+
+/* The unknowns */
+enum {
+  battery_mhe_SOC=0,
+  battery_mhe_C1Q,
+  battery_mhe_capacity,
+  battery_mhe_unknowns
+};
+
+/* Window, noise and prior settings */
+struct battery_mhe_config {
+  int horizon;          /* samples per window */
+  int stride;           /* samples each window moves on */
+  int iterations;       /* most replays per window */
+  int warm;             /* 1: start each window from the last one's solution.  0: from the first prior, every time */
+  float tolerance;      /* stop once the SOC step is smaller than this */
+  float SOC;            /* first window's prior */
+  float SOC_sigma;      /* first window's prior standard deviation */
+  float arrival_SOC;    /* later windows' prior standard deviations */
+  float arrival_C1Q;    /* coulombs */
+  float capacity_sigma; /* first window's prior on the capacity factor, about 1 */
+  float arrival_capacity; /* later windows' prior on it: how far it may drift per window */
+  float damping;        /* Levenberg-Marquardt's starting damping, relative to the diagonal */
+  float volts_noise;    /* measurement noise and model error, per cell (volts) */
+};
+
+/* Defaults: ten minute windows moving a minute at a time, at 1 Hz logging */
+void battery_mhe_config_init(struct battery_mhe_config *c)
+{
+  c->horizon=600;
+  c->stride=60;
+  c->iterations=4;
+  c->warm=1;
+  c->tolerance=1.0e-4f;
+  c->SOC=0.5f;
+  c->SOC_sigma=0.5f;
+  c->arrival_SOC=0.02f;
+  c->arrival_C1Q=5.0f;
+  c->capacity_sigma=0.1f;
+  c->arrival_capacity=0.005f;
+  c->damping=1.0e-3f;
+  c->volts_noise=0.05f;
+}
+
+/* One window's solution */
+struct battery_mhe_estimate {
+  int end;          /* last sample of the window */
+  float SOC, C1Q;   /* at that sample */
+  float capacity;   /* factor on the rated capacity */
+  float rms;        /* voltage error over the window (volts) */
+  int iterations;
+};
+
+/* Derivatives of the two states with respect to the unknowns */
+struct battery_mhe_tangent {
+  double SOC[battery_mhe_unknowns], C1Q[battery_mhe_unknowns];
+};
+
+/* Slope along SOC of each parameter, at the lookup cell c */
+static inline void battery_mhe_slopes(const struct battery_replay_lut *lut,
+  const struct battery_gradient_cell *c,double *slope)
+{
+  for (int p=0;p<battery_replay_params;p++) {
+    double lo=lut->v[c->t0][c->s1][p]-lut->v[c->t0][c->s0][p];
+    double hi=lut->v[c->t1][c->s1][p]-lut->v[c->t1][c->s0][p];
+    slope[p]=(lo+(hi-lo)*c->t)*(battery_model_table_SOCs-1);
+  }
+}
+
+/* Set replay r, which has just run a sample, to state x there, for a
+   cell of capacityAs amp-seconds at factor 1 */
+void battery_mhe_set(struct battery_replay *r,const double *x,double capacityAs)
+{
+  r->battery.SOC=x[battery_mhe_SOC];
+  r->battery.C1Q=x[battery_mhe_C1Q];
+  r->battery.capacityAs=x[battery_mhe_capacity]*capacityAs;
+  r->inv_capacity=1.0f/r->battery.capacityAs;
+  battery_replay_state(r,&r->battery,r->param,&r->C1V,&r->R1I);
+}
+
+/* Replay samples [begin,end) of the log from r (which has run sample
+   begin, with this capacity factor), adding the normal equations of the
+   voltage errors to JTJ and JTr.  Copies the replay after sample keep to
+   *kept, and leaves r after the last sample.  Returns the sum of squared
+   errors (volts^2). */
+double battery_mhe_window(struct battery_replay *r,struct battery_mhe_tangent *d,double factor,
+  const struct battery_log *log,int begin,int end,int keep,
+  struct battery_replay *kept,
+  double JTJ[battery_mhe_unknowns][battery_mhe_unknowns],double *JTr)
+{
+  const float *time=log->col[battery_log_time], *amps=log->col[battery_log_amps];
+  const float *tempC=log->col[battery_log_tempC], *cellV=log->col[battery_log_cellV];
+  const struct battery_replay_lut *lut=r->lut;
+  double sse=0;
+  for (int i=begin;i<end;i++) {
+    float V;
+    if (i==begin) V=r->param[battery_replay_Em]-r->C1V-r->param[battery_replay_R0]*amps[i];
+    else {
+      // the step from the last sample, holding its current, as the replay takes it
+      double I=r->last_amps, dt=time[i]-r->last_time;
+      double R1=r->param[battery_replay_R1], C1=r->param[battery_replay_C1], tau=R1*C1, C1Q=r->battery.C1Q;
+      struct battery_gradient_cell c;
+      double slope[battery_replay_params];
+      battery_gradient_find(lut,r->battery.SOC,r->battery.cellT,&c);
+      battery_mhe_slopes(lut,&c,slope);
+      double a, A;
+      if (dt<=tau) { a=1.0-dt/tau; A=C1Q*dt/(tau*tau); }
+      else {
+        double e=exp(-dt/tau);
+        a=e;
+        A=I*(1.0-e)+(C1Q-I*tau)*e*dt/(tau*tau);
+      }
+      double dtau=slope[battery_replay_R1]*C1+R1*slope[battery_replay_C1];
+      for (int k=0;k<battery_mhe_unknowns;k++) d->C1Q[k]=a*d->C1Q[k]+A*dtau*d->SOC[k];
+      d->SOC[battery_mhe_capacity]+=I*dt*r->inv_capacity/factor;
+      battery_replay_run(r,time+i,amps+i,tempC+i,cellV+i,1,&V,0,0);
+    }
+    // this sample's row: dV = (dEm - I dR0 + C1V/C1 dC1) dSOC - dC1Q/C1
+    struct battery_gradient_cell c;
+    double slope[battery_replay_params];
+    battery_gradient_find(lut,r->battery.SOC,r->battery.cellT,&c);
+    battery_mhe_slopes(lut,&c,slope);
+    double C1=r->param[battery_replay_C1];
+    double dV_dSOC=slope[battery_replay_Em]-amps[i]*slope[battery_replay_R0]+r->C1V/C1*slope[battery_replay_C1];
+    double row[battery_mhe_unknowns], err=V-cellV[i];
+    for (int k=0;k<battery_mhe_unknowns;k++) row[k]=dV_dSOC*d->SOC[k]-d->C1Q[k]/C1;
+    for (int a=0;a<battery_mhe_unknowns;a++) {
+      for (int b=0;b<battery_mhe_unknowns;b++) JTJ[a][b]+=row[a]*row[b];
+      JTr[a]+=row[a]*err;
+    }
+    sse+=err*err;
+    if (i==keep) *kept=*r;
+  }
+  return sse;
+}
+
+/* Solve the symmetric positive definite 3x3 system H x = b, by Cholesky.
+   Returns 0, or -1 if H isn't positive definite. */
+int battery_mhe_solve(double H[battery_mhe_unknowns][battery_mhe_unknowns],const double *b,double *x)
+{
+  double L[battery_mhe_unknowns][battery_mhe_unknowns]={{0}}, y[battery_mhe_unknowns];
+  for (int i=0;i<battery_mhe_unknowns;i++)
+    for (int j=0;j<=i;j++) {
+      double sum=H[i][j];
+      for (int k=0;k<j;k++) sum-=L[i][k]*L[j][k];
+      if (i==j) {
+        if (!(sum>0)) return -1;
+        L[i][i]=sqrt(sum);
+      }
+      else L[i][j]=sum/L[j][j];
+    }
+  for (int i=0;i<battery_mhe_unknowns;i++) {
+    double sum=b[i];
+    for (int k=0;k<i;k++) sum-=L[i][k]*y[k];
+    y[i]=sum/L[i][i];
+  }
+  for (int i=battery_mhe_unknowns-1;i>=0;i--) {
+    double sum=y[i];
+    for (int k=i+1;k<battery_mhe_unknowns;k++) sum-=L[k][i]*x[k];
+    x[i]=sum/L[i][i];
+  }
+  return 0;
+}
+
+/* Estimate the state through this run, window by window, replaying it
+   through lut with the replay config's thermal settings.  The run's
+   chamber was at ambientT (deg C), or NAN if not known.  Stores up to max
+   window solutions to out; returns how many. */
+int battery_mhe_run(const struct battery_replay_lut *lut,const struct battery_replay_config *replay_config,
+  const struct battery_mhe_config *config,const struct battery_log *log,float ambientT,
+  struct battery_mhe_estimate *out,int max)
+{
+  int n=log->n;
+  if (n<2 || max<=0) return 0;
+  const float *time=log->col[battery_log_time], *amps=log->col[battery_log_amps];
+  const float *tempC=log->col[battery_log_tempC], *cellV=log->col[battery_log_cellV];
+  struct battery_replay_config rc=*replay_config;
+  rc.ambientT=battery_log_nominal_temp(tempC,n,ambientT,rc.ambientT);
+  struct battery_replay start, r, kept;
+  battery_replay_start(&start,lut,&rc,&log->info);
+  float V;
+  battery_replay_run(&start,time,amps,tempC,cellV,1,&V,0,0);
+  double capacityAs=start.battery.capacityAs, inv_var=1.0/(config->volts_noise*config->volts_noise);
+  int horizon=config->horizon>1?config->horizon:2, stride=config->stride>0?config->stride:1;
+
+  double x[battery_mhe_unknowns]={config->SOC,0.0,1.0}, prior[battery_mhe_unknowns];
+  double weight[battery_mhe_unknowns]={1.0/(config->SOC_sigma*config->SOC_sigma),
+    1.0/(config->arrival_C1Q*config->arrival_C1Q),1.0/(config->capacity_sigma*config->capacity_sigma)};
+  memcpy(prior,x,sizeof(x));
+  int nwin=0, begin=0;
+  while (nwin<max) {
+    int end=begin+horizon<n?begin+horizon:n, keep=begin+stride<end-1?begin+stride:end-1;
+    struct battery_replay best_r, trial_kept;
+    struct battery_mhe_tangent d;
+    double H[battery_mhe_unknowns][battery_mhe_unknowns], g[battery_mhe_unknowns];
+    double best[battery_mhe_unknowns], best_cost=INFINITY, best_sse=0, lambda=config->damping;
+    int replays=0;
+    memcpy(best,x,sizeof(best));
+    best_r=start;
+    while (replays<config->iterations || replays==0) {
+      r=start;
+      battery_mhe_set(&r,x,capacityAs);
+      memset(&d,0,sizeof(d));
+      d.SOC[battery_mhe_SOC]=d.C1Q[battery_mhe_C1Q]=1.0;
+      double JTJ[battery_mhe_unknowns][battery_mhe_unknowns]={{0}}, JTr[battery_mhe_unknowns]={0};
+      double sse=battery_mhe_window(&r,&d,x[battery_mhe_capacity],log,begin,end,keep,&trial_kept,JTJ,JTr);
+      replays++;
+      double cost=sse*inv_var;
+      for (int a=0;a<battery_mhe_unknowns;a++) cost+=weight[a]*(x[a]-prior[a])*(x[a]-prior[a]);
+      if (cost<best_cost)
+      { // accept, and linearize the weighted cost here, prior included
+        best_cost=cost;
+        best_sse=sse;
+        memcpy(best,x,sizeof(best));
+        best_r=r;
+        kept=trial_kept;
+        for (int a=0;a<battery_mhe_unknowns;a++) {
+          for (int b=0;b<battery_mhe_unknowns;b++) H[a][b]=JTJ[a][b]*inv_var;
+          H[a][a]+=weight[a];
+          g[a]=-(JTr[a]*inv_var+weight[a]*(x[a]-prior[a]));
+        }
+        lambda*=0.1;
+      }
+      else lambda*=10.0; // the step overshot: back to the best point, with a shorter step
+      // Levenberg-Marquardt step from the best point
+      double damped[battery_mhe_unknowns][battery_mhe_unknowns], dx[battery_mhe_unknowns];
+      memcpy(damped,H,sizeof(damped));
+      for (int a=0;a<battery_mhe_unknowns;a++) damped[a][a]*=1.0+lambda;
+      if (battery_mhe_solve(damped,g,dx)!=0) break;
+      // past the ends of the tables the voltage says nothing more about SOC
+      double SOC=best[battery_mhe_SOC]+dx[battery_mhe_SOC];
+      if (SOC<0.0) dx[battery_mhe_SOC]-=SOC;
+      if (SOC>1.0) dx[battery_mhe_SOC]-=SOC-1.0;
+      if (fabs(dx[battery_mhe_SOC])<config->tolerance) break;
+      for (int a=0;a<battery_mhe_unknowns;a++) x[a]=best[a]+dx[a];
+      if (x[battery_mhe_capacity]<0.1) x[battery_mhe_capacity]=0.1; // keep the capacity physical
+    }
+    memcpy(x,best,sizeof(x));
+    struct battery_mhe_estimate *e=&out[nwin++];
+    e->end=end-1;
+    e->SOC=best_r.battery.SOC;
+    e->C1Q=best_r.battery.C1Q;
+    e->capacity=x[battery_mhe_capacity];
+    e->rms=sqrt(best_sse/(end-begin));
+    e->iterations=replays;
+    if (end==n) break;
+
+    // the next window starts where this one's solution says
+    start=kept;
+    begin=keep;
+    if (config->warm) {
+      x[battery_mhe_SOC]=kept.battery.SOC;
+      x[battery_mhe_C1Q]=kept.battery.C1Q;
+      memcpy(prior,x,sizeof(x));
+      weight[battery_mhe_SOC]=1.0/(config->arrival_SOC*config->arrival_SOC);
+      weight[battery_mhe_capacity]=1.0/(config->arrival_capacity*config->arrival_capacity);
+    }
+    else {
+      x[battery_mhe_SOC]=prior[battery_mhe_SOC]=config->SOC;
+      x[battery_mhe_C1Q]=prior[battery_mhe_C1Q]=0.0;
+      x[battery_mhe_capacity]=prior[battery_mhe_capacity]=1.0;
+    }
+  }
+  return nwin;
+}
+
+#endif
@@ -0,0 +1,136 @@
+/**
+  Open circuit voltage (Em) tables measured from the logs.
+
+  The 100 mA test at -20 degC draws C/18 for 10% of the charge at a time,
+  then rests for half an hour: almost an open circuit sweep.  Every
+  loaded sample of a slow run like that is an Em sample once the model's
+  own overpotential is added back: the R0*I drop, and the voltage on C1
+  (at -20 degC, R1*I is nearly as big as R0*I, so it can't be left out).
+  Both come from replaying the run through the current tables, so the
+  logged voltage becomes
+      Em = V_logged + (Em - V)_model = V_logged + R0*I + C1V
+  at the replay's SOC and cell temperature, in the same single pass.
+
+  The end of every long rest, in any test, is a nearly exact Em sample
+  too: by then C1 has almost discharged.  Those are taken from the same
+  replay, and cover the temperatures the sweep doesn't.
+
+  Samples are spread onto the table grid with the lookup's bilinear
+  weights.  Each sweep sample's weight is the SOC it covers in units of
+  the table spacing, so a sweep counts about as much at each node as one
+  rest does; each rest counts 1.  Grid nodes with enough weight get the
+  weighted mean; the rest keep their old values.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_OCV_H
+#define BATTERY_OCV_H
+
+#include <string.h>
+#include <math.h>
+#include "battery_log.h"
+#include "battery_replay.h"
+#include "battery_gradient.h"
+
+#define battery_ocv_sweep_crate 0.1f /* runs drawing at most this C-rate count as open circuit sweeps */
+#define battery_ocv_rest_fraction 0.01f /* current below this fraction of the peak counts as resting */
+#define battery_ocv_min_rest 500.0f /* seconds of rest before the voltage counts as open circuit */
+#define battery_ocv_min_weight 0.5 /* weight a grid node needs before it's replaced */
+
+/* Weighted sums of Em samples at each table node */
+struct battery_ocv {
+  double sum[battery_model_table_temps][battery_model_table_SOCs];
+  double weight[battery_model_table_temps][battery_model_table_SOCs];
+  long sweep_samples; /* loaded samples from sweeps */
+  int rests;          /* long rests */
+};
+
+void battery_ocv_init(struct battery_ocv *o)
+{
+  memset(o,0,sizeof(*o));
+}
+
+/* Spread one Em sample onto the four nodes around (SOC, cellT) */
+static inline void battery_ocv_add(struct battery_ocv *o,const struct battery_replay_lut *lut,
+  float SOC,float cellT,double Em,double weight)
+{
+  struct battery_gradient_cell c;
+  battery_gradient_find(lut,SOC,cellT,&c);
+  double s=c.s, t=c.t;
+  double w00=weight*(1-s)*(1-t), w01=weight*s*(1-t), w10=weight*(1-s)*t, w11=weight*s*t;
+  o->weight[c.t0][c.s0]+=w00; o->sum[c.t0][c.s0]+=w00*Em;
+  o->weight[c.t0][c.s1]+=w01; o->sum[c.t0][c.s1]+=w01*Em;
+  o->weight[c.t1][c.s0]+=w10; o->sum[c.t1][c.s0]+=w10*Em;
+  o->weight[c.t1][c.s1]+=w11; o->sum[c.t1][c.s1]+=w11*Em;
+}
+
+/* Replay this run through lut, adding its Em samples: every loaded
+   sample if it's a slow sweep, and the end of every long rest.  The run's
+   chamber was at ambientT (deg C), or NAN if not known; the cell starts
+   there if the log has no valid temperature. */
+void battery_ocv_run(struct battery_ocv *o,const struct battery_replay_lut *lut,
+  const struct battery_replay_config *config,const struct battery_log *log,float ambientT)
+{
+  int n=log->n;
+  if (n<=0) return;
+  const float *time=log->col[battery_log_time], *amps=log->col[battery_log_amps];
+  const float *tempC=log->col[battery_log_tempC], *cellV=log->col[battery_log_cellV];
+  float peak=0.0f;
+  for (int i=0;i<n;i++) if (amps[i]>peak) peak=amps[i];
+  struct battery_replay_config c=*config;
+  c.ambientT=battery_log_nominal_temp(tempC,n,ambientT,c.ambientT);
+  struct battery_replay r;
+  battery_replay_start(&r,lut,&c,&log->info);
+  int sweep=peak>0 && peak*r.amps_to_crate<=battery_ocv_sweep_crate;
+  float rest=peak*battery_ocv_rest_fraction, per_node=battery_model_table_SOCs-1;
+
+  float last_SOC=r.battery.SOC, rest_start=time[0];
+  float Em=0.0f, SOC=0.0f, cellT=0.0f; // last sample's
+  int resting=0;
+  for (int i=0;i<n;i++) {
+    float V;
+    battery_replay_run(&r,time+i,amps+i,tempC+i,cellV+i,1,&V,0,0);
+    if (amps[i]<rest) {
+      if (!resting) rest_start=time[i];
+      resting=1;
+    }
+    else {
+      // load came back on: the sample before ended a rest
+      if (resting && time[i-1]-rest_start>=battery_ocv_min_rest && SOC>=0.0f) {
+        battery_ocv_add(o,lut,SOC,cellT,Em,1.0);
+        o->rests++;
+      }
+      resting=0;
+    }
+    SOC=r.battery.SOC;
+    cellT=r.battery.cellT;
+    Em=cellV[i]+r.param[battery_replay_Em]-V;
+    if (sweep && !resting && SOC>=0.0f && SOC<=1.0f) {
+      battery_ocv_add(o,lut,SOC,cellT,Em,fabsf(last_SOC-SOC)*per_node);
+      o->sweep_samples++;
+    }
+    last_SOC=SOC;
+  }
+  // a rest at the very end counts, unless the run ended because the cell was empty
+  if (resting && time[n-1]-rest_start>=battery_ocv_min_rest && SOC>=0.0f) {
+    battery_ocv_add(o,lut,SOC,cellT,Em,1.0);
+    o->rests++;
+  }
+}
+
+/* Replace the Em entries of lut at every node with enough weight by the
+   samples' weighted mean.  Returns the number of nodes replaced. */
+int battery_ocv_apply(const struct battery_ocv *o,struct battery_replay_lut *lut)
+{
+  int replaced=0;
+  for (int t=0;t<battery_model_table_temps;t++)
+    for (int s=0;s<battery_model_table_SOCs;s++) {
+      double w=o->weight[t][s];
+      if (w<battery_ocv_min_weight) continue;
+      lut->v[t][s][battery_replay_Em]=o->sum[t][s]/w;
+      replaced++;
+    }
+  return replaced;
+}
+
+#endif
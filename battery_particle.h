@@ -0,0 +1,239 @@
+/**
+  Particle filter for the state of charge, for where the model is too
+  nonlinear for the Kalman filter (battery_ekf.h): near SOC 0 and 1, and
+  at -20 degC, where R0 jumps 0.13 -> 0.67 ohms within one table cell and
+  C1 spans five orders of magnitude.
+
+  Each cell is tracked by n particles, each a possible (SOC, C1Q) state,
+  stored as a structure of arrays like battery_ekf.  A step moves every
+  particle through the cell model with the measured current plus process
+  noise, weights it by how well its predicted voltage matches the
+  measurement, and reports the weighted mean.  When the weights get
+  uneven (effective sample size below half the particles) the particles
+  are resampled, systematically: with normalized cumulative weights c[i]
+  and one random offset u, particle i's copies end at slot
+      floor(n*c[i] - u)
+  which, like battery_coulomb_scan, is a prefix sum eight weights at a
+  time in an AVX2 register, with the floor taken in the same register.
+  The copies then fill the other half of a double buffer, so nothing is
+  allocated after setup; each cell switches halves only when it resamples.
+
+  All of a cell's particles share its temperature, so each step first
+  interpolates the tables to that temperature, leaving one short row
+  per parameter that every particle indexes by SOC alone, and the
+  particle loop has no branches or table searches.  Process noise comes from a counter-based hash of
+  (cell, step, particle), so it needs no sequential generator state;
+  each normal deviate is the sum of four 16-bit uniforms (Irwin-Hall).
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_PARTICLE_H
+#define BATTERY_PARTICLE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+#include "battery_replay.h"
+#include "battery_ekf.h"
+#include "battery_coulomb.h"
+
+#define battery_particle_resample 0.5f /* resample when the effective sample size drops below this fraction */
+
+/* Every cell's particles, [cell][particle], double buffered for resampling */
+struct battery_particle {
+  int ncell, n;
+  const struct battery_replay_lut *lut;
+  float SOC_noise, C1Q_noise, inv_volts_var; /* per sqrt(second), and 1/variance */
+  float *SOC[2], *C1Q[2]; /* particles: cell c's are in [now[c]], and [!now[c]] is its resampling target */
+  unsigned char *now;     /* per cell */
+  float *weight;          /* one cell's scratch */
+  int *last;
+  float *last_amps, *inv_capacity; /* per cell */
+  float *est_SOC, *est_C1Q;        /* per cell: weighted mean after the last step */
+  uint32_t seed, step;
+  long resamples;
+  void *mem;
+};
+
+/* Well mixed 32 bit hash of x (lowbias32) */
+static inline uint32_t battery_particle_hash(uint32_t x)
+{
+  x^=x>>16; x*=0x7feb352dU;
+  x^=x>>15; x*=0x846ca68bU;
+  x^=x>>16;
+  return x;
+}
+
+/* Roughly standard normal deviate from key (Irwin-Hall sum of four uniforms) */
+static inline float battery_particle_normal(uint32_t key)
+{
+  uint32_t a=battery_particle_hash(key), b=battery_particle_hash(key^0x9e3779b9U);
+  float sum=(float)(a&0xffff)+(float)(a>>16)+(float)(b&0xffff)+(float)(b>>16);
+  return (sum*(1.0f/65536.0f)-2.0f)*1.7320508f;
+}
+
+/* Set up n particles for each of ncell cells of capacityAh amp hours,
+   spread around config's starting SOC.  Returns 0, or -1 if out of memory. */
+int battery_particle_init(struct battery_particle *pf,int ncell,int n,const struct battery_replay_lut *lut,
+  float capacityAh,const struct battery_ekf_config *config,uint32_t seed)
+{
+  memset(pf,0,sizeof(*pf));
+  if (n<1) n=1;
+  if (ncell<0) ncell=0;
+  size_t total=(size_t)ncell*n;
+  size_t floats=4*total+(size_t)n+4*(size_t)ncell;
+  pf->mem=malloc(floats*sizeof(float)+(size_t)n*sizeof(int)+(size_t)ncell);
+  if (!pf->mem) return -1;
+  float *p=(float *)pf->mem;
+  pf->SOC[0]=p; p+=total;
+  pf->SOC[1]=p; p+=total;
+  pf->C1Q[0]=p; p+=total;
+  pf->C1Q[1]=p; p+=total;
+  pf->weight=p; p+=n;
+  pf->last_amps=p; p+=ncell;
+  pf->inv_capacity=p; p+=ncell;
+  pf->est_SOC=p; p+=ncell;
+  pf->est_C1Q=p; p+=ncell;
+  pf->last=(int *)p;
+  pf->now=(unsigned char *)(pf->last+n);
+  pf->ncell=ncell;
+  pf->n=n;
+  pf->lut=lut;
+  pf->SOC_noise=config->SOC_noise;
+  pf->C1Q_noise=config->C1Q_noise;
+  pf->inv_volts_var=1.0f/(config->volts_noise*config->volts_noise);
+  pf->seed=seed;
+  for (int c=0;c<ncell;c++) {
+    for (int i=0;i<n;i++) {
+      float S=config->SOC+config->SOC_sigma*battery_particle_normal(seed^battery_particle_hash(c*n+i));
+      pf->SOC[0][(size_t)c*n+i]=S<0.0f?0.0f:S>1.0f?1.0f:S;
+      pf->C1Q[0][(size_t)c*n+i]=0.0f;
+    }
+    pf->now[c]=0;
+    pf->last_amps[c]=0.0f;
+    pf->inv_capacity[c]=1.0f/(capacityAh*3600.0f);
+    pf->est_SOC[c]=config->SOC;
+    pf->est_C1Q[c]=0.0f;
+  }
+  return 0;
+}
+
+void battery_particle_free(struct battery_particle *pf)
+{
+  free(pf->mem);
+  memset(pf,0,sizeof(*pf));
+}
+
+/* Resample this cell's particles systematically into the other buffer,
+   from their weights, which sum to total */
+void battery_particle_systematic(struct battery_particle *pf,int c,double total,float u)
+{
+  int n=pf->n;
+  const float *restrict weight=pf->weight;
+  int *restrict last=pf->last; // particle i's copies end at slot last[i]
+  float scale=(float)(n/total), hi=0.0f, lo=0.0f;
+  int i=0;
+#if defined(__AVX2__)
+  __m256 vscale=_mm256_set1_ps(scale), vu=_mm256_set1_ps(u);
+  for (;i+8<=n;i+=8) {
+    // inclusive prefix sum of eight weights, as in battery_coulomb_scan
+    __m256 x=_mm256_loadu_ps(weight+i);
+    x=_mm256_add_ps(x,_mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(x),4)));
+    x=_mm256_add_ps(x,_mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(x),8)));
+    __m256 low_total=_mm256_permute_ps(x,_MM_SHUFFLE(3,3,3,3));
+    x=_mm256_add_ps(x,_mm256_permute2f128_ps(low_total,low_total,0x08));
+    __m256 cum=_mm256_add_ps(_mm256_set1_ps(hi),_mm256_add_ps(x,_mm256_set1_ps(lo)));
+    __m256 slot=_mm256_floor_ps(_mm256_sub_ps(_mm256_mul_ps(cum,vscale),vu));
+    _mm256_storeu_si256((__m256i *)(last+i),_mm256_cvtps_epi32(slot));
+    float block[8];
+    _mm256_storeu_ps(block,x);
+    battery_coulomb_add(&hi,&lo,block[7]);
+  }
+#endif
+  for (;i<n;i++) {
+    battery_coulomb_add(&hi,&lo,weight[i]);
+    last[i]=(int)floorf((hi+lo)*scale-u);
+  }
+  size_t base=(size_t)c*n;
+  int now=pf->now[c];
+  const float *restrict SOC=pf->SOC[now]+base, *restrict C1Q=pf->C1Q[now]+base;
+  float *restrict to_SOC=pf->SOC[!now]+base, *restrict to_C1Q=pf->C1Q[!now]+base;
+  int j=0;
+  for (i=0;i<n;i++) {
+    int end=last[i]<n-1?last[i]:n-1;
+    for (;j<=end;j++) { to_SOC[j]=SOC[i]; to_C1Q[j]=C1Q[i]; }
+  }
+  // rounding can leave the last slot short of the total
+  for (;j<n;j++) { to_SOC[j]=SOC[n-1]; to_C1Q[j]=C1Q[n-1]; }
+  pf->now[c]=!now;
+}
+
+/* Step every cell dt seconds on from its last measurement (dt=0 for the
+   first), and weight its particles by these measurements of current
+   (amps), per-cell voltage and cell temperature (deg C).  Leaves each
+   cell's estimate in est_SOC and est_C1Q. */
+void battery_particle_step(struct battery_particle *pf,float dt,
+  const float *amps,const float *volts,const float *tempC)
+{
+  int n=pf->n;
+  float SOC_sigma=pf->SOC_noise*sqrtf(dt), C1Q_sigma=pf->C1Q_noise*sqrtf(dt);
+  uint32_t step=pf->step++;
+  for (int c=0;c<pf->ncell;c++) {
+    // the tables at this cell's temperature: one row per parameter, by SOC
+    float row[battery_replay_params][battery_model_table_SOCs], param[battery_replay_params];
+    for (int s=0;s<battery_model_table_SOCs;s++) {
+      battery_replay_lookup(pf->lut,s*(1.0f/(battery_model_table_SOCs-1)),tempC[c],param);
+      for (int p=0;p<battery_replay_params;p++) row[p][s]=param[p];
+    }
+    float *restrict SOC=pf->SOC[pf->now[c]]+(size_t)c*n, *restrict C1Q=pf->C1Q[pf->now[c]]+(size_t)c*n;
+    float *restrict weight=pf->weight;
+    float I=pf->last_amps[c], A=amps[c], V=volts[c], drop=I*dt*pf->inv_capacity[c];
+    float half_inv_var=0.5f*pf->inv_volts_var;
+    uint32_t key=pf->seed^battery_particle_hash(step*0x9e3779b9U^c);
+    float best=INFINITY;
+    for (int i=0;i<n;i++) {
+      // predict: the model with the last current, plus noise
+      float S=SOC[i]-drop+SOC_sigma*battery_particle_normal(key+2*i);
+      S=S<0.0f?0.0f:S>1.0f?1.0f:S;
+      float x=S*(battery_model_table_SOCs-1);
+      int s0=(int)x;
+      if (s0>battery_model_table_SOCs-2) s0=battery_model_table_SOCs-2;
+      float f=x-s0;
+      float Em=row[battery_replay_Em][s0]+(row[battery_replay_Em][s0+1]-row[battery_replay_Em][s0])*f;
+      float R0=row[battery_replay_R0][s0]+(row[battery_replay_R0][s0+1]-row[battery_replay_R0][s0])*f;
+      float R1=row[battery_replay_R1][s0]+(row[battery_replay_R1][s0+1]-row[battery_replay_R1][s0])*f;
+      float C1=row[battery_replay_C1][s0]+(row[battery_replay_C1][s0+1]-row[battery_replay_C1][s0])*f;
+      float tau=R1*C1, settled=I*tau;
+      float Q=settled+(C1Q[i]-settled)*expf(-dt/tau)+C1Q_sigma*battery_particle_normal(key+2*i+1);
+      SOC[i]=S;
+      C1Q[i]=Q;
+      // weight: squared voltage error over the noise variance, as a log
+      float err=V-(Em-Q/C1-R0*A);
+      weight[i]=err*err*half_inv_var;
+      best=fminf(best,weight[i]);
+    }
+    double sum=0, sum_sq=0, mean_SOC=0, mean_C1Q=0;
+    for (int i=0;i<n;i++) {
+      float w=expf(best-weight[i]);
+      weight[i]=w;
+      sum+=w; sum_sq+=(double)w*w;
+      mean_SOC+=w*SOC[i];
+      mean_C1Q+=w*C1Q[i];
+    }
+    pf->est_SOC[c]=mean_SOC/sum;
+    pf->est_C1Q[c]=mean_C1Q/sum;
+    pf->last_amps[c]=A;
+    if (sum*sum<battery_particle_resample*n*sum_sq)
+    { // effective sample size (sum w)^2/sum w^2 too small
+      float u=(battery_particle_hash(key^0x85ebca6bU)>>8)*(1.0f/16777216.0f);
+      battery_particle_systematic(pf,c,sum,u);
+      pf->resamples++;
+    }
+  }
+}
+
+#endif
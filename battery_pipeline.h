@@ -0,0 +1,338 @@
+/**
+  Log file to model error in one pass: parse, simulate and score stages
+  running concurrently on their own threads.
+
+  The stages pass fixed-size chunks of sample columns along bounded
+  lock-free queues:
+      parse -> simulate -> score -> (back to parse, to be refilled)
+  A fixed pool of chunks circulates around this loop, so however large the
+  log set, memory use stays constant, and a slow stage holds the stages
+  upstream of it back instead of letting data pile up.
+
+  The parse stage streams each CSV file (or each CSV member of a zip
+  archive) through the incremental parser, moving samples out of the
+  parser into chunks as soon as they're parsed.  The simulate stage replays
+  the cell model against the logged current and temperature
+  (battery_replay.h), scoring its per-cell voltage against the logged
+  "Avg v/cell" by SOC, temperature and load band as it goes
+  (battery_score.h), and the score stage adds each chunk's partial score
+  into its run's total.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_PIPELINE_H
+#define BATTERY_PIPELINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "battery_log.h"
+#include "battery_zip.h"
+#include "battery_queue.h"
+#include "battery_replay.h"
+#include "battery_catalog.h"
+
+#define battery_chunk_len 1024 /* samples per chunk */
+#define battery_pipeline_chunks 32 /* chunks circulating between stages */
+#define battery_pipeline_read_len 262144 /* bytes read from a CSV file at a time */
+
+/* A run of up to battery_chunk_len samples on its way down the pipeline */
+struct battery_chunk {
+  int source; /* index of the input log, or -1 to mark the end of all input */
+  int run;    /* run within that log */
+  int first, last; /* 1 if this chunk starts / ends its run */
+  int n;      /* number of samples */
+  struct battery_log_info info; /* the run's metadata */
+  float col[battery_log_columns][battery_chunk_len]; /* logged columns */
+  float model[battery_chunk_len]; /* simulated per-cell voltage */
+  struct battery_score score; /* model error over this chunk */
+};
+
+/* One input log: a CSV file, or a CSV member of a zip archive */
+struct battery_pipeline_source {
+  char name[256];
+  int zip;    /* archive holding this log, or -1 for a plain file */
+  int entry;  /* member of that archive */
+  int status; /* 0 if read, -1 if it couldn't be read */
+  float ambientT; /* the chamber's temperature from the name (deg C), NAN if not given */
+};
+
+/* Model error over one run */
+struct battery_pipeline_run {
+  int source, run;
+  struct battery_log_info info;
+  struct battery_score score;
+};
+
+struct battery_pipeline {
+  int nsource;
+  struct battery_pipeline_source *source;
+  int nzip;
+  struct battery_zip *zip;
+
+  struct battery_replay_config replay; /* how to simulate each run */
+  struct battery_replay_lut lut;       /* model parameters */
+  struct battery_score_config bands;   /* how to split up the error */
+
+  struct battery_chunk *chunk; /* the pool */
+  struct battery_queue free, parsed, simulated;
+
+  int nrun, maxrun;
+  struct battery_pipeline_run *runs; /* results, in input order */
+  long samples;
+};
+
+
+/********* Parse stage ***********/
+
+/* Parse stage state while streaming one log */
+struct battery_pipeline_reader {
+  struct battery_pipeline *p;
+  struct battery_zip_stream stream;
+  int source;
+  int run;     /* runs with samples so far in this log */
+  int started; /* 1 once the current run has sent samples */
+  struct battery_chunk *c; /* chunk being filled, or 0 */
+};
+
+/* Send the chunk being filled down the pipeline */
+void battery_pipeline_send(struct battery_pipeline_reader *r,int last)
+{
+  r->c->last=last;
+  battery_queue_push(&r->p->parsed,r->c);
+  r->c=0;
+}
+
+/* Move the samples parsed so far out of the parser into chunks.
+   Runs before the parser's current one are finished; at the end of the
+   log, so is the current one. */
+void battery_pipeline_drain(struct battery_pipeline_reader *r,int end)
+{
+  struct battery_log_parser *parser=&r->stream.parser;
+  for (int l=0;l<parser->nlog;l++) {
+    struct battery_log *log=&parser->log[l];
+    for (int i=0;i<log->n;) {
+      if (!r->c) {
+        r->c=(struct battery_chunk *)battery_queue_pop(&r->p->free);
+        r->c->source=r->source;
+        r->c->run=r->run;
+        r->c->first=!r->started;
+        r->c->n=0;
+        r->c->info=log->info;
+        r->started=1;
+      }
+      int n=log->n-i;
+      if (n>battery_chunk_len-r->c->n) n=battery_chunk_len-r->c->n;
+      for (int k=0;k<battery_log_columns;k++)
+        memcpy(r->c->col[k]+r->c->n,log->col[k]+i,n*sizeof(float));
+      r->c->n+=n;
+      i+=n;
+      if (r->c->n==battery_chunk_len) battery_pipeline_send(r,0);
+    }
+    log->n=0; // samples now belong to the pipeline
+
+    if ((l<parser->nlog-1 || end) && r->started)
+    { // end of this run
+      if (!r->c) {
+        r->c=(struct battery_chunk *)battery_queue_pop(&r->p->free);
+        r->c->source=r->source;
+        r->c->run=r->run;
+        r->c->first=0;
+        r->c->n=0;
+        r->c->info=log->info;
+      }
+      battery_pipeline_send(r,1);
+      r->run++;
+      r->started=0;
+    }
+  }
+  // Keep only the run still being parsed
+  for (int l=0;l<parser->nlog-1;l++)
+    for (int k=0;k<battery_log_columns;k++) free(parser->log[l].col[k]);
+  if (parser->nlog>1) {
+    parser->log[0]=parser->log[parser->nlog-1];
+    parser->nlog=1;
+  }
+}
+
+int battery_pipeline_read_chunk(void *user,const char *buf,size_t len)
+{
+  struct battery_pipeline_reader *r=(struct battery_pipeline_reader *)user;
+  battery_zip_stream_chunk(&r->stream,buf,len);
+  battery_pipeline_drain(r,0);
+  return 0;
+}
+
+/* Stream one log down the pipeline.  Returns 0, or -1 if it can't be read. */
+int battery_pipeline_read(struct battery_pipeline *p,int s,char *buf)
+{
+  struct battery_pipeline_reader *r=(struct battery_pipeline_reader *)calloc(1,sizeof(struct battery_pipeline_reader));
+  r->p=p;
+  r->source=s;
+  battery_log_parser_init(&r->stream.parser);
+  int err=0;
+  const struct battery_pipeline_source *src=&p->source[s];
+  if (src->zip>=0) err=battery_zip_read(&p->zip[src->zip],src->entry,battery_pipeline_read_chunk,r);
+  else {
+    FILE *f=fopen(src->name,"rb");
+    if (!f) err=-1;
+    else {
+      size_t got;
+      while ((got=fread(buf,1,battery_pipeline_read_len,f))>0) battery_pipeline_read_chunk(r,buf,got);
+      fclose(f);
+    }
+  }
+  battery_log_parse(&r->stream.parser,r->stream.buf,r->stream.len); // last line may lack a newline
+  battery_pipeline_drain(r,1);
+  battery_log_free(r->stream.parser.log,r->stream.parser.nlog);
+  free(r->stream.buf);
+  free(r);
+  return err?-1:0;
+}
+
+void *battery_pipeline_parse_stage(void *arg)
+{
+  struct battery_pipeline *p=(struct battery_pipeline *)arg;
+  char *buf=(char *)malloc(battery_pipeline_read_len);
+  for (int s=0;s<p->nsource;s++) p->source[s].status=battery_pipeline_read(p,s,buf);
+  free(buf);
+  struct battery_chunk *c=(struct battery_chunk *)battery_queue_pop(&p->free);
+  c->source=-1; // end of input
+  battery_queue_push(&p->parsed,c);
+  return 0;
+}
+
+
+/********* Simulate stage ***********/
+
+void *battery_pipeline_simulate_stage(void *arg)
+{
+  struct battery_pipeline *p=(struct battery_pipeline *)arg;
+  struct battery_replay replay;
+  while (1) {
+    struct battery_chunk *c=(struct battery_chunk *)battery_queue_pop(&p->parsed);
+    if (c->source<0) { battery_queue_push(&p->simulated,c); break; }
+    if (c->first) {
+      struct battery_replay_config config=p->replay;
+      // without a nominal temperature, the first valid reading of the run's first chunk
+      config.ambientT=battery_log_nominal_temp(c->col[battery_log_tempC],c->n,p->source[c->source].ambientT,config.ambientT);
+      battery_replay_start(&replay,&p->lut,&config,&c->info);
+    }
+    battery_score_init(&c->score,&p->bands);
+    battery_replay_run(&replay,c->col[battery_log_time],c->col[battery_log_amps],
+      c->col[battery_log_tempC],c->col[battery_log_cellV],c->n,c->model,0,&c->score);
+    battery_queue_push(&p->simulated,c);
+  }
+  return 0;
+}
+
+
+/********* Score stage ***********/
+
+void *battery_pipeline_score_stage(void *arg)
+{
+  struct battery_pipeline *p=(struct battery_pipeline *)arg;
+  while (1) {
+    struct battery_chunk *c=(struct battery_chunk *)battery_queue_pop(&p->simulated);
+    if (c->source<0) break;
+    if (c->first) {
+      if (p->nrun>=p->maxrun) {
+        p->maxrun=p->maxrun?2*p->maxrun:64;
+        p->runs=(struct battery_pipeline_run *)realloc(p->runs,p->maxrun*sizeof(struct battery_pipeline_run));
+      }
+      struct battery_pipeline_run *r=&p->runs[p->nrun++];
+      memset(r,0,sizeof(*r));
+      r->source=c->source;
+      r->run=c->run;
+      r->info=c->info;
+      battery_score_init(&r->score,&p->bands);
+    }
+    battery_score_merge(&p->runs[p->nrun-1].score,&c->score);
+    p->samples+=c->n;
+    battery_queue_push(&p->free,c);
+  }
+  return 0;
+}
+
+
+/********* Interface ***********/
+
+/* Set up an empty pipeline, simulating with the default replay settings
+   and the model's built-in tables, and scoring with the default bands
+   (any of which may be changed before running). */
+void battery_pipeline_init(struct battery_pipeline *p)
+{
+  memset(p,0,sizeof(*p));
+  battery_replay_config_init(&p->replay);
+  battery_replay_lut_default(&p->lut);
+  battery_score_config_init(&p->bands);
+}
+
+/* Add one input log */
+struct battery_pipeline_source *battery_pipeline_add_source(struct battery_pipeline *p,const char *name,int zip,int entry)
+{
+  p->source=(struct battery_pipeline_source *)realloc(p->source,(p->nsource+1)*sizeof(struct battery_pipeline_source));
+  struct battery_pipeline_source *src=&p->source[p->nsource++];
+  snprintf(src->name,sizeof(src->name),"%s",name);
+  src->zip=zip;
+  src->entry=entry;
+  src->status=0;
+  struct battery_catalog_entry e;
+  memset(&e,0,sizeof(e));
+  battery_catalog_parse_name(&e,name);
+  src->ambientT=e.tempC;
+  return src;
+}
+
+/* Add this CSV file, or every CSV log in this zip archive, as inputs.
+   Returns 0, or -1 if a zip archive can't be opened. */
+int battery_pipeline_add(struct battery_pipeline *p,const char *filename)
+{
+  size_t len=strlen(filename);
+  if (len<=4 || strcasecmp(filename+len-4,".zip")) {
+    battery_pipeline_add_source(p,filename,-1,0);
+    return 0;
+  }
+  p->zip=(struct battery_zip *)realloc(p->zip,(p->nzip+1)*sizeof(struct battery_zip));
+  struct battery_zip *zip=&p->zip[p->nzip];
+  if (battery_zip_open(zip,filename)!=0) return -1;
+  for (int e=0;e<zip->n;e++)
+    if (battery_zip_is_csv(&zip->entry[e]))
+      battery_pipeline_add_source(p,battery_zip_basename(&zip->entry[e]),p->nzip,e);
+  p->nzip++;
+  return 0;
+}
+
+/* Stream every input through the three stages, filling in p->runs */
+void battery_pipeline_run(struct battery_pipeline *p)
+{
+  p->chunk=(struct battery_chunk *)malloc(battery_pipeline_chunks*sizeof(struct battery_chunk));
+  battery_queue_init(&p->free,battery_pipeline_chunks);
+  battery_queue_init(&p->parsed,battery_pipeline_chunks);
+  battery_queue_init(&p->simulated,battery_pipeline_chunks);
+  for (int i=0;i<battery_pipeline_chunks;i++) battery_queue_push(&p->free,&p->chunk[i]);
+
+  pthread_t parse, simulate, score;
+  pthread_create(&parse,0,battery_pipeline_parse_stage,p);
+  pthread_create(&simulate,0,battery_pipeline_simulate_stage,p);
+  pthread_create(&score,0,battery_pipeline_score_stage,p);
+  pthread_join(parse,0);
+  pthread_join(simulate,0);
+  pthread_join(score,0);
+}
+
+void battery_pipeline_close(struct battery_pipeline *p)
+{
+  battery_queue_free(&p->free);
+  battery_queue_free(&p->parsed);
+  battery_queue_free(&p->simulated);
+  free(p->chunk);
+  free(p->runs);
+  free(p->source);
+  for (int z=0;z<p->nzip;z++) battery_zip_close(&p->zip[z]);
+  free(p->zip);
+  memset(p,0,sizeof(*p));
+}
+
+#endif
@@ -0,0 +1,217 @@
+/**
+  First-guess R0, R1 and C1 tables straight from the pulse tests.
+
+  The 2.5C tests draw a steady current for 144 seconds, then rest for
+  900.  When the load comes off, the voltage jumps back by I*R0 at once,
+  then recovers the rest of the way as C1 discharges through R1.  So each
+  pulse's rest is fitted with
+      V(t) = Vinf - A exp(-t/tau)
+  (t from the first sample at rest), which is linear least squares in
+  Vinf and A for a given tau, leaving a one-dimensional search over tau,
+  from a fraction of a sample interval up.  Then the jump back at t=0
+  gives R0 = (Vinf - A - V_loaded)/I, and with C1's voltage having built
+  up as I*R1*(1-exp(-on/tau)) over the pulse, R1 = A/(I*(1-exp(-on/tau)))
+  and C1 = tau/R1.
+
+  Only the end of each pulse is used, since the start has no clean
+  reference.  The charger ramps the current down over a sample or two,
+  so V_loaded and I are taken from the last sample before the ramp, and
+  the ramp's samples are left out of the fit.  Each pulse's values belong
+  to its SOC and cell temperature there, and are spread onto the table
+  grid with the lookup's own bilinear weights, averaged as logarithms.
+  Grid nodes with enough pulses near them are replaced; the rest keep
+  their old values.
+
+  A whole corpus takes well under a second, which makes a good starting
+  point for battery_fit.h.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_PULSE_H
+#define BATTERY_PULSE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "battery_log.h"
+#include "battery_cache.h"
+#include "battery_replay.h"
+#include "battery_gradient.h"
+#include "battery_thermal.h"
+
+#define battery_pulse_rest_fraction 0.01f /* current below this fraction of the peak counts as resting */
+#define battery_pulse_min_rest 60.0f /* seconds of rest needed to fit the recovery */
+#define battery_pulse_taus 32 /* time constants tried, log spaced from battery_pulse_min_tau samples to the rest's length */
+#define battery_pulse_min_tau 0.25 /* shortest time constant tried, in sample intervals */
+#define battery_pulse_ramp 0.98f /* a loaded sample below this fraction of the one before is the charger ramping down */
+#define battery_pulse_refine 24 /* golden section steps around the best of those */
+#define battery_pulse_min_weight 0.5 /* interpolation weight a grid node needs before it's replaced */
+
+/* What one pulse says about the cell */
+struct battery_pulse {
+  int begin, end;   /* samples [begin,end) under load */
+  float SOC, cellT; /* as the load came off */
+  float amps;       /* steady load current before it came off */
+  float R0, R1, C1; /* ohms and farads */
+  float tau;        /* R1*C1 (seconds) */
+  float rms;        /* fit error over the rest (volts) */
+};
+
+/* Least squares fit of V = Vinf - A*exp(-x/tau) to n samples.  Returns the sum of squared errors. */
+double battery_pulse_fit(const float *x,const float *V,int n,double tau,double *Vinf,double *A)
+{
+  double se=0, see=0, sv=0, sev=0;
+  for (int i=0;i<n;i++) {
+    double e=exp(-x[i]/tau);
+    se+=e; see+=e*e; sv+=V[i]; sev+=e*V[i];
+  }
+  double det=n*see-se*se;
+  if (!(fabs(det)>0)) { *Vinf=sv/n; *A=0; return INFINITY; }
+  // V = Vinf + B*e, with B=-A
+  double B=(n*sev-se*sv)/det;
+  *Vinf=(sv-B*se)/n;
+  *A=-B;
+  double sse=0;
+  for (int i=0;i<n;i++) {
+    double r=*Vinf+B*exp(-x[i]/tau)-V[i];
+    sse+=r*r;
+  }
+  return sse;
+}
+
+/* Fit the rest after one pulse of amps that ended at sample last, the
+   last one drawing the steady current: samples [r0,r1), with t=0 at r0,
+   the first one at rest.  Returns 0 and fills in p's R0, R1, C1 and tau,
+   or -1 if it doesn't fit. */
+int battery_pulse_rest(const float *time,const float *cellV,int last,int r0,int r1,
+  float amps,float on_s,struct battery_pulse *p)
+{
+  int n=r1-r0;
+  float *x=(float *)malloc(n*sizeof(float));
+  if (!x) return -1;
+  for (int i=0;i<n;i++) x[i]=time[r0+i]-time[r0];
+  double span=x[n-1], dt=span/(n-1);
+
+  // coarse search over log tau, then golden section around the best
+  double lo=log(battery_pulse_min_tau*dt), hi=log(span), step=(hi-lo)/(battery_pulse_taus-1);
+  double Vinf, A, best=INFINITY;
+  int best_k=0;
+  for (int k=0;k<battery_pulse_taus;k++) {
+    double sse=battery_pulse_fit(x,cellV+r0,n,exp(lo+k*step),&Vinf,&A);
+    if (sse<best) { best=sse; best_k=k; }
+  }
+  int err=best_k==0 || best_k==battery_pulse_taus-1; // a time constant outside what the rest can show
+  double a=lo+(best_k-1)*step, b=lo+(best_k+1)*step, g=0.5*(sqrt(5.0)-1.0);
+  double c=b-g*(b-a), d=a+g*(b-a);
+  double fc=battery_pulse_fit(x,cellV+r0,n,exp(c),&Vinf,&A), fd=battery_pulse_fit(x,cellV+r0,n,exp(d),&Vinf,&A);
+  for (int k=0;k<battery_pulse_refine;k++) {
+    if (fc<fd) { b=d; d=c; fd=fc; c=b-g*(b-a); fc=battery_pulse_fit(x,cellV+r0,n,exp(c),&Vinf,&A); }
+    else { a=c; c=d; fc=fd; d=a+g*(b-a); fd=battery_pulse_fit(x,cellV+r0,n,exp(d),&Vinf,&A); }
+  }
+  double tau=exp(0.5*(a+b));
+  double sse=battery_pulse_fit(x,cellV+r0,n,tau,&Vinf,&A);
+  free(x);
+
+  double I=amps, charged=1.0-exp(-on_s/tau);
+  p->tau=tau;
+  p->R0=(Vinf-A-cellV[last])/I;
+  p->R1=A/(I*charged);
+  p->C1=tau/p->R1;
+  p->rms=sqrt(sse/n);
+  if (err || !(p->R0>0) || !(p->R1>0) || !(p->C1>0)) return -1;
+  return 0;
+}
+
+/* Find the pulses in this run, and what each says about the cell.  The
+   run's chamber was at ambientT (deg C), used where the logged
+   temperature isn't.  Stores up to max pulses to out; returns how many
+   fitted. */
+int battery_pulse_extract(const struct battery_log *log,float ambientT,struct battery_pulse *out,int max)
+{
+  int n=log->n;
+  const float *time=log->col[battery_log_time], *amps=log->col[battery_log_amps], *tempC=log->col[battery_log_tempC];
+  float capacity=log->info.rated_Ah*3600.0f;
+  if (n<2 || !(capacity>0)) return 0;
+  float peak=0.0f;
+  for (int i=0;i<n;i++) if (amps[i]>peak) peak=amps[i];
+  if (!(peak>0)) return 0;
+  ambientT=battery_log_nominal_temp(tempC,n,ambientT,NAN);
+  // edges as battery_cache finds them, with hysteresis against noise
+  float on=peak*battery_cache_pulse_fraction, off=on*0.5f, rest=peak*battery_pulse_rest_fraction;
+
+  int npulse=0, begin=-1;
+  double SOC=1.0;
+  for (int i=0;i<n && npulse<max;i++) {
+    if (i>0) SOC-=amps[i-1]*(time[i]-time[i-1])/capacity;
+    if (begin<0) { if (amps[i]>on) begin=i; continue; }
+    if (amps[i]>=off) continue;
+    // load came off at sample i: step back over the charger's ramp to the last steady sample
+    int last=i-1, r0=i;
+    while (last>begin && amps[last]<amps[last-1]*battery_pulse_ramp) last--;
+    while (r0<n && amps[r0]>=rest) r0++;
+    int r1=r0;
+    while (r1<n && amps[r1]<on) r1++;
+    struct battery_pulse *p=&out[npulse];
+    p->begin=begin;
+    p->end=i;
+    p->amps=amps[last];
+    p->SOC=SOC;
+    for (int k=last+1;k<i;k++) p->SOC+=amps[k-1]*(time[k]-time[k-1])/capacity;
+    p->cellT=battery_log_temp_plausible(tempC[last],ambientT)?tempC[last]:ambientT;
+    if (p->cellT==p->cellT && r1-r0>=3 && time[r1-1]-time[r0]>=battery_pulse_min_rest
+        && battery_pulse_rest(time,log->col[battery_log_cellV],last,r0,r1,amps[last],time[last]-time[begin],p)==0)
+      npulse++;
+    begin=-1;
+  }
+  return npulse;
+}
+
+
+/********* Onto the table grid ***********/
+
+/* Weighted sums of the logs of R0, R1 and C1 at each table node */
+struct battery_pulse_grid {
+  double sum[battery_model_table_temps][battery_model_table_SOCs][battery_replay_params];
+  double weight[battery_model_table_temps][battery_model_table_SOCs];
+  int npulse;
+};
+
+void battery_pulse_grid_init(struct battery_pulse_grid *g)
+{
+  memset(g,0,sizeof(*g));
+}
+
+/* Spread this pulse onto the four nodes around it, with the lookup's weights */
+void battery_pulse_grid_add(struct battery_pulse_grid *g,const struct battery_replay_lut *lut,const struct battery_pulse *p)
+{
+  struct battery_gradient_cell c;
+  battery_gradient_find(lut,p->SOC,p->cellT,&c);
+  double s=c.s, t=c.t;
+  int ts[4]={c.t0,c.t0,c.t1,c.t1}, ss[4]={c.s0,c.s1,c.s0,c.s1};
+  double w[4]={(1-s)*(1-t),s*(1-t),(1-s)*t,s*t};
+  double value[battery_replay_params]={0.0,log(p->R0),log(p->R1),log(p->C1)};
+  for (int k=0;k<4;k++) {
+    if (w[k]<=0.0) continue;
+    g->weight[ts[k]][ss[k]]+=w[k];
+    for (int q=battery_replay_R0;q<battery_replay_params;q++) g->sum[ts[k]][ss[k]][q]+=w[k]*value[q];
+  }
+  g->npulse++;
+}
+
+/* Replace the R0, R1 and C1 entries of lut at every node with enough
+   weight by the pulses' weighted geometric mean.  Returns the number of
+   nodes replaced. */
+int battery_pulse_grid_apply(const struct battery_pulse_grid *g,struct battery_replay_lut *lut)
+{
+  int replaced=0;
+  for (int t=0;t<battery_model_table_temps;t++)
+    for (int s=0;s<battery_model_table_SOCs;s++) {
+      double w=g->weight[t][s];
+      if (w<battery_pulse_min_weight) continue;
+      for (int q=battery_replay_R0;q<battery_replay_params;q++) lut->v[t][s][q]=exp(g->sum[t][s][q]/w);
+      replaced++;
+    }
+  return replaced;
+}
+
+#endif
@@ -0,0 +1,101 @@
+/**
+  Bounded lock-free queue between two pipeline stages.
+
+  Exactly one thread pushes and one thread pops, so the only shared state
+  is the head and tail counters, each on its own cache line.  A full queue
+  makes the producer wait for the consumer to catch up (backpressure), and
+  an empty queue makes the consumer wait for the producer; waiting threads
+  spin briefly and then yield the core, so stages can share fewer cores
+  than there are stages.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_QUEUE_H
+#define BATTERY_QUEUE_H
+
+#include <stdlib.h>
+#include <sched.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define battery_queue_spins 64 /* polls before yielding the core */
+
+struct battery_queue {
+  void **slot;
+  unsigned mask; /* capacity-1, capacity a power of two */
+  unsigned head __attribute__((aligned(64))); /* next slot to pop (written by consumer) */
+  unsigned long empty_waits; /* times the consumer found nothing to pop */
+  unsigned tail __attribute__((aligned(64))); /* next slot to push (written by producer) */
+  unsigned long full_waits; /* times the producer was held back */
+};
+
+/* Make an empty queue holding at least this many items */
+void battery_queue_init(struct battery_queue *q,int capacity)
+{
+  unsigned len=1;
+  while (len<(unsigned)capacity) len*=2;
+  q->slot=(void **)malloc(len*sizeof(void *));
+  q->mask=len-1;
+  q->head=q->tail=0;
+  q->empty_waits=q->full_waits=0;
+}
+
+void battery_queue_free(struct battery_queue *q)
+{
+  free(q->slot);
+  q->slot=0;
+}
+
+/* Wait a little, then give up the core */
+static inline void battery_queue_pause(int *spins)
+{
+  if (++*spins<battery_queue_spins) {
+#if defined(__SSE2__)
+    _mm_pause();
+#endif
+  }
+  else { sched_yield(); *spins=0; }
+}
+
+/* Add this item, or return 0 if the queue is full */
+static inline int battery_queue_try_push(struct battery_queue *q,void *item)
+{
+  unsigned tail=q->tail;
+  if (tail-__atomic_load_n(&q->head,__ATOMIC_ACQUIRE)>q->mask) return 0;
+  q->slot[tail&q->mask]=item;
+  __atomic_store_n(&q->tail,tail+1,__ATOMIC_RELEASE);
+  return 1;
+}
+
+/* Remove the oldest item, or return 0 if the queue is empty */
+static inline void *battery_queue_try_pop(struct battery_queue *q)
+{
+  unsigned head=q->head;
+  if (head==__atomic_load_n(&q->tail,__ATOMIC_ACQUIRE)) return 0;
+  void *item=q->slot[head&q->mask];
+  __atomic_store_n(&q->head,head+1,__ATOMIC_RELEASE);
+  return item;
+}
+
+/* Add this (non-null) item, waiting while the queue is full */
+void battery_queue_push(struct battery_queue *q,void *item)
+{
+  if (battery_queue_try_push(q,item)) return;
+  q->full_waits++;
+  int spins=0;
+  while (!battery_queue_try_push(q,item)) battery_queue_pause(&spins);
+}
+
+/* Remove the oldest item, waiting while the queue is empty */
+void *battery_queue_pop(struct battery_queue *q)
+{
+  void *item=battery_queue_try_pop(q);
+  if (item) return item;
+  q->empty_waits++;
+  int spins=0;
+  while (!(item=battery_queue_try_pop(q))) battery_queue_pause(&spins);
+  return item;
+}
+
+#endif
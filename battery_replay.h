@@ -0,0 +1,326 @@
+/**
+  Streaming replay of recorded runs through the cell model.
+
+  The logged current drives the model sample by sample, with each sample's
+  current held until the next sample's timestamp, and the logged
+  temperature is the ambient the cell exchanges heat with (or, for
+  checking the thermal model, the cell's own temperature, with the
+  ambient held fixed).  The model's
+  terminal voltage for one cell is compared against the logged per-cell
+  voltage ("Avg v/cell", or pack voltage / cells) to give a residual stream.
+
+  This does the same arithmetic as calling battery_model_voltage,
+  battery_model_electrical and battery_model_thermal each sample, but
+  restructured for speed:
+    - the four parameter tables are interleaved, so one bilinear lookup
+      finds Em, R0, R1 and C1 together;
+    - parameters looked up for a sample's voltage are kept and reused for
+      the electrical step that follows it, so there is one lookup per
+      sample instead of two;
+    - nothing is allocated once a run has started.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_REPLAY_H
+#define BATTERY_REPLAY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "battery_log.h"
+#include "isaac_battery_model.h"
+#include "battery_score.h"
+
+#define battery_replay_cell_mass 55.0f /* grams per cell if the log doesn't say (0.165 kg 3-cell pack) */
+
+/* Parameters, in the order they're interleaved in a lookup table */
+enum {
+  battery_replay_Em=0,
+  battery_replay_R0,
+  battery_replay_R1,
+  battery_replay_C1,
+  battery_replay_params
+};
+
+/* The four model parameter tables, interleaved by table cell */
+struct battery_replay_lut {
+  float v[battery_model_table_temps][battery_model_table_SOCs][battery_replay_params];
+  float inv_spacing[battery_model_table_temps]; /* 1/(next temperature - this one) */
+};
+
+/* Interleave these parameter tables */
+void battery_replay_lut_init(struct battery_replay_lut *lut,
+  const struct battery_model_table *Em,const struct battery_model_table *R0,
+  const struct battery_model_table *R1,const struct battery_model_table *C1)
+{
+  for (int t=0;t<battery_model_table_temps;t++)
+    for (int s=0;s<battery_model_table_SOCs;s++) {
+      lut->v[t][s][battery_replay_Em]=Em->values[t][s];
+      lut->v[t][s][battery_replay_R0]=R0->values[t][s];
+      lut->v[t][s][battery_replay_R1]=R1->values[t][s];
+      lut->v[t][s][battery_replay_C1]=C1->values[t][s];
+    }
+  for (int t=0;t+1<battery_model_table_temps;t++)
+    lut->inv_spacing[t]=1.0f/(battery_model_temperatures[t+1]-battery_model_temperatures[t]);
+  lut->inv_spacing[battery_model_table_temps-1]=0.0f;
+}
+
+/* Interleave the model's built-in calibration tables */
+void battery_replay_lut_default(struct battery_replay_lut *lut)
+{
+  battery_replay_lut_init(lut,&battery_model_Em,&battery_model_R0,&battery_model_R1,&battery_model_C1);
+}
+
+/* Look up all four parameters at this state of charge and cell temperature,
+   interpolating like battery_model_get_parameters. */
+static inline void battery_replay_lookup(const struct battery_replay_lut *lut,
+  float SOC,float cellT,float *param)
+{
+  float SOC_number=SOC*(battery_model_table_SOCs-1);
+  int SOC_index=(int)SOC_number;
+  if (SOC_number<0) { SOC_number=SOC_index=0; }
+  if (SOC_index>=battery_model_table_SOCs) { SOC_number=SOC_index=battery_model_table_SOCs-1; }
+  int SOC_next=SOC_index+1;
+  if (SOC_next>=battery_model_table_SOCs) SOC_next=battery_model_table_SOCs-1;
+
+  int T_index=0;
+  while (T_index+1<battery_model_table_temps
+      && battery_model_temperatures[T_index+1]<=cellT)
+      T_index++;
+  int T_next=T_index;
+  float t=0.0f;
+  if (T_index+1<battery_model_table_temps) {
+    t=(cellT-battery_model_temperatures[T_index])*lut->inv_spacing[T_index];
+    T_next=T_index+1;
+  }
+
+  float s=SOC_number-SOC_index;
+  const float *II=lut->v[T_index][SOC_index], *IN=lut->v[T_index][SOC_next];
+  const float *TI=lut->v[T_next][SOC_index], *TN=lut->v[T_next][SOC_next];
+  for (int k=0;k<battery_replay_params;k++) {
+    float I=II[k] + (IN[k]-II[k])*s;
+    float T=TI[k] + (TN[k]-TI[k])*s;
+    param[k]=I + (T-I)*t;
+  }
+}
+
+/* Settings for replaying runs */
+struct battery_replay_config {
+  float capacityAh;    /* cell capacity (amp hours), or 0 for the log's rated capacity */
+  float SOC;           /* state of charge at the start of each run */
+  float specific_heat; /* cell heat capacity (joules/(degree C * gram)) */
+  float mass;          /* grams per cell, or 0 for the log's battery weight / cells */
+  float Rvalue;        /* insulation R-value (m^2*degrees C/watt) */
+  float area;          /* area exposed to ambient (m^2) */
+  float ambientT;      /* the chamber's temperature (deg C): the ambient until the log has a
+                          plausible one (battery_log_temp_plausible), which readings are checked against.
+                          Callers without a nominal one use battery_log_nominal_temp */
+  float heat_volts;    /* reversible (entropic) heat per amp drawn (watts/amp), on top of the I^2 R losses */
+  int log_ambient;     /* 1: the logged temperature is the ambient.  0: it's the cell's,
+                          which starts at the first logged value, and ambientT stays fixed */
+};
+
+/* Default settings: a fully charged cell, thermal constants from the demo in isaac_battery_model.c */
+void battery_replay_config_init(struct battery_replay_config *c)
+{
+  c->capacityAh=0.0f;
+  c->SOC=1.0f;
+  c->specific_heat=0.9f;
+  c->mass=0.0f;
+  c->Rvalue=0.1f;
+  c->area=0.01f; // 0.1 x 0.1 m
+  c->ambientT=20.0f;
+  c->heat_volts=0.0f;
+  c->log_ambient=1;
+}
+
+/* State of one run's replay */
+struct battery_replay {
+  const struct battery_replay_lut *lut;
+  struct battery_model battery;
+  float param[battery_replay_params]; /* parameters at the current state */
+  float C1V, R1I;      /* voltage across C1 and current through R1 at the current state */
+  float last_time, last_amps; /* previous sample */
+  float ambientT;
+  float nominalT;      /* the chamber's temperature, which logged readings are checked against */
+  float inv_capacity;  /* 1/battery.capacityAs */
+  float amps_to_crate; /* 1/capacity in amp hours */
+  float conductance;   /* heat lost per degree above ambient (watts/degree C) */
+  float inv_heat_capacity; /* degrees C per joule of one cell */
+  float heat_volts;
+  int log_ambient;
+  int started;         /* 0 until the run's first sample */
+};
+
+/* Get ready to replay a run with this metadata */
+void battery_replay_start(struct battery_replay *r,const struct battery_replay_lut *lut,
+  const struct battery_replay_config *c,const struct battery_log_info *info)
+{
+  memset(r,0,sizeof(*r));
+  r->lut=lut;
+  float capacityAh=c->capacityAh>0?c->capacityAh:info->rated_Ah;
+  battery_model_init(&r->battery,capacityAh,c->SOC,c->ambientT);
+  r->inv_capacity=1.0f/r->battery.capacityAs;
+  r->amps_to_crate=1.0f/capacityAh;
+  float mass=c->mass>0?c->mass:1000.0f*info->weight_kg/info->cells;
+  if (!(mass>0)) mass=battery_replay_cell_mass;
+  r->inv_heat_capacity=1.0f/(c->specific_heat*mass);
+  r->conductance=c->area/c->Rvalue;
+  r->heat_volts=c->heat_volts;
+  r->log_ambient=c->log_ambient;
+  r->ambientT=r->nominalT=c->ambientT;
+}
+
+/* Look up the parameters at the current state, and the voltage across
+   C1 and current through R1 that follow from them. */
+static inline void battery_replay_state(struct battery_replay *r,const struct battery_model *b,
+  float *param,float *C1V,float *R1I)
+{
+  battery_replay_lookup(r->lut,b->SOC,b->cellT,param);
+  // both reciprocals can start together, instead of one divide waiting on the other
+  float inv_C1=1.0f/param[battery_replay_C1], inv_R1=1.0f/param[battery_replay_R1];
+  *C1V=b->C1Q*inv_C1;
+  *R1I=*C1V*inv_R1;
+}
+
+/* Replay n samples: time (seconds), current draw (amps) and logged
+   temperature (deg C).  Stores the model's per-cell voltage to model[i],
+   and if cellV is given, the residual model[i]-cellV[i] to residual[i]
+   and into score (banded by the model's SOC and the ambient temperature).
+   Any of the outputs may be 0.  Runs can be fed in pieces of any size. */
+void battery_replay_run(struct battery_replay *r,const float *time,const float *amps,
+  const float *tempC,const float *cellV,int n,float *model,float *residual,
+  struct battery_score *score)
+{
+  if (!cellV) { residual=0; score=0; }
+  if (n<=0) return;
+  struct battery_model b=r->battery;
+  float param[battery_replay_params];
+  memcpy(param,r->param,sizeof(param));
+  float C1V=r->C1V, R1I=r->R1I, last_time=r->last_time, last_amps=r->last_amps, ambientT=r->ambientT;
+  int i=0;
+  if (!r->started)
+  { // cell starts at the temperature it's sitting in
+    b.cellT=ambientT;
+    if (battery_log_temp_plausible(tempC[0],r->nominalT)) {
+      if (r->log_ambient) ambientT=tempC[0];
+      b.cellT=tempC[0];
+    }
+    battery_replay_state(r,&b,param,&C1V,&R1I);
+    float V=param[battery_replay_Em] - C1V - param[battery_replay_R0]*amps[0];
+    if (model) model[0]=V;
+    if (residual) residual[0]=V-cellV[0];
+    if (score) battery_score_sample(score,V-cellV[0],b.SOC,ambientT,amps[0]*r->amps_to_crate);
+    last_time=time[0];
+    last_amps=amps[0];
+    r->started=1;
+    i=1;
+  }
+  for (;i<n;i++) {
+    // previous sample's current, held until this sample (battery_model_electrical)
+    float dt=time[i]-last_time;
+    float heat=(param[battery_replay_R0]*last_amps*last_amps + C1V*R1I + r->heat_volts*last_amps)*dt;
+    float tau=param[battery_replay_R1]*param[battery_replay_C1];
+    if (dt<=tau) b.C1Q+=(last_amps-R1I)*dt;
+    else
+    { // explicit steps longer than R1*C1 blow up (C1 is tiny at SOC 0): relax exactly
+      float settled=last_amps*tau;
+      b.C1Q=settled + (b.C1Q-settled)*expf(-dt/tau);
+    }
+    b.SOC-=last_amps*dt*r->inv_capacity;
+    // battery_model_thermal
+    float cool=(b.cellT-ambientT)*r->conductance*dt;
+    b.cellT+=(heat-cool)*r->inv_heat_capacity;
+    if (r->log_ambient && battery_log_temp_plausible(tempC[i],r->nominalT)) ambientT=tempC[i];
+
+    battery_replay_state(r,&b,param,&C1V,&R1I);
+    float V=param[battery_replay_Em] - C1V - param[battery_replay_R0]*amps[i];
+    if (model) model[i]=V;
+    if (residual) residual[i]=V-cellV[i];
+    if (score) battery_score_sample(score,V-cellV[i],b.SOC,ambientT,amps[i]*r->amps_to_crate);
+    last_time=time[i];
+    last_amps=amps[i];
+  }
+  r->battery=b;
+  memcpy(r->param,param,sizeof(param));
+  r->C1V=C1V;
+  r->R1I=R1I;
+  r->last_time=last_time;
+  r->last_amps=last_amps;
+  r->ambientT=ambientT;
+}
+
+/********* Parameter files ***********/
+
+static const char *battery_replay_param_names[battery_replay_params]={"Em","R0","R1","C1"};
+
+/* Write the shortest decimal that reads back as exactly this float */
+void battery_replay_write_float(FILE *f,const char *prefix,float x)
+{
+  char buf[32];
+  for (int digits=6;digits<=9;digits++) {
+    snprintf(buf,sizeof(buf),"%.*g",digits,x);
+    if (strtof(buf,0)==x) break;
+  }
+  fprintf(f,"%s%s",prefix,buf);
+}
+
+/* Save these tables and thermal constants as text, one table row per
+   line, so a parameter set can be diffed, edited or pasted back into
+   isaac_battery_model.h.  Returns 0, or -1 if the file can't be written. */
+int battery_replay_save(const char *filename,const struct battery_replay_lut *lut,const struct battery_replay_config *c)
+{
+  FILE *f=fopen(filename,"w");
+  if (!f) return -1;
+  fprintf(f,"# Cell model parameters: table rows are deg C");
+  for (int t=0;t<battery_model_table_temps;t++) fprintf(f," %g",battery_model_temperatures[t]);
+  fprintf(f,", columns SOC 0.0 to 1.0\n");
+  for (int k=0;k<battery_replay_params;k++) {
+    fprintf(f,"%s\n",battery_replay_param_names[k]);
+    for (int t=0;t<battery_model_table_temps;t++) {
+      for (int s=0;s<battery_model_table_SOCs;s++) battery_replay_write_float(f,s?" ":"  ",lut->v[t][s][k]);
+      fprintf(f,"\n");
+    }
+  }
+  battery_replay_write_float(f,"specific_heat ",c->specific_heat);
+  battery_replay_write_float(f,"\nmass ",c->mass);
+  battery_replay_write_float(f,"\nRvalue ",c->Rvalue);
+  battery_replay_write_float(f,"\narea ",c->area);
+  battery_replay_write_float(f,"\nheat_volts ",c->heat_volts);
+  fprintf(f,"\n");
+  return fclose(f)==0?0:-1;
+}
+
+/* Load a parameter file written by battery_replay_save.  Tables or
+   constants the file doesn't mention are left as they were.
+   Returns 0, or -1 if the file can't be read or isn't understood. */
+int battery_replay_load(const char *filename,struct battery_replay_lut *lut,struct battery_replay_config *c)
+{
+  FILE *f=fopen(filename,"r");
+  if (!f) return -1;
+  char key[64];
+  int err=0;
+  while (!err && fscanf(f,"%63s",key)==1) {
+    if (key[0]=='#') { int ch; while ((ch=fgetc(f))!=EOF && ch!='\n') {} continue; }
+    int k=0;
+    while (k<battery_replay_params && strcmp(key,battery_replay_param_names[k])) k++;
+    if (k<battery_replay_params) {
+      for (int t=0;t<battery_model_table_temps && !err;t++)
+        for (int s=0;s<battery_model_table_SOCs && !err;s++)
+          if (fscanf(f,"%f",&lut->v[t][s][k])!=1) err=1;
+      continue;
+    }
+    float *value=0;
+    if (!strcmp(key,"specific_heat")) value=&c->specific_heat;
+    else if (!strcmp(key,"mass")) value=&c->mass;
+    else if (!strcmp(key,"Rvalue")) value=&c->Rvalue;
+    else if (!strcmp(key,"area")) value=&c->area;
+    else if (!strcmp(key,"heat_volts")) value=&c->heat_volts;
+    if (!value || fscanf(f,"%f",value)!=1) err=1;
+  }
+  fclose(f);
+  return err?-1:0;
+}
+
+#endif
@@ -0,0 +1,193 @@
+/**
+  Tracking each cell's drift from the tables as it ages, by recursive
+  least squares with a forgetting factor.
+
+  Every cell gets three scale factors on the tables: a on R0, b on R1 and
+  c on the rated capacity, so its model is
+      SOC = SOC0 - q/(c*capacity)     (q: charge drawn so far)
+      C1Q' = I*tau + (C1Q - I*tau)*exp(-dt/tau),  tau = b*R1*C1
+      V = Em(SOC) - C1Q/C1 - a*R0*I
+  The voltage isn't linear in b or c, so each step regresses the voltage
+  error on the voltage's derivatives with respect to (a, b, c) at the
+  current estimate (a recursive prediction error method):
+      dV/da = -R0*I
+      dV/db = -(dC1Q/db)/C1
+      dV/dc = dV/dSOC * q/(c^2*capacity) - (dC1Q/dc)/C1
+  where dC1Q/db and dC1Q/dc are carried along like C1Q itself, and dV/dSOC
+  counts R0 and C1 as well as Em: in the cold R0's slope under load
+  outweighs Em's.  Each of these costs O(1) per sample: one table lookup
+  of the parameters and their slopes along SOC, and a 3x3 covariance
+  update.  The forgetting
+  factor discounts old samples so the factors can follow slow drift;
+  while the current is steady the covariance would grow without bound
+  under it, so forgetting pauses once the covariance is back to its
+  starting size.
+
+  Cells are a structure of arrays, stepped together like battery_ekf.
+  Each starts from a known SOC, e.g. full off the charger or rested
+  (battery_ocv tables).
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_RLS_H
+#define BATTERY_RLS_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "battery_replay.h"
+#include "battery_ekf.h"
+
+/* The scale factors tracked */
+enum {
+  battery_rls_R0=0,
+  battery_rls_R1,
+  battery_rls_capacity,
+  battery_rls_factors
+};
+
+#define battery_rls_min_factor 0.1f /* factors are kept above this */
+
+/* Forgetting and starting uncertainty */
+struct battery_rls_config {
+  float SOC;         /* state of charge at the start */
+  float forget;      /* forgetting factor per sample, e.g. 0.9995 for about 2000 samples of memory */
+  float sigma;       /* starting standard deviation of each factor */
+  float volts_noise; /* measurement noise and model error, per cell (volts) */
+};
+
+void battery_rls_config_init(struct battery_rls_config *c)
+{
+  c->SOC=1.0f;
+  c->forget=0.9995f;
+  c->sigma=0.3f;
+  c->volts_noise=0.02f;
+}
+
+/* Every cell's factors and model state, as a structure of arrays */
+struct battery_rls {
+  int n;
+  const struct battery_ekf_tables *tables;
+  float forget, max_trace;
+  float *factor[battery_rls_factors];
+  float *P[6];          /* covariance of the factors over the voltage noise's variance: 00 01 02 11 12 22 */
+  float *SOC0, *q;      /* starting SOC, and amp-seconds drawn since */
+  float *C1Q, *dC1Q_b, *dC1Q_c; /* C1's charge, and its derivatives by the R1 and capacity factors */
+  float *tau, *R1C1;    /* b*R1*C1 and R1*C1 at the last update */
+  float *dtau_c;        /* tau's derivative by the capacity factor there */
+  float *last_amps;
+  float *inv_capacity;  /* 1/rated amp-seconds */
+  float *mem;
+};
+
+/* Set up tracking for n cells of capacityAh rated amp hours each, with
+   every factor at 1.  Returns 0, or -1 if out of memory. */
+int battery_rls_init(struct battery_rls *f,int n,const struct battery_ekf_tables *tables,
+  float capacityAh,const struct battery_rls_config *config)
+{
+  memset(f,0,sizeof(*f));
+  int arrays=battery_rls_factors+6+10;
+  f->mem=(float *)malloc((size_t)arrays*(n>0?n:1)*sizeof(float));
+  if (!f->mem) return -1;
+  f->n=n;
+  f->tables=tables;
+  f->forget=config->forget;
+  // in units of the voltage noise, so the update's "1" is its variance
+  float var=config->sigma*config->sigma/(config->volts_noise*config->volts_noise);
+  f->max_trace=battery_rls_factors*var;
+  float *p=f->mem;
+  for (int k=0;k<battery_rls_factors;k++) { f->factor[k]=p; p+=n; }
+  for (int k=0;k<6;k++) { f->P[k]=p; p+=n; }
+  f->SOC0=p; p+=n;
+  f->q=p; p+=n;
+  f->C1Q=p; p+=n;
+  f->dC1Q_b=p; p+=n;
+  f->dC1Q_c=p; p+=n;
+  f->tau=p; p+=n;
+  f->R1C1=p; p+=n;
+  f->dtau_c=p; p+=n;
+  f->last_amps=p; p+=n;
+  f->inv_capacity=p;
+  for (int i=0;i<n;i++) {
+    for (int k=0;k<battery_rls_factors;k++) f->factor[k][i]=1.0f;
+    f->P[0][i]=f->P[3][i]=f->P[5][i]=var;
+    f->P[1][i]=f->P[2][i]=f->P[4][i]=0.0f;
+    f->SOC0[i]=config->SOC;
+    f->q[i]=f->C1Q[i]=f->dC1Q_b[i]=f->dC1Q_c[i]=0.0f;
+    f->tau[i]=f->R1C1[i]=1.0f;
+    f->dtau_c[i]=0.0f;
+    f->last_amps[i]=0.0f;
+    f->inv_capacity[i]=1.0f/(capacityAh*3600.0f);
+  }
+  return 0;
+}
+
+void battery_rls_free(struct battery_rls *f)
+{
+  free(f->mem);
+  memset(f,0,sizeof(*f));
+}
+
+/* Step every cell dt seconds on from its last measurement (dt=0 for the
+   first), and update its factors from these measurements of current
+   (amps), per-cell voltage and cell temperature (deg C). */
+void battery_rls_step(struct battery_rls *f,float dt,
+  const float *restrict amps,const float *restrict volts,const float *restrict tempC)
+{
+  const struct battery_ekf_tables *e=f->tables;
+  float forget=f->forget, max_trace=f->max_trace;
+  float *restrict a=f->factor[battery_rls_R0], *restrict b=f->factor[battery_rls_R1], *restrict c=f->factor[battery_rls_capacity];
+  float *restrict P00=f->P[0], *restrict P01=f->P[1], *restrict P02=f->P[2];
+  float *restrict P11=f->P[3], *restrict P12=f->P[4], *restrict P22=f->P[5];
+  float *restrict q=f->q, *restrict C1Q=f->C1Q, *restrict dC1Q_b=f->dC1Q_b, *restrict dC1Q_c=f->dC1Q_c;
+  float *restrict tau=f->tau, *restrict R1C1=f->R1C1, *restrict dtau_c=f->dtau_c, *restrict last_amps=f->last_amps;
+  const float *restrict SOC0=f->SOC0, *restrict inv_capacity=f->inv_capacity;
+  for (int i=0;i<f->n;i++) {
+    // the model, with the last current held for dt, and C1's derivatives by b and c
+    float I=last_amps[i], x=expf(-dt/tau[i]), settled=I*tau[i];
+    float A=I*(1.0f-x)+(C1Q[i]-settled)*x*dt/(tau[i]*tau[i]); // dC1Q/dtau
+    dC1Q_b[i]=x*dC1Q_b[i]+A*R1C1[i];
+    dC1Q_c[i]=x*dC1Q_c[i]+A*dtau_c[i];
+    C1Q[i]=settled+(C1Q[i]-settled)*x;
+    q[i]+=I*dt;
+    float inv_cap=inv_capacity[i]/c[i];
+    float SOC=SOC0[i]-q[i]*inv_cap;
+    // past the ends of the tables the lookup clamps, and SOC says nothing about c
+    float dSOC_c=SOC>0.0f && SOC<1.0f?q[i]*inv_cap/c[i]:0.0f;
+
+    float param[battery_ekf_values], slope[battery_replay_params];
+    battery_ekf_lookup(e,SOC,tempC[i],param,slope);
+    float inv_C1=1.0f/param[battery_replay_C1], R0=param[battery_replay_R0], C1V=C1Q[i]*inv_C1;
+    float err=volts[i]-(param[battery_replay_Em]-C1V-a[i]*R0*amps[i]);
+    // regressors: the voltage's derivatives by a, b and c
+    float dV_dSOC=slope[battery_replay_Em]-a[i]*amps[i]*slope[battery_replay_R0]+C1V*inv_C1*slope[battery_replay_C1];
+    float h0=-R0*amps[i], h1=-dC1Q_b[i]*inv_C1, h2=dV_dSOC*dSOC_c-dC1Q_c[i]*inv_C1;
+
+    float Ph0=P00[i]*h0+P01[i]*h1+P02[i]*h2;
+    float Ph1=P01[i]*h0+P11[i]*h1+P12[i]*h2;
+    float Ph2=P02[i]*h0+P12[i]*h1+P22[i]*h2;
+    float inv_S=1.0f/(forget+h0*Ph0+h1*Ph1+h2*Ph2);
+    float K0=Ph0*inv_S, K1=Ph1*inv_S, K2=Ph2*inv_S;
+    float old_b=b[i], old_c=c[i];
+    a[i]=fmaxf(a[i]+K0*err,battery_rls_min_factor);
+    b[i]=fmaxf(b[i]+K1*err,battery_rls_min_factor);
+    c[i]=fmaxf(c[i]+K2*err,battery_rls_min_factor);
+    C1Q[i]+=dC1Q_b[i]*(b[i]-old_b)+dC1Q_c[i]*(c[i]-old_c);
+    // forget only while the covariance is smaller than it started
+    float trace=P00[i]+P11[i]+P22[i];
+    float scale=trace<max_trace?1.0f/forget:1.0f;
+    P00[i]=(P00[i]-K0*Ph0)*scale;
+    P01[i]=(P01[i]-K0*Ph1)*scale;
+    P02[i]=(P02[i]-K0*Ph2)*scale;
+    P11[i]=(P11[i]-K1*Ph1)*scale;
+    P12[i]=(P12[i]-K1*Ph2)*scale;
+    P22[i]=(P22[i]-K2*Ph2)*scale;
+    float R1=param[battery_replay_R1], C1=param[battery_replay_C1];
+    R1C1[i]=R1*C1;
+    tau[i]=b[i]*R1C1[i];
+    dtau_c[i]=b[i]*(slope[battery_replay_R1]*C1+R1*slope[battery_replay_C1])*dSOC_c;
+    last_amps[i]=amps[i];
+  }
+}
+
+#endif
@@ -0,0 +1,151 @@
+/**
+  Single-pass model error metrics, split by state of charge, temperature
+  and pulse/rest phase.
+
+  calc_mean_square_error_segments.m finds where SOC first drops below 0.8
+  and 0.2, then calls immse on each of the three slices, so it needs whole
+  trajectories in memory.  Here each residual goes straight into running
+  sums for its SOC band, temperature band and phase as it is produced, so
+  nothing is stored.  Every band keeps the count, sum, sum of squares and
+  largest magnitude of its errors, which give MSE, bias and max abs error,
+  and which simply add when scores from different threads or runs are
+  merged.
+
+  Bands are set by their edges: SOC edges descending (SOC 0.8 and 0.2 give
+  the script's >=0.8, 0.8-0.2 and <0.2 bands), temperature edges ascending.
+  SOC only falls during a discharge, so banding each sample by its SOC
+  matches the script's slicing at the first crossings.
+
+  Once the model's SOC goes below 0 its cell is flat and its voltage runs
+  off the ends of the tables, while the real cell may still be giving
+  charge.  Those samples say nothing about the fit, and a few of them can
+  swamp a run's MSE, so they are only counted, in their own stats, and
+  kept out of the overall figures and every band.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_SCORE_H
+#define BATTERY_SCORE_H
+
+#include <math.h>
+#include <string.h>
+
+#define battery_score_max_bands 8 /* bands per kind (so up to 7 edges) */
+
+/* Load phases */
+enum {
+  battery_score_pulse=0, /* under load */
+  battery_score_rest,    /* resting between pulses (or before/after the test) */
+  battery_score_phases
+};
+
+/* Error statistics over some set of samples */
+struct battery_score_stats {
+  long n;
+  double sum;    /* sum of errors (volts) */
+  double sum_sq; /* sum of squared errors */
+  double max_abs; /* largest error magnitude */
+};
+
+/* How samples are split into bands */
+struct battery_score_config {
+  int nsoc;  /* number of SOC edges; there are nsoc+1 SOC bands */
+  float soc_edge[battery_score_max_bands-1]; /* descending */
+  int ntemp; /* number of temperature edges */
+  float temp_edge[battery_score_max_bands-1]; /* ascending (deg C) */
+  float pulse_crate; /* currents above this C-rate count as pulse, below as rest */
+};
+
+/* Accumulated errors, overall and per band */
+struct battery_score {
+  struct battery_score_config config;
+  struct battery_score_stats all;
+  struct battery_score_stats soc[battery_score_max_bands];
+  struct battery_score_stats temp[battery_score_max_bands];
+  struct battery_score_stats phase[battery_score_phases];
+  struct battery_score_stats empty; /* samples past the model's SOC 0, in no other stats */
+};
+
+/* Default bands: the script's SOC 0.8 and 0.2 splits, and one temperature
+   band around each temperature in the model's parameter tables. */
+void battery_score_config_init(struct battery_score_config *c)
+{
+  memset(c,0,sizeof(*c));
+  c->nsoc=2;
+  c->soc_edge[0]=0.8f;
+  c->soc_edge[1]=0.2f;
+  static const float temps[]={-15.0f,-7.5f,-1.5f,7.0f,16.0f}; // midpoints of -20 -10 -5 2 12 20
+  c->ntemp=sizeof(temps)/sizeof(temps[0]);
+  for (int i=0;i<c->ntemp;i++) c->temp_edge[i]=temps[i];
+  c->pulse_crate=0.02f;
+}
+
+/* Start an empty score with these bands */
+void battery_score_init(struct battery_score *s,const struct battery_score_config *c)
+{
+  memset(s,0,sizeof(*s));
+  s->config=*c;
+}
+
+static inline void battery_score_stats_add(struct battery_score_stats *s,float err)
+{
+  s->n++;
+  s->sum+=err;
+  s->sum_sq+=(double)err*err;
+  if (fabsf(err)>s->max_abs) s->max_abs=fabsf(err);
+}
+
+void battery_score_stats_merge(struct battery_score_stats *dest,const struct battery_score_stats *src)
+{
+  dest->n+=src->n;
+  dest->sum+=src->sum;
+  dest->sum_sq+=src->sum_sq;
+  if (src->max_abs>dest->max_abs) dest->max_abs=src->max_abs;
+}
+
+/* Mean squared error, like MATLAB's immse (0 if there are no samples) */
+static inline double battery_score_mse(const struct battery_score_stats *s) { return s->n?s->sum_sq/s->n:0.0; }
+
+/* Mean error: positive when the model reads high */
+static inline double battery_score_bias(const struct battery_score_stats *s) { return s->n?s->sum/s->n:0.0; }
+
+/* Band index of this state of charge */
+static inline int battery_score_soc_band(const struct battery_score_config *c,float SOC)
+{
+  int b=0;
+  while (b<c->nsoc && SOC<c->soc_edge[b]) b++;
+  return b;
+}
+
+/* Band index of this temperature */
+static inline int battery_score_temp_band(const struct battery_score_config *c,float tempC)
+{
+  int b=0;
+  while (b<c->ntemp && tempC>=c->temp_edge[b]) b++;
+  return b;
+}
+
+/* Add one sample's error (model minus measured volts), taken at this
+   state of charge, temperature (deg C) and discharge C-rate. */
+static inline void battery_score_sample(struct battery_score *s,float err,float SOC,float tempC,float crate)
+{
+  if (SOC<0.0f) { battery_score_stats_add(&s->empty,err); return; }
+  battery_score_stats_add(&s->all,err);
+  battery_score_stats_add(&s->soc[battery_score_soc_band(&s->config,SOC)],err);
+  battery_score_stats_add(&s->temp[battery_score_temp_band(&s->config,tempC)],err);
+  battery_score_stats_add(&s->phase[crate>s->config.pulse_crate?battery_score_pulse:battery_score_rest],err);
+}
+
+/* Add the samples scored in src into dest (both must use the same bands) */
+void battery_score_merge(struct battery_score *dest,const struct battery_score *src)
+{
+  battery_score_stats_merge(&dest->all,&src->all);
+  for (int b=0;b<battery_score_max_bands;b++) {
+    battery_score_stats_merge(&dest->soc[b],&src->soc[b]);
+    battery_score_stats_merge(&dest->temp[b],&src->temp[b]);
+  }
+  for (int p=0;p<battery_score_phases;p++) battery_score_stats_merge(&dest->phase[p],&src->phase[p]);
+  battery_score_stats_merge(&dest->empty,&src->empty);
+}
+
+#endif
@@ -0,0 +1,220 @@
+/**
+  Local sensitivity of a run's outputs to every parameter table entry, by
+  forward-mode differentiation with dual numbers.
+
+  Every quantity the replay carries from sample to sample (the C1 charge
+  and the cell temperature) is paired with its derivative with respect to
+  each of the 264 table entries: 264 dual numbers sharing one value, laid
+  out as one lane per entry.  One replay pushes all 264 lanes forward
+  together, so there's no need for one replay per entry.  Each sample is
+  linearized once (battery_jacobian_linearize), which gives every
+  derivative as a combination of the two state lanes plus the handful of
+  entries the sample looks up, so stepping the lanes is a few
+  multiply-adds across 264 contiguous floats, which the compiler
+  vectorizes.  A run costs about what a few plain replays do.
+
+  The outputs are the run's voltage MSE against the log, and its runtime:
+  the time until the model's voltage first falls below a cutoff (found
+  between samples by linear interpolation, so it moves smoothly).
+
+  Sensitivities are ranked by elasticity, the change in the output for
+  a 1% change in the entry, so volts, ohms and farads compare fairly.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_SENSITIVITY_H
+#define BATTERY_SENSITIVITY_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "battery_log.h"
+#include "battery_replay.h"
+#include "battery_score.h"
+#include "battery_jacobian.h"
+#include "battery_validate.h"
+
+#define battery_sensitivity_entries battery_jacobian_entries /* 264 lanes */
+#define battery_sensitivity_cutoff 3.0f /* default end of discharge (volts per cell) */
+
+/* A run's outputs, and their derivatives with respect to each table entry
+   (indexed like battery_jacobian_index) */
+struct battery_sensitivity {
+  struct battery_score_stats error; /* model minus measured volts */
+  double mse, d_mse[battery_sensitivity_entries];
+  float runtime; /* seconds until the model's voltage falls below the cutoff, or NAN if it never does */
+  double d_runtime[battery_sensitivity_entries];
+};
+
+#define battery_sensitivity_tiny 1.0e-30f /* lanes smaller than this are flushed to 0, before they go denormal */
+#define battery_sensitivity_block 256 /* samples summed in float lanes before adding to the double totals */
+
+/* Derivative lanes of the two model states, now (state[now]) and at the
+   last sample, a block's sum of the MSE derivative, and the voltage at
+   the cutoff */
+struct battery_sensitivity_work {
+  int now;
+  float C1Q[2][battery_sensitivity_entries], cellT[2][battery_sensitivity_entries];
+  float sum_sq[battery_sensitivity_entries];
+  float V[battery_sensitivity_entries], last_V[battery_sensitivity_entries];
+};
+
+/* out+=scale*(d's own table weights) */
+static inline void battery_sensitivity_scatter(float *out,const struct battery_jacobian_d *d,
+  const struct battery_gradient_cell *c,double scale)
+{
+  double s=c->s, t=c->t;
+  for (int p=0;p<battery_replay_params;p++) {
+    double w=d->param[p]*scale;
+    if (w==0.0) continue;
+    out[battery_jacobian_index(p,c->t0,c->s0)]+=w*(1-s)*(1-t);
+    out[battery_jacobian_index(p,c->t0,c->s1)]+=w*s*(1-t);
+    out[battery_jacobian_index(p,c->t1,c->s0)]+=w*(1-s)*t;
+    out[battery_jacobian_index(p,c->t1,c->s1)]+=w*s*t;
+  }
+}
+
+/* out = d's combination of the state lanes, plus its own table weights */
+static inline void battery_sensitivity_expand(float *restrict out,const struct battery_jacobian_d *d,
+  const struct battery_gradient_cell *c,const float *restrict C1Q,const float *restrict cellT)
+{
+  float a=d->C1Q, b=d->cellT;
+  for (int k=0;k<battery_sensitivity_entries;k++) out[k]=a*C1Q[k]+b*cellT[k];
+  battery_sensitivity_scatter(out,d,c,1.0);
+}
+
+/* One sample's pass over the lanes: add e2 times the voltage's derivative
+   to sum_sq, and step the states to the next sample.  All three are
+   combinations of the same two state lanes, so they share one pass. */
+static inline void battery_sensitivity_step(struct battery_sensitivity_work *w,
+  const struct battery_jacobian_sample *d,float e2)
+{
+  float aV=e2*d->V.C1Q, bV=e2*d->V.cellT;
+  float aQ=d->C1Q.C1Q, bQ=d->C1Q.cellT, aT=d->cellT.C1Q, bT=d->cellT.cellT;
+  const float *restrict C1Q=w->C1Q[w->now], *restrict cellT=w->cellT[w->now];
+  float *restrict next_C1Q=w->C1Q[!w->now], *restrict next_cellT=w->cellT[!w->now];
+  float *restrict sum_sq=w->sum_sq;
+  for (int k=0;k<battery_sensitivity_entries;k++) {
+    float Q=C1Q[k], T=cellT[k];
+    float next_Q=aQ*Q+bQ*T, next_T=aT*Q+bT*T;
+    sum_sq[k]+=aV*Q+bV*T;
+    next_C1Q[k]=fabsf(next_Q)<battery_sensitivity_tiny?0.0f:next_Q;
+    next_cellT[k]=fabsf(next_T)<battery_sensitivity_tiny?0.0f:next_T;
+  }
+  battery_sensitivity_scatter(sum_sq,&d->V,&d->c,e2);
+  battery_sensitivity_scatter(next_C1Q,&d->C1Q,&d->c,1.0);
+  battery_sensitivity_scatter(next_cellT,&d->cellT,&d->c,1.0);
+  w->now=!w->now;
+}
+
+/* Replay this run, finding its outputs and their sensitivities.  The
+   runtime is to cutoff volts per cell.  work is scratch space. */
+void battery_sensitivity_run(struct battery_sensitivity *out,struct battery_sensitivity_work *work,
+  const struct battery_replay_lut *lut,const struct battery_replay_config *config,
+  const struct battery_log *log,float cutoff)
+{
+  memset(out,0,sizeof(*out));
+  out->runtime=NAN;
+  int n=log->n;
+  if (n<=0) return;
+  const float *time=log->col[battery_log_time], *amps=log->col[battery_log_amps];
+  const float *tempC=log->col[battery_log_tempC], *cellV=log->col[battery_log_cellV];
+  memset(work,0,sizeof(*work));
+
+  struct battery_replay r;
+  battery_replay_start(&r,lut,config,&log->info);
+  struct battery_jacobian_sample d, last_d;
+  memset(&last_d,0,sizeof(last_d));
+  float model_V, last_model_V=0.0f;
+  for (int i=0;i<n;i++) {
+    battery_replay_run(&r,time+i,amps+i,tempC+i,cellV+i,1,&model_V,0,0);
+    float err=0.0f; // past the model's SOC 0 isn't scored (battery_score_sample)
+    if (r.battery.SOC>=0.0f) battery_score_stats_add(&out->error,err=model_V-cellV[i]);
+    battery_jacobian_linearize(lut,&r,amps[i],i+1<n?time[i+1]-time[i]:-1.0f,&d);
+
+    if (out->runtime!=out->runtime && model_V<cutoff)
+    { // crossed the cutoff since the last sample: t=t0+(V0-cutoff)/(V0-V1)*dt
+      if (i==0) out->runtime=0.0f;
+      else {
+        int now=work->now;
+        battery_sensitivity_expand(work->V,&d.V,&d.c,work->C1Q[now],work->cellT[now]);
+        battery_sensitivity_expand(work->last_V,&last_d.V,&last_d.c,work->C1Q[!now],work->cellT[!now]);
+        double dt=time[i]-time[i-1], dV=last_model_V-model_V;
+        out->runtime=time[i-1]+(last_model_V-cutoff)/dV*dt-time[0];
+        double a=dt*(cutoff-model_V)/(dV*dV), b=dt*(last_model_V-cutoff)/(dV*dV);
+        for (int k=0;k<battery_sensitivity_entries;k++) out->d_runtime[k]=a*work->last_V[k]+b*work->V[k];
+      }
+    }
+    battery_sensitivity_step(work,&d,2.0f*err); // the last sample's state step is never used
+    if ((i+1)%battery_sensitivity_block==0 || i+1==n)
+      for (int k=0;k<battery_sensitivity_entries;k++) {
+        out->d_mse[k]+=work->sum_sq[k];
+        work->sum_sq[k]=0.0f;
+      }
+    last_d=d;
+    last_model_V=model_V;
+  }
+  out->mse=battery_score_mse(&out->error);
+  if (out->error.n) for (int k=0;k<battery_sensitivity_entries;k++) out->d_mse[k]/=out->error.n;
+}
+
+/* Change in an output for a 1% change in entry k, from its derivative */
+static inline double battery_sensitivity_elasticity(const struct battery_replay_lut *lut,int k,double derivative)
+{
+  int s=k%battery_model_table_SOCs, t=(k/battery_model_table_SOCs)%battery_model_table_temps;
+  int p=k/(battery_model_table_SOCs*battery_model_table_temps);
+  return derivative*lut->v[t][s][p]*0.01;
+}
+
+/* List every entry in order, largest |elasticity| first */
+void battery_sensitivity_rank(const struct battery_replay_lut *lut,const double *derivative,int *order)
+{
+  double size[battery_sensitivity_entries];
+  for (int k=0;k<battery_sensitivity_entries;k++) {
+    size[k]=fabs(battery_sensitivity_elasticity(lut,k,derivative[k]));
+    int j=k;
+    while (j>0 && size[order[j-1]]<size[k]) { order[j]=order[j-1]; j--; }
+    order[j]=k;
+  }
+}
+
+
+/********* Parallel runs ***********/
+
+struct battery_sensitivity_runs {
+  const struct battery_validate *data;
+  const struct battery_replay_lut *lut;
+  const struct battery_replay_config *config;
+  float cutoff;
+  struct battery_sensitivity *out; /* per run */
+  int next; /* next run to claim (atomic) */
+};
+
+void *battery_sensitivity_worker(void *arg)
+{
+  struct battery_sensitivity_runs *w=(struct battery_sensitivity_runs *)arg;
+  struct battery_sensitivity_work work;
+  int r;
+  while ((r=__atomic_fetch_add(&w->next,1,__ATOMIC_RELAXED))<w->data->nrun) {
+    struct battery_replay_config config;
+    battery_validate_run_config(w->data,r,w->config,&config);
+    battery_sensitivity_run(&w->out[r],&work,w->lut,&config,w->data->run[r].log,w->cutoff);
+  }
+  return 0;
+}
+
+/* Find the sensitivities of every run of these datasets, into out[run].
+   The runs are spread over threads, one run at a time. */
+void battery_sensitivity_all(const struct battery_validate *v,const struct battery_replay_lut *lut,
+  const struct battery_replay_config *config,float cutoff,struct battery_sensitivity *out,int nthreads)
+{
+  struct battery_sensitivity_runs w={v,lut,config,cutoff,out,0};
+  nthreads=battery_validate_threads(nthreads,v->nrun);
+  pthread_t thread[nthreads];
+  for (int t=1;t<nthreads;t++) pthread_create(&thread[t],0,battery_sensitivity_worker,&w);
+  battery_sensitivity_worker(&w);
+  for (int t=1;t<nthreads;t++) pthread_join(thread[t],0);
+}
+
+#endif
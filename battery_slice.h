@@ -0,0 +1,182 @@
+/**
+  Windowed slices of a cached run, by time, state of charge, or pulse.
+
+  A slice is a sample range [begin,end) of a mapped run.  Its time and
+  voltage pointers point straight into the mapped columns, and current and
+  temperature are decoded from the packed blocks only when asked for, so
+  nothing is copied.  The cache's sparse indexes make each query cheap:
+    - time ranges binary search the (nondecreasing) time column,
+    - SOC bands binary search the per-block running maximum of charge
+      drawn, then finish inside one 64-sample block,
+    - pulse and rest periods are looked up directly from the edge list.
+
+  State of charge follows battery_model: it starts at 1.0 and drops by the
+  coulombs drawn divided by the capacity, so SOC(i) = 1 - charge(i)/capacity.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_SLICE_H
+#define BATTERY_SLICE_H
+
+#include "battery_cache.h"
+
+/* A window of samples [begin,end) from one cached run */
+struct battery_slice {
+  const struct battery_cache_view *run;
+  int begin, end;
+  const float *time;  /* run->time+begin */
+  const float *volts; /* run->volts+begin */
+};
+
+/* Make the slice of run covering samples [begin,end), clamped to the run */
+struct battery_slice battery_slice_make(const struct battery_cache_view *run,int begin,int end)
+{
+  if (begin<0) begin=0;
+  if (end>run->n) end=run->n;
+  if (end<begin) end=begin;
+  struct battery_slice s={run,begin,end,run->time+begin,run->volts+begin};
+  return s;
+}
+
+/* Number of samples in this slice */
+static inline int battery_slice_n(const struct battery_slice *s) { return s->end-s->begin; }
+
+/* Decode this slice's current (amps) into out[0..n) */
+void battery_slice_amps(const struct battery_slice *s,float *out)
+{
+  battery_cache_decode(&s->run->amps,s->begin,s->end,out);
+}
+
+/* Decode this slice's logged temperature (deg C) into out[0..n) */
+void battery_slice_tempC(const struct battery_slice *s,float *out)
+{
+  battery_cache_decode(&s->run->tempC,s->begin,s->end,out);
+}
+
+
+/********* By time ***********/
+
+/* First sample at or after time t (seconds), or n if none */
+int battery_slice_time_index(const struct battery_cache_view *run,float t)
+{
+  int lo=0, hi=run->n;
+  while (lo<hi) {
+    int mid=(lo+hi)/2;
+    if (run->time[mid]<t) lo=mid+1;
+    else hi=mid;
+  }
+  return lo;
+}
+
+/* Samples with t0 <= time < t1 */
+struct battery_slice battery_slice_time(const struct battery_cache_view *run,float t0,float t1)
+{
+  return battery_slice_make(run,battery_slice_time_index(run,t0),battery_slice_time_index(run,t1));
+}
+
+
+/********* By state of charge ***********/
+
+/* Amp-seconds drawn before sample i */
+float battery_slice_charge(const struct battery_cache_view *run,int i)
+{
+  if (i<=0) return 0.0f;
+  if (i>=run->n) i=run->n-1;
+  int b=i/battery_cache_block_len, first=b*battery_cache_block_len;
+  float amps[battery_cache_block_len];
+  battery_cache_decode(&run->amps,first,i,amps);
+  double q=run->charge[b];
+  for (int k=first;k<i;k++) q+=amps[k-first]*(run->time[k+1]-run->time[k]);
+  return q;
+}
+
+/* State of charge at sample i, for a cell of this capacity (amp-seconds) */
+float battery_slice_soc_at(const struct battery_cache_view *run,int i,float capacityAs)
+{
+  return 1.0f-battery_slice_charge(run,i)/capacityAs;
+}
+
+/* Rated capacity of this run's cells, in amp-seconds */
+float battery_slice_capacity(const struct battery_cache_view *run)
+{
+  return run->info->rated_Ah*3600.0f;
+}
+
+/* First sample where more than q amp-seconds have been drawn, or n if none */
+int battery_slice_charge_index(const struct battery_cache_view *run,float q)
+{
+  if (q<0) return 0;
+  // Find the first block whose running maximum passes q...
+  int lo=0, hi=run->nblocks;
+  while (lo<hi) {
+    int mid=(lo+hi)/2;
+    if (run->charge_max[mid]<=q) lo=mid+1;
+    else hi=mid;
+  }
+  if (lo>=run->nblocks) return run->n;
+  // ...then walk that block's samples to the crossing
+  int first=lo*battery_cache_block_len, end=first+battery_cache_block_len;
+  if (end>run->n) end=run->n;
+  float amps[battery_cache_block_len];
+  battery_cache_decode(&run->amps,first,end,amps);
+  double drawn=run->charge[lo];
+  for (int i=first;i<end;i++) {
+    if (drawn>q) return i;
+    if (i+1<run->n) drawn+=amps[i-first]*(run->time[i+1]-run->time[i]);
+  }
+  return end;
+}
+
+/* First sample where the state of charge drops below soc, like MATLAB's
+   find(SOC<soc,1).  Returns n if it never does. */
+int battery_slice_soc_index(const struct battery_cache_view *run,float soc,float capacityAs)
+{
+  if (soc>1.0f) return 0;
+  return battery_slice_charge_index(run,(1.0f-soc)*capacityAs);
+}
+
+/* Samples with soc_hi > SOC >= soc_lo (for soc_hi>=1 the slice starts at
+   sample 0, and for soc_lo<=0 it runs to the end). */
+struct battery_slice battery_slice_soc(const struct battery_cache_view *run,
+  float soc_hi,float soc_lo,float capacityAs)
+{
+  int begin=soc_hi>=1.0f?0:battery_slice_soc_index(run,soc_hi,capacityAs);
+  int end=soc_lo<=0.0f?run->n:battery_slice_soc_index(run,soc_lo,capacityAs);
+  return battery_slice_make(run,begin,end);
+}
+
+
+/********* By pulse ***********/
+
+/* Store to *s the samples of pulse k (0-based), while the load is on.
+   Returns 0, or -1 if the run has no pulse k. */
+int battery_slice_pulse(const struct battery_cache_view *run,int k,struct battery_slice *s)
+{
+  if (k<0 || k>=run->npulse) return -1;
+  *s=battery_slice_make(run,run->pulse_on[k],run->pulse_off[k]);
+  return 0;
+}
+
+/* Store to *s the samples of the rest after pulse k, up to the next
+   pulse or end of run.  Returns 0, or -1 if the run has no pulse k. */
+int battery_slice_rest(const struct battery_cache_view *run,int k,struct battery_slice *s)
+{
+  if (k<0 || k>=run->npulse) return -1;
+  int end=k+1<run->npulse?run->pulse_on[k+1]:run->n;
+  *s=battery_slice_make(run,run->pulse_off[k],end);
+  return 0;
+}
+
+/* Index of the pulse containing or most recently before sample i, or -1 */
+int battery_slice_pulse_index(const struct battery_cache_view *run,int i)
+{
+  int lo=0, hi=run->npulse;
+  while (lo<hi) {
+    int mid=(lo+hi)/2;
+    if (run->pulse_on[mid]<=i) lo=mid+1;
+    else hi=mid;
+  }
+  return lo-1;
+}
+
+#endif
@@ -0,0 +1,212 @@
+/**
+  Fit the thermal constants to the logged cell temperatures.
+
+  The thermal model is one lump: the cell heats by its I^2 R losses plus
+  a reversible (entropic) heat of heat_volts per amp drawn, and cools
+  through an R-value to the chamber.  Of the constants, only the heat
+  capacity (specific_heat*mass) and the conductance (area/Rvalue) change
+  the temperature trace, so mass and area are held at their configured
+  values and the fit moves specific_heat, Rvalue and heat_volts.  The
+  first two are fitted as logarithms, since they must stay positive and
+  the guesses may be out by a lot; heat_volts, which may have either
+  sign, in tenths of a volt.
+
+  Each run is replayed with the logged temperature as the cell's, and a
+  fixed ambient (the replay's log_ambient=0 mode): the first logged
+  temperature, since every test starts with the cell resting in the
+  chamber.  The chamber's nominal temperature would be wrong by the
+  sensor's 1-2 degC offset, and the fit would absorb that into a huge
+  heat capacity.  The objective is the mean over runs of each run's
+  temperature MSE, over the samples with a valid logged temperature; runs
+  with none, or from tests with no nominal temperature, are left out.
+  Temperatures far from the chamber's are left out too: the sensor reads
+  40-100 degC for a few samples as it comes out of its invalid values,
+  and never reads anything at all on one -20 degC test.  Scoring stops
+  if the model's SOC goes below 0, where the tables end (C1 collapses
+  there, and the charge left on it turns into a burst of heat).
+
+  The temperature error is a bumpy function of the constants (the
+  replay's float arithmetic, and R1*C1 switching between explicit and
+  relaxed steps) so it's minimized without derivatives, by CMA-ES
+  (battery_cmaes.h).  Each generation's candidates x runs are replayed as
+  one batch, one (candidate, run) replay per thread at a time.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_THERMAL_H
+#define BATTERY_THERMAL_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "battery_replay.h"
+#include "battery_validate.h"
+#include "battery_cmaes.h"
+
+/* Fitted constants */
+enum {
+  battery_thermal_specific_heat=0,
+  battery_thermal_Rvalue,
+  battery_thermal_heat_volts,
+  battery_thermal_params
+};
+
+#define battery_thermal_sigma 0.5 /* initial CMA-ES step, in fit coordinates (a factor of 1.6, or 0.05 V) */
+#define battery_thermal_volts 0.1 /* heat_volts per unit of its fit coordinate */
+#define battery_thermal_tolerance 1.0e-3 /* converged once the CMA-ES step is below this */
+
+/* Fitting state */
+struct battery_thermal {
+  struct battery_validate *data; /* datasets to fit to */
+  int nrun, *run;  /* the runs being fit (indices into data->run) */
+  float *ambientT; /* per fitted run: its first valid logged temperature */
+  struct battery_replay_lut lut; /* tables, held fixed */
+  struct battery_replay_config config; /* current constants */
+  struct battery_cmaes es;
+  double objective; /* mean run temperature MSE at config */
+  long replays;     /* run replays done so far */
+  int nthreads;
+};
+
+/* Constants for fit coordinates x */
+void battery_thermal_config(const struct battery_thermal *th,const double *x,struct battery_replay_config *c)
+{
+  *c=th->config;
+  c->specific_heat=exp(x[battery_thermal_specific_heat]);
+  c->Rvalue=exp(x[battery_thermal_Rvalue]);
+  c->heat_volts=x[battery_thermal_heat_volts]*battery_thermal_volts;
+  c->log_ambient=0;
+}
+
+/* Temperature MSE of one run with these constants and ambient
+   temperature, or NAN if it has no valid temperatures */
+double battery_thermal_run(const struct battery_replay_lut *lut,
+  const struct battery_replay_config *config,const struct battery_log *log)
+{
+  const float *time=log->col[battery_log_time], *amps=log->col[battery_log_amps];
+  const float *tempC=log->col[battery_log_tempC], *cellV=log->col[battery_log_cellV];
+  struct battery_replay r;
+  battery_replay_start(&r,lut,config,&log->info);
+  double sum_sq=0;
+  long count=0;
+  for (int i=0;i<log->n;i++) {
+    battery_replay_run(&r,time+i,amps+i,tempC+i,cellV+i,1,0,0,0);
+    if (r.battery.SOC<0.0f) break;
+    if (battery_log_temp_plausible(tempC[i],config->ambientT)) {
+      double e=r.battery.cellT-tempC[i];
+      sum_sq+=e*e;
+      count++;
+    }
+  }
+  return count?sum_sq/count:NAN;
+}
+
+
+/********* Parallel objective ***********/
+
+/* A batch of candidate constants, each replayed over every run */
+struct battery_thermal_batch {
+  struct battery_thermal *th;
+  const struct battery_replay_config *config; /* ncandidate sets */
+  int ncandidate;
+  double *mse; /* [candidate*nrun+run] */
+  int next; /* next (candidate, run) pair to claim (atomic) */
+};
+
+void *battery_thermal_worker(void *arg)
+{
+  struct battery_thermal_batch *b=(struct battery_thermal_batch *)arg;
+  struct battery_thermal *th=b->th;
+  int total=b->ncandidate*th->nrun, i;
+  while ((i=__atomic_fetch_add(&b->next,1,__ATOMIC_RELAXED))<total) {
+    int c=i/th->nrun, r=i%th->nrun;
+    struct battery_replay_config config=b->config[c];
+    config.ambientT=th->ambientT[r];
+    b->mse[i]=battery_thermal_run(&th->lut,&config,th->data->run[th->run[r]].log);
+  }
+  return 0;
+}
+
+/* Evaluate the objective for each of these candidate constants */
+void battery_thermal_evaluate(struct battery_thermal *th,const struct battery_replay_config *config,int ncandidate,double *objective)
+{
+  struct battery_thermal_batch b={th,config,ncandidate,0,0};
+  b.mse=(double *)malloc((ncandidate*th->nrun>0?ncandidate*th->nrun:1)*sizeof(double));
+  int nthreads=battery_validate_threads(th->nthreads,ncandidate*th->nrun);
+  pthread_t thread[nthreads];
+  for (int t=1;t<nthreads;t++) pthread_create(&thread[t],0,battery_thermal_worker,&b);
+  battery_thermal_worker(&b);
+  for (int t=1;t<nthreads;t++) pthread_join(thread[t],0);
+  for (int c=0;c<ncandidate;c++) {
+    double sum=0;
+    for (int r=0;r<th->nrun;r++) sum+=b.mse[c*th->nrun+r];
+    objective[c]=th->nrun?sum/th->nrun:0.0;
+  }
+  th->replays+=(long)ncandidate*th->nrun;
+  free(b.mse);
+}
+
+
+/********* Fitting ***********/
+
+/* Start fitting these constants to the runs of these datasets that have
+   a nominal temperature and logged temperatures.  population is the
+   CMA-ES population size (0 for its default).  Returns the number of runs. */
+int battery_thermal_init(struct battery_thermal *th,struct battery_validate *data,
+  const struct battery_replay_lut *lut,const struct battery_replay_config *config,
+  int population,int nthreads)
+{
+  memset(th,0,sizeof(*th));
+  th->data=data;
+  th->lut=*lut;
+  th->config=*config;
+  th->config.log_ambient=0;
+  th->nthreads=nthreads;
+  th->run=(int *)malloc((data->nrun>0?data->nrun:1)*sizeof(int));
+  th->ambientT=(float *)malloc((data->nrun>0?data->nrun:1)*sizeof(float));
+  for (int r=0;r<data->nrun;r++) {
+    const struct battery_log *log=data->run[r].log;
+    float tempC=battery_log_nominal_temp(log->col[battery_log_tempC],log->n,data->run[r].ambientT,NAN);
+    for (int i=0;i<log->n;i++) {
+      float t=log->col[battery_log_tempC][i];
+      if (battery_log_temp_plausible(t,tempC)) {
+        th->ambientT[th->nrun]=t;
+        th->run[th->nrun++]=r;
+        break;
+      }
+    }
+  }
+  double x[battery_thermal_params]={log(config->specific_heat),log(config->Rvalue),config->heat_volts/battery_thermal_volts};
+  battery_cmaes_init(&th->es,battery_thermal_params,x,battery_thermal_sigma,population,1);
+  battery_thermal_evaluate(th,&th->config,1,&th->objective);
+  th->es.best_f=th->objective;
+  return th->nrun;
+}
+
+void battery_thermal_free(struct battery_thermal *th)
+{
+  free(th->run);
+  free(th->ambientT);
+  th->run=0;
+  th->ambientT=0;
+  th->nrun=0;
+}
+
+/* One CMA-ES generation.  config and objective become the best seen so far. */
+void battery_thermal_generation(struct battery_thermal *th)
+{
+  int n=battery_thermal_params, lambda=th->es.lambda;
+  double x[battery_cmaes_max_lambda*battery_thermal_params], f[battery_cmaes_max_lambda];
+  struct battery_replay_config config[battery_cmaes_max_lambda];
+  battery_cmaes_sample(&th->es,x);
+  for (int k=0;k<lambda;k++) battery_thermal_config(th,&x[k*n],&config[k]);
+  battery_thermal_evaluate(th,config,lambda,f);
+  battery_cmaes_update(&th->es,x,f);
+  if (th->es.best_f<th->objective) {
+    battery_thermal_config(th,th->es.best,&th->config);
+    th->objective=th->es.best_f;
+  }
+}
+
+#endif
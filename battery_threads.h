@@ -0,0 +1,21 @@
+/**
+  How many threads the parallel stages use when not told.
+
+  Kept apart from the modules that use it so that pulling in, say, the
+  coulomb counter doesn't pull in the zip reader and zlib with it.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_THREADS_H
+#define BATTERY_THREADS_H
+
+#include <unistd.h>
+
+/* Number of threads to use by default: one per core */
+int battery_threads_default(void)
+{
+  long n=sysconf(_SC_NPROCESSORS_ONLN);
+  return n>0?(int)n:1;
+}
+
+#endif
@@ -0,0 +1,1643 @@
+/**
+  Command line tool for working with the recorded cell discharge data.
+
+  Compile with:
+    gcc -O3 -march=native battery_tool.c -o battery_tool -lz -lpthread -lm
+
+  Usage:
+    battery_tool parse <file.csv or licoo2_data.zip> ...
+        Parse discharge logs and print a summary of each run.
+        Logs inside a zip archive are inflated and parsed in parallel.
+    battery_tool cache <outdir> <file.csv or .zip> ...
+        Convert each log to a columnar binary .bcache file in outdir.
+    battery_tool show <file.bcache> ...
+        Map cache files and summarize the runs inside.
+    battery_tool slice <file.bcache> [run r] time <t0> <t1> | soc <hi> <lo> | pulse <k> | rest <k>
+        Print statistics for one window of a cached run.
+    battery_tool catalog <licoo2_data.zip or .bcat> [Ah lo hi] [temp lo hi] [rate lo hi]
+        [csv] [conflicted] [save <file.bcat>]
+        List the datasets whose test conditions match, e.g.
+          catalog licoo2_data.zip Ah 1.8 1.8 temp -10 5 rate 2 inf
+    battery_tool pipeline <file.csv or .zip> ... [bands]
+        Parse, simulate and score logs in one concurrent pass, printing the
+        model's per-cell voltage error for each run: MSE per SOC band, or
+        with "bands", MSE, bias and max error per SOC, temperature and
+        pulse/rest band.
+    battery_tool replay <file.csv or .zip> ... [repeat N] [out <residuals.csv>]
+        Replay each run's logged current and temperature through the cell
+        model, and print its per-cell voltage error by SOC, temperature and
+        pulse/rest band, and the replay speed.
+    battery_tool validate <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi]
+        [scenarios] [threads N] [gate <mse>]
+        Replay every catalogued discharge test against a parameter set
+        (default: the built-in tables) and print the MSE matrix by test
+        temperature, C-rate and SOC band.  Samples after the model's SOC
+        reaches 0 are counted but not scored.  With "gate", exits with an
+        error if any entry of the matrix is above that MSE.
+    battery_tool fit <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi]
+        [scenarios] [iterations N] [descent | sweep] [rows] [threads N] [check] [save <file>]
+        Fit the model's Em, R0, R1 and C1 tables to the matching tests by
+        minimizing the replay voltage error, starting from a parameter set
+        (default: the built-in tables), and save the fitted parameters.
+        Takes Levenberg-Marquardt steps, or with "descent", gradient descent,
+        or with "sweep", coordinate descent re-scored from checkpoints.
+        All temperature rows are fit together, or with "rows", one row at
+        a time to the tests nearest its temperature.
+        "check" first compares the adjoint gradient to forward differences.
+    battery_tool thermal <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi]
+        [scenarios] [generations N] [population N] [threads N] [save <file>]
+        Fit the thermal constants (specific heat, R-value and a reversible
+        heat per amp) to the logged cell temperatures by CMA-ES, and save
+        them.
+    battery_tool sensitivity <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi]
+        [scenarios] [cutoff V] [top N] [threads N]
+        For each matching test, rank the table entries by how much a 1%
+        change in each would move the replay's voltage MSE and its runtime
+        to the cutoff voltage (default 3.0 V per cell), all found in one
+        forward-mode replay per run.
+    battery_tool pulses <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi]
+        [scenarios] [list] [threads N] [save <file>]
+        Fit R0, R1 and C1 to the voltage recovery after each pulse of the
+        pulse tests, average them onto the table grid, and save the result
+        as a starting point for "fit" (unless it replays worse than the
+        starting tables).  "list" prints every pulse.
+    battery_tool ocv <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi]
+        [scenarios] [threads N] [save <file>]
+        Measure the Em table from the slow (open circuit) sweeps, with the
+        model's R0 and C1 drops added back, and from the end of every long
+        rest, and save the result.
+    battery_tool ekf <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi]
+        [scenarios] [start SOC] [cells N] [threads N]
+        Track each test's SOC from its voltage and current with the
+        extended Kalman filter, starting from a guess (default 0.5), and
+        compare to coulomb counting.  Then time one filter step over a
+        fleet of cells (default 4096).
+    battery_tool particle <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi]
+        [scenarios] [start SOC] [particles N] [cells N] [threads N]
+        Track each test's SOC with a particle filter of N particles
+        (default 1000), next to the Kalman filter's error.  Then time one
+        step over a fleet of cells (default 16) of N particles each, and
+        check that its first cell tracks a lone filter exactly.
+    battery_tool mhe <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi]
+        [scenarios] [start SOC] [horizon N] [stride N] [iterations N] [cold] [threads N]
+        Estimate each test's SOC, C1 charge and capacity by moving-horizon
+        estimation: fit windows of N samples (default 600) every stride
+        samples (default 60), each warm started from the last, or "cold"
+        from the start guess every time.
+    battery_tool rls <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi]
+        [scenarios] [age R0 R1 capacity] [forget f] [cells N] [threads N]
+        Track each test's R0, R1 and capacity as factors on the tables, by
+        recursive least squares, starting from full.  With "age", the
+        voltages come from the model with those factors, to check they're
+        recovered.  Then time one step over a fleet of cells (default 4096).
+    battery_tool rest <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi]
+        [scenarios] [cells N] [threads N]
+        Initialize SOC from rested voltages through the inverse Em table:
+        check it against the tables and against each test's Coulomb count
+        at its start and at the end of every long rest, then time a cold
+        start of a fleet of cells (default 1000000) against bisection.
+    battery_tool ingest <directory or file.csv> ... [threads N] [pread]
+        Batch read and parse every .csv log in these directories, through
+        io_uring where available, and report the throughput.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "battery_log.h"
+#include "battery_zip.h"
+#include "battery_cache.h"
+#include "battery_slice.h"
+#include "battery_catalog.h"
+#include "battery_ingest.h"
+#include "battery_pipeline.h"
+#include "battery_replay.h"
+#include "battery_validate.h"
+#include "battery_fit.h"
+#include "battery_thermal.h"
+#include "battery_sensitivity.h"
+#include "battery_pulse.h"
+#include "battery_ocv.h"
+#include "battery_coulomb.h"
+#include "battery_ekf.h"
+#include "battery_particle.h"
+#include "battery_mhe.h"
+#include "battery_rls.h"
+#include "battery_inverse.h"
+
+/* Wall clock time in seconds */
+double battery_tool_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+1.0e-9*ts.tv_nsec;
+}
+
+/* Print a one-line summary of this run */
+void battery_tool_print_run(const char *name,const struct battery_log *log)
+{
+  const struct battery_log_info *i=&log->info;
+  printf("%s: \"%s\" %d samples, %.2f Ah rated, %d cells, %.0f s/sample",
+    name,i->test,log->n,i->rated_Ah,i->cells,i->sample_s);
+  if (i->on_s>0) printf(", %.3f %s pulses %.0f s on %.0f s off",
+    i->test_current,i->test_power?"W":"A",i->on_s,i->off_s);
+  printf("\n");
+}
+
+/* Print one line of error statistics, if there were any samples */
+void battery_tool_print_stats(const char *label,const struct battery_score_stats *s)
+{
+  if (s->n==0) return;
+  printf("    %-22s %8ld samples  MSE %.6f V^2  RMS %6.1f mV  bias %+6.1f mV  max %6.1f mV\n",
+    label,s->n,battery_score_mse(s),1.0e3*sqrt(battery_score_mse(s)),
+    1.0e3*battery_score_bias(s),1.0e3*s->max_abs);
+}
+
+/* Print a score's error statistics, band by band */
+void battery_tool_print_score(const struct battery_score *s)
+{
+  const struct battery_score_config *c=&s->config;
+  char label[64];
+  for (int b=0;b<=c->nsoc;b++) {
+    if (b==0) snprintf(label,sizeof(label),"SOC >= %.2f",c->nsoc?c->soc_edge[0]:0.0f);
+    else if (b==c->nsoc) snprintf(label,sizeof(label),"SOC < %.2f",c->soc_edge[b-1]);
+    else snprintf(label,sizeof(label),"SOC %.2f to %.2f",c->soc_edge[b-1],c->soc_edge[b]);
+    battery_tool_print_stats(label,&s->soc[b]);
+  }
+  for (int b=0;b<=c->ntemp;b++) {
+    if (b==0) snprintf(label,sizeof(label),"T < %.1f C",c->ntemp?c->temp_edge[0]:0.0f);
+    else if (b==c->ntemp) snprintf(label,sizeof(label),"T >= %.1f C",c->temp_edge[b-1]);
+    else snprintf(label,sizeof(label),"T %.1f to %.1f C",c->temp_edge[b-1],c->temp_edge[b]);
+    battery_tool_print_stats(label,&s->temp[b]);
+  }
+  battery_tool_print_stats("pulse",&s->phase[battery_score_pulse]);
+  battery_tool_print_stats("rest",&s->phase[battery_score_rest]);
+  battery_tool_print_stats("past empty (unscored)",&s->empty);
+}
+
+/* Return 1 if this file name ends in .zip */
+int battery_tool_is_zip(const char *filename)
+{
+  size_t len=strlen(filename);
+  return len>4 && !strcasecmp(filename+len-4,".zip");
+}
+
+/* Called with the runs parsed from each input log */
+typedef int (*battery_tool_log_fn)(void *user,const char *name,struct battery_log *runs,int nrun);
+
+/* Parse each CSV file or zip archive named in argv, and pass the runs
+   from each log to fn.  Returns nonzero if any input couldn't be read. */
+int battery_tool_for_each_log(int argc,char *argv[],battery_tool_log_fn fn,void *user)
+{
+  for (int a=0;a<argc;a++) {
+    if (battery_tool_is_zip(argv[a])) {
+      struct battery_zip zip;
+      if (battery_zip_open(&zip,argv[a])!=0) { printf("Can't read zip %s\n",argv[a]); return 1; }
+      struct battery_zip_log *logs;
+      int nlogs=battery_zip_read_logs(&zip,&logs,0);
+      int err=0;
+      for (int i=0;i<nlogs && !err;i++) {
+        const char *name=battery_zip_basename(&zip.entry[logs[i].entry]);
+        if (logs[i].nrun<0) printf("%s: damaged archive member\n",name);
+        else err=fn(user,name,logs[i].runs,logs[i].nrun);
+      }
+      battery_zip_free_logs(logs,nlogs);
+      battery_zip_close(&zip);
+      if (err) return err;
+      continue;
+    }
+    struct battery_log *runs;
+    int n=battery_log_read(argv[a],&runs);
+    if (n<0) { printf("Can't read %s\n",argv[a]); return 1; }
+    int err=fn(user,argv[a],runs,n);
+    battery_log_free(runs,n);
+    if (err) return err;
+  }
+  return 0;
+}
+
+int battery_tool_parse_log(void *user,const char *name,struct battery_log *runs,int nrun)
+{
+  long *samples=(long *)user;
+  for (int r=0;r<nrun;r++) {
+    battery_tool_print_run(name,&runs[r]);
+    *samples+=runs[r].n;
+  }
+  return 0;
+}
+
+/* Parse each CSV file or zip archive given on the command line */
+int battery_tool_parse(int argc,char *argv[])
+{
+  double start=battery_tool_time();
+  long samples=0;
+  if (battery_tool_for_each_log(argc,argv,battery_tool_parse_log,&samples)) return 1;
+  double elapsed=battery_tool_time()-start;
+  printf("Parsed %ld samples in %.3f seconds (%.1f M samples/s)\n",
+    samples,elapsed,samples*1.0e-6/elapsed);
+  return 0;
+}
+
+/* Cache file name for this log: its base name, with .bcache instead of .csv */
+void battery_tool_cache_name(char *dest,int len,const char *dir,const char *name)
+{
+  const char *slash=strrchr(name,'/');
+  if (slash) name=slash+1;
+  int base=strlen(name);
+  if (base>4 && !strcasecmp(name+base-4,".csv")) base-=4;
+  snprintf(dest,len,"%s/%.*s.bcache",dir,base,name);
+}
+
+int battery_tool_cache_log(void *user,const char *name,struct battery_log *runs,int nrun)
+{
+  const char *dir=(const char *)user;
+  char filename[1024];
+  battery_tool_cache_name(filename,sizeof(filename),dir,name);
+  if (battery_cache_write(filename,runs,nrun)!=0) { printf("Can't write %s\n",filename); return 1; }
+  long samples=0;
+  for (int r=0;r<nrun;r++) samples+=runs[r].n;
+  struct stat st;
+  stat(filename,&st);
+  printf("%s: %ld samples, %ld bytes (%.1f bytes/sample)\n",
+    filename,samples,(long)st.st_size,st.st_size/(double)(samples?samples:1));
+  return 0;
+}
+
+/* Convert logs to columnar cache files in this directory */
+int battery_tool_cache(int argc,char *argv[])
+{
+  if (argc<2) { printf("Usage: battery_tool cache <outdir> <file.csv or .zip> ...\n"); return 1; }
+  return battery_tool_for_each_log(argc-1,argv+1,battery_tool_cache_log,argv[0]);
+}
+
+/* Map cache files and summarize their runs */
+int battery_tool_show(int argc,char *argv[])
+{
+  double start=battery_tool_time();
+  long samples=0;
+  float *amps=0, *tempC=0;
+  for (int a=0;a<argc;a++) {
+    struct battery_cache c;
+    if (battery_cache_open(&c,argv[a])!=0) { printf("Can't read cache %s\n",argv[a]); return 1; }
+    for (int r=0;r<c.nrun;r++) {
+      const struct battery_cache_view *v=&c.run[r];
+      amps=(float *)realloc(amps,v->n*sizeof(float));
+      tempC=(float *)realloc(tempC,v->n*sizeof(float));
+      battery_cache_decode(&v->amps,0,v->n,amps);
+      battery_cache_decode(&v->tempC,0,v->n,tempC);
+      double Ah=0;
+      for (int i=0;i<v->n;i++) Ah+=amps[i]*v->info->sample_s/3600.0;
+      printf("%s: \"%s\" %d samples, %.1f s, %.3f Ah drawn, %.3f V to %.3f V\n",
+        argv[a],v->info->test,v->n,v->n?v->time[v->n-1]:0.0f,Ah,
+        v->n?v->volts[0]:0.0f,v->n?v->volts[v->n-1]:0.0f);
+      samples+=v->n;
+    }
+    battery_cache_close(&c);
+  }
+  free(amps); free(tempC);
+  double elapsed=battery_tool_time()-start;
+  printf("Read %ld cached samples in %.3f seconds (%.1f M samples/s)\n",
+    samples,elapsed,samples*1.0e-6/elapsed);
+  return 0;
+}
+
+/* Print statistics for a window of a cached run */
+int battery_tool_slice(int argc,char *argv[])
+{
+  const char *usage="Usage: battery_tool slice <file.bcache> [run r] time <t0> <t1> | soc <hi> <lo> | pulse <k> | rest <k>\n";
+  if (argc<3) { printf("%s",usage); return 1; }
+  struct battery_cache c;
+  if (battery_cache_open(&c,argv[0])!=0) { printf("Can't read cache %s\n",argv[0]); return 1; }
+  int a=1, r=0;
+  if (!strcmp(argv[a],"run") && a+1<argc) { r=atoi(argv[a+1]); a+=2; }
+  if (r<0 || r>=c.nrun || a+1>=argc) { printf("%s",usage); battery_cache_close(&c); return 1; }
+  const struct battery_cache_view *run=&c.run[r];
+
+  double start=battery_tool_time();
+  struct battery_slice s;
+  if (!strcmp(argv[a],"time") && a+2<argc) s=battery_slice_time(run,strtof(argv[a+1],0),strtof(argv[a+2],0));
+  else if (!strcmp(argv[a],"soc") && a+2<argc) s=battery_slice_soc(run,strtof(argv[a+1],0),strtof(argv[a+2],0),battery_slice_capacity(run));
+  else if (!strcmp(argv[a],"pulse") || !strcmp(argv[a],"rest")) {
+    int k=atoi(argv[a+1]);
+    if ((!strcmp(argv[a],"pulse")?battery_slice_pulse(run,k,&s):battery_slice_rest(run,k,&s))!=0) {
+      printf("%s run %d: no pulse %d (run has %d)\n",argv[0],r,k,run->npulse);
+      battery_cache_close(&c);
+      return 1;
+    }
+  }
+  else { printf("%s",usage); battery_cache_close(&c); return 1; }
+  double elapsed=battery_tool_time()-start;
+
+  int n=battery_slice_n(&s);
+  float *amps=(float *)malloc((n>0?n:1)*sizeof(float));
+  battery_slice_amps(&s,amps);
+  double V=0, A=0;
+  for (int i=0;i<n;i++) { V+=s.volts[i]; A+=amps[i]; }
+  printf("%s run %d: samples %d to %d (%d samples, %.0f to %.0f s), %d pulses in run\n",
+    argv[0],r,s.begin,s.end,n,n?s.time[0]:0.0f,n?s.time[n-1]:0.0f,run->npulse);
+  if (n) printf("  mean %.3f V %.3f A, SOC %.3f to %.3f (query in %.2f us)\n",V/n,A/n,
+    battery_slice_soc_at(run,s.begin,battery_slice_capacity(run)),
+    battery_slice_soc_at(run,s.end-1,battery_slice_capacity(run)),elapsed*1.0e6);
+  free(amps);
+  battery_cache_close(&c);
+  return 0;
+}
+
+/* Print one catalog entry */
+void battery_tool_print_entry(const struct battery_catalog *cat,int i)
+{
+  const struct battery_catalog_entry *e=&cat->entry[i];
+  printf("%3d %-4s %5.2f Ah %6.1f C %5.2f C-rate",
+    i,e->format==battery_catalog_csv?"csv":"xlsx",e->capacity_Ah,e->tempC,e->crate);
+  if (e->has_info) printf(" %d cells",e->info.cells);
+  if (e->has_info && e->info.on_s>0) printf(" %.0f/%.0f s pulses",e->info.on_s,e->info.off_s);
+  if (e->run) printf(" run %d",e->run);
+  if (e->scenario) printf(" scenario");
+  if (e->conflicted) printf(" CONFLICTED copy of %d",e->duplicate_of);
+  printf("  %s\n",e->name);
+}
+
+/* Build or load the dataset catalog, and list entries matching a query */
+int battery_tool_catalog(int argc,char *argv[])
+{
+  if (argc<1) { printf("Usage: battery_tool catalog <licoo2_data.zip or .bcat> [Ah lo hi] [temp lo hi] [rate lo hi] [csv] [conflicted] [save <file.bcat>]\n"); return 1; }
+  struct battery_catalog cat;
+  double start=battery_tool_time();
+  if (battery_tool_is_zip(argv[0])?battery_catalog_build(&cat,argv[0]):battery_catalog_read(&cat,argv[0])) {
+    printf("Can't read catalog from %s\n",argv[0]);
+    return 1;
+  }
+  double built=battery_tool_time();
+
+  struct battery_catalog_query q;
+  battery_catalog_query_init(&q);
+  const char *save=0;
+  for (int a=1;a<argc;a++) {
+    float *range=0;
+    if (!strcmp(argv[a],"Ah")) range=&q.min_Ah;
+    else if (!strcmp(argv[a],"temp")) range=&q.min_tempC;
+    else if (!strcmp(argv[a],"rate")) range=&q.min_crate;
+    else if (!strcmp(argv[a],"csv")) q.csv_only=1;
+    else if (!strcmp(argv[a],"conflicted")) q.with_conflicted=1;
+    else if (!strcmp(argv[a],"save") && a+1<argc) save=argv[++a];
+    else { printf("Unknown catalog option %s\n",argv[a]); return 1; }
+    if (range) {
+      if (a+2>=argc) { printf("%s needs a low and high value\n",argv[a]); return 1; }
+      range[0]=strtof(argv[a+1],0);
+      range[1]=strtof(argv[a+2],0);
+      a+=2;
+    }
+  }
+
+  int *match=(int *)malloc((cat.n>0?cat.n:1)*sizeof(int));
+  double qstart=battery_tool_time();
+  int n=battery_catalog_query(&cat,&q,match,cat.n);
+  double qtime=battery_tool_time()-qstart;
+  for (int i=0;i<n;i++) battery_tool_print_entry(&cat,match[i]);
+  printf("%d of %d datasets match (catalog in %.3f ms, query in %.2f us)\n",
+    n,cat.n,(built-start)*1.0e3,qtime*1.0e6);
+  if (save && battery_catalog_write(&cat,save)!=0) { printf("Can't write %s\n",save); return 1; }
+  free(match);
+  battery_catalog_free(&cat);
+  return 0;
+}
+
+/* Settings and totals for battery_tool replay */
+struct battery_tool_replay {
+  struct battery_replay_config config;
+  struct battery_replay_lut lut;
+  struct battery_score total;
+  int repeat;
+  FILE *out;
+  long samples;
+  double seconds;
+};
+
+int battery_tool_replay_log(void *user,const char *name,struct battery_log *runs,int nrun)
+{
+  struct battery_tool_replay *t=(struct battery_tool_replay *)user;
+  // the chamber's temperature, from the file name where it's given
+  struct battery_catalog_entry entry;
+  memset(&entry,0,sizeof(entry));
+  battery_catalog_parse_name(&entry,name);
+  struct battery_replay_config config=t->config;
+  for (int r=0;r<nrun;r++) {
+    const struct battery_log *log=&runs[r];
+    config.ambientT=battery_log_nominal_temp(log->col[battery_log_tempC],log->n,entry.tempC,t->config.ambientT);
+    float *model=(float *)malloc((log->n>0?log->n:1)*sizeof(float));
+    float *residual=(float *)malloc((log->n>0?log->n:1)*sizeof(float));
+    struct battery_score score;
+    double start=battery_tool_time();
+    for (int k=0;k<t->repeat;k++) {
+      struct battery_replay replay;
+      battery_replay_start(&replay,&t->lut,&config,&log->info);
+      battery_score_init(&score,&t->total.config);
+      battery_replay_run(&replay,log->col[battery_log_time],log->col[battery_log_amps],
+        log->col[battery_log_tempC],log->col[battery_log_cellV],log->n,model,residual,&score);
+    }
+    t->seconds+=battery_tool_time()-start;
+    t->samples+=(long)log->n*t->repeat;
+    printf("%s run %d: \"%s\"\n",name,r,log->info.test);
+    battery_tool_print_score(&score);
+    battery_score_merge(&t->total,&score);
+    if (t->out)
+      for (int i=0;i<log->n;i++)
+        fprintf(t->out,"\"%s\",%d,%.3f,%.3f,%.4f,%.4f,%.4f\n",name,r,log->col[battery_log_time][i],
+          log->col[battery_log_amps][i],log->col[battery_log_cellV][i],model[i],residual[i]);
+    free(model); free(residual);
+  }
+  return 0;
+}
+
+/* Replay logged runs through the model */
+int battery_tool_replay(int argc,char *argv[])
+{
+  struct battery_tool_replay t;
+  memset(&t,0,sizeof(t));
+  battery_replay_config_init(&t.config);
+  battery_replay_lut_default(&t.lut);
+  struct battery_score_config bands;
+  battery_score_config_init(&bands);
+  battery_score_init(&t.total,&bands);
+  t.repeat=1;
+  char *inputs[argc>0?argc:1];
+  int ninput=0;
+  for (int a=0;a<argc;a++) {
+    if (!strcmp(argv[a],"repeat") && a+1<argc) t.repeat=atoi(argv[++a]);
+    else if (!strcmp(argv[a],"out") && a+1<argc) {
+      if (!(t.out=fopen(argv[++a],"w"))) { printf("Can't write %s\n",argv[a]); return 1; }
+      fprintf(t.out,"log,run,time,amps,cellV,model,residual\n");
+    }
+    else inputs[ninput++]=argv[a];
+  }
+  if (ninput==0 || t.repeat<1) { printf("Usage: battery_tool replay <file.csv or .zip> ... [repeat N] [out <residuals.csv>]\n"); return 1; }
+  int err=battery_tool_for_each_log(ninput,inputs,battery_tool_replay_log,&t);
+  if (t.out) fclose(t.out);
+  printf("All runs:\n");
+  battery_tool_print_stats("all",&t.total.all);
+  battery_tool_print_score(&t.total);
+  printf("Replayed %ld samples in %.3f seconds (%.1f M samples/s)\n",
+    t.samples,t.seconds,t.samples*1.0e-6/t.seconds);
+  return err;
+}
+
+/* Defaults for the commands that replay the catalogued tests: the built-in
+   tables, and every test except the scenarios */
+void battery_tool_test_defaults(struct battery_replay_lut *lut,struct battery_replay_config *config,
+  struct battery_catalog_query *q)
+{
+  battery_replay_lut_default(lut);
+  battery_replay_config_init(config);
+  battery_catalog_query_init(q);
+  q->with_scenarios=0;
+}
+
+/* If argv[*a] is one of the options every test command takes (params,
+   Ah, temp, rate, scenarios, threads), use it and leave *a on its last
+   value.  Returns 1 if it was, 0 if not, or -1 after saying what's wrong. */
+int battery_tool_test_option(int argc,char *argv[],int *a,struct battery_replay_lut *lut,
+  struct battery_replay_config *config,struct battery_catalog_query *q,int *nthreads)
+{
+  const char *opt=argv[*a];
+  float *range=0;
+  if (!strcmp(opt,"params") && *a+1<argc) {
+    if (battery_replay_load(argv[++*a],lut,config)!=0) { printf("Can't read parameters %s\n",argv[*a]); return -1; }
+  }
+  else if (!strcmp(opt,"Ah")) range=&q->min_Ah;
+  else if (!strcmp(opt,"temp")) range=&q->min_tempC;
+  else if (!strcmp(opt,"rate")) range=&q->min_crate;
+  else if (!strcmp(opt,"scenarios")) q->with_scenarios=1;
+  else if (!strcmp(opt,"threads") && *a+1<argc) *nthreads=atoi(argv[++*a]);
+  else return 0;
+  if (range) {
+    if (*a+2>=argc) { printf("%s needs a low and high value\n",opt); return -1; }
+    range[0]=strtof(argv[*a+1],0);
+    range[1]=strtof(argv[*a+2],0);
+    *a+=2;
+  }
+  return 1;
+}
+
+/* Load the tests in this zip that match q, naming any that can't be read.
+   Returns how many couldn't, or -1 after saying why if the zip can't be
+   read, or if need_runs is set and no tests match. */
+int battery_tool_load_tests(struct battery_validate *v,const char *zipname,
+  const struct battery_catalog_query *q,int nthreads,int need_runs)
+{
+  struct battery_catalog cat;
+  if (battery_catalog_build(&cat,zipname)!=0) { printf("Can't read zip %s\n",zipname); return -1; }
+  int failed=battery_validate_load(v,&cat,zipname,q,nthreads);
+  battery_catalog_free(&cat);
+  if (failed<0) { printf("Can't read zip %s\n",zipname); return -1; }
+  for (int d=0;d<v->ndataset;d++)
+    if (v->dataset[d].nrun<0) printf("Can't read %s\n",v->dataset[d].entry.name);
+  if (need_runs && v->nrun==0) { printf("No tests match\n"); battery_validate_free(v); return -1; }
+  return failed;
+}
+
+/* Replay the catalogued tests and print the error matrix */
+int battery_tool_validate(int argc,char *argv[])
+{
+  const char *usage="Usage: battery_tool validate <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [threads N] [gate <mse>]\n";
+  if (argc<1) { printf("%s",usage); return 1; }
+  struct battery_replay_lut lut;
+  struct battery_replay_config config;
+  struct battery_catalog_query q;
+  battery_tool_test_defaults(&lut,&config,&q);
+  int nthreads=0;
+  double gate=-1;
+  for (int a=1;a<argc;a++) {
+    int used=battery_tool_test_option(argc,argv,&a,&lut,&config,&q,&nthreads);
+    if (used<0) return 1;
+    if (used) continue;
+    if (!strcmp(argv[a],"gate") && a+1<argc) gate=strtod(argv[++a],0);
+    else { printf("%s",usage); return 1; }
+  }
+
+  double start=battery_tool_time();
+  struct battery_validate v;
+  int failed=battery_tool_load_tests(&v,argv[0],&q,nthreads,0);
+  if (failed<0) return 1;
+  double loaded=battery_tool_time();
+  battery_validate_evaluate(&v,&lut,&config);
+  double replayed=battery_tool_time();
+
+  struct battery_validate_matrix m;
+  battery_validate_matrix(&v,&m);
+  const struct battery_score_config *b=&v.bands;
+  printf("  temp  C-rate tests  samples      MSE all");
+  for (int k=0;k<=b->nsoc;k++) {
+    char label[32];
+    if (k==0) snprintf(label,sizeof(label),"SOC>=%.2f",b->nsoc?b->soc_edge[0]:0.0f);
+    else if (k==b->nsoc) snprintf(label,sizeof(label),"SOC<%.2f",b->soc_edge[k-1]);
+    else snprintf(label,sizeof(label),"%.2f-%.2f",b->soc_edge[k-1],b->soc_edge[k]);
+    printf(" %12s",label);
+  }
+  printf("\n");
+  int over=0;
+  for (int c=0;c<m.ncell;c++) {
+    const struct battery_validate_cell *cell=&m.cell[c];
+    printf("%6.1f %6.2f %5d %8ld %12.6f",cell->tempC,cell->crate,cell->ndataset,
+      cell->score.all.n,battery_score_mse(&cell->score.all));
+    for (int k=0;k<=b->nsoc;k++) {
+      double mse=battery_score_mse(&cell->score.soc[k]);
+      if (cell->score.soc[k].n==0) printf(" %12s","-");
+      else printf(" %12.6f",mse);
+      if (gate>=0 && mse>gate) over++;
+    }
+    printf("\n");
+  }
+  printf("%d tests, %d runs, %ld samples: loaded in %.3f s, replayed in %.3f s (%.1f M samples/s)\n",
+    v.ndataset,v.nrun,v.samples,loaded-start,replayed-loaded,v.samples*1.0e-6/(replayed-loaded));
+  struct battery_score total;
+  battery_validate_total(&v,&total);
+  if (total.empty.n) printf("%ld samples past the model's SOC 0 not scored\n",total.empty.n);
+  if (gate>=0) printf("%s: %d matrix entries above MSE %g\n",over?"FAIL":"PASS",over,gate);
+  battery_validate_matrix_free(&m);
+  battery_validate_free(&v);
+  return (over || failed)?1:0;
+}
+
+/* Fit the parameter tables to the recorded tests */
+int battery_tool_fit(int argc,char *argv[])
+{
+  const char *usage="Usage: battery_tool fit <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [iterations N] [descent | sweep] [rows] [threads N] [check] [save <file>]\n";
+  if (argc<1) { printf("%s",usage); return 1; }
+  struct battery_replay_lut lut;
+  struct battery_replay_config config;
+  struct battery_catalog_query q;
+  battery_tool_test_defaults(&lut,&config,&q);
+  int nthreads=0, iterations=20, check=0, descent=0, sweep=0, rows=0;
+  const char *save=0;
+  for (int a=1;a<argc;a++) {
+    int used=battery_tool_test_option(argc,argv,&a,&lut,&config,&q,&nthreads);
+    if (used<0) return 1;
+    if (used) continue;
+    if (!strcmp(argv[a],"iterations") && a+1<argc) iterations=atoi(argv[++a]);
+    else if (!strcmp(argv[a],"save") && a+1<argc) save=argv[++a];
+    else if (!strcmp(argv[a],"check")) check=1;
+    else if (!strcmp(argv[a],"descent")) descent=1;
+    else if (!strcmp(argv[a],"sweep")) sweep=1;
+    else if (!strcmp(argv[a],"rows")) rows=1;
+    else { printf("%s",usage); return 1; }
+  }
+
+  struct battery_validate v;
+  int failed=battery_tool_load_tests(&v,argv[0],&q,nthreads,1);
+  if (failed<0) return 1;
+
+  double start=battery_tool_time();
+  struct battery_fit fit;
+  battery_fit_init(&fit,&v,&lut,&config,nthreads);
+  double initial=fit.objective;
+  printf("Fitting %d tests, %d runs, %ld samples: mean run MSE %.6f\n",v.ndataset,v.nrun,v.samples,initial);
+  if (check)
+  { // compare the adjoint gradient against forward differences
+    double t0=battery_tool_time();
+    battery_fit_gradient(&fit);
+    double t1=battery_tool_time();
+    double *difference=(double *)malloc(battery_fit_entries*sizeof(double));
+    battery_fit_difference(&fit,difference);
+    double t2=battery_tool_time();
+    for (int p=0;p<battery_replay_params;p++) {
+      double largest=0, worst=0;
+      for (int k=0;k<battery_fit_entries;k++)
+        if (battery_fit_param(k)==p) {
+          if (fabs(difference[k])>largest) largest=fabs(difference[k]);
+          if (fabs(fit.gradient[k]-difference[k])>worst) worst=fabs(fit.gradient[k]-difference[k]);
+        }
+      printf("  %s gradient: largest %.3g, adjoint differs from forward difference by up to %.3g\n",
+        battery_replay_param_names[p],largest,worst);
+    }
+    printf("  adjoint gradient in %.3f s, forward differences in %.3f s\n",t1-t0,t2-t1);
+    free(difference);
+  }
+  for (int row=0;row<(rows?battery_model_table_temps:1);row++) {
+    if (rows) {
+      int n=battery_fit_select_row(&fit,row);
+      printf(" row %g degC: %d runs, mean run MSE %.6f\n",battery_model_temperatures[row],n,fit.objective);
+      if (n==0) continue;
+    }
+    for (int i=0;i<iterations;i++) {
+      double before=fit.objective;
+      if (sweep) {
+        int kept=battery_fit_sweep(&fit);
+        if (kept<0) { printf("Out of memory\n"); break; }
+        printf("  sweep %3d: MSE %.6f  %d steps kept  %.1f s, replaying %.1f%% of the samples a full replay would\n",
+          i+1,fit.objective,kept,battery_tool_time()-start,fit.samples*100.0/fit.full_samples);
+        if (kept==0 || before-fit.objective<battery_fit_tolerance*before) { printf("  converged\n"); break; }
+        continue;
+      }
+      if (!(descent?battery_fit_iterate(&fit):battery_fit_lm_iterate(&fit))) { printf("  converged\n"); break; }
+      double t=battery_tool_time()-start;
+      if (descent) printf("  iteration %3d: MSE %.6f  step %.3g  %.1f s\n",i+1,fit.objective,fit.rate,t);
+      else printf("  iteration %3d: MSE %.6f  damping %.3g  %.1f s\n",i+1,fit.objective,fit.lambda,t);
+      if (before-fit.objective<battery_fit_tolerance*before) { printf("  converged\n"); break; }
+    }
+  }
+  if (rows) battery_fit_select_all(&fit);
+  printf("Mean run MSE %.6f -> %.6f after %ld run replays in %.1f s\n",initial,fit.objective,fit.replays,battery_tool_time()-start);
+  int err=0;
+  if (save) {
+    if (battery_replay_save(save,&fit.lut,&fit.config)!=0) { printf("Can't write %s\n",save); err=1; }
+    else printf("Saved parameters to %s\n",save);
+  }
+  battery_fit_free(&fit);
+  battery_validate_free(&v);
+  return (err || failed)?1:0;
+}
+
+/* Fit the thermal constants to the logged temperatures */
+int battery_tool_thermal(int argc,char *argv[])
+{
+  const char *usage="Usage: battery_tool thermal <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [generations N] [population N] [threads N] [save <file>]\n";
+  if (argc<1) { printf("%s",usage); return 1; }
+  struct battery_replay_lut lut;
+  struct battery_replay_config config;
+  struct battery_catalog_query q;
+  battery_tool_test_defaults(&lut,&config,&q);
+  int nthreads=0, generations=40, population=0;
+  const char *save=0;
+  for (int a=1;a<argc;a++) {
+    int used=battery_tool_test_option(argc,argv,&a,&lut,&config,&q,&nthreads);
+    if (used<0) return 1;
+    if (used) continue;
+    if (!strcmp(argv[a],"generations") && a+1<argc) generations=atoi(argv[++a]);
+    else if (!strcmp(argv[a],"population") && a+1<argc) population=atoi(argv[++a]);
+    else if (!strcmp(argv[a],"save") && a+1<argc) save=argv[++a];
+    else { printf("%s",usage); return 1; }
+  }
+
+  struct battery_validate v;
+  int failed=battery_tool_load_tests(&v,argv[0],&q,nthreads,0);
+  if (failed<0) return 1;
+
+  double start=battery_tool_time();
+  struct battery_thermal th;
+  if (battery_thermal_init(&th,&v,&lut,&config,population,nthreads)==0) {
+    printf("No tests with logged temperatures match\n");
+    battery_thermal_free(&th);
+    battery_validate_free(&v);
+    return 1;
+  }
+  double initial=th.objective;
+  printf("Fitting %d runs of %d tests, population %d: temperature RMS %.3f degC\n",
+    th.nrun,v.ndataset,th.es.lambda,sqrt(initial));
+  for (int g=0;g<generations;g++) {
+    battery_thermal_generation(&th);
+    printf("  generation %3d: RMS %.3f degC  sigma %.3g  %.1f s\n",
+      g+1,sqrt(th.objective),th.es.sigma,battery_tool_time()-start);
+    if (th.es.sigma<battery_thermal_tolerance) { printf("  converged\n"); break; }
+  }
+  printf("Temperature RMS %.3f -> %.3f degC after %ld run replays in %.1f s\n",
+    sqrt(initial),sqrt(th.objective),th.replays,battery_tool_time()-start);
+  printf("  specific_heat %.4g J/(g degC), Rvalue %.4g (conductance %.4g W/degC), heat_volts %.4g\n",
+    th.config.specific_heat,th.config.Rvalue,th.config.area/th.config.Rvalue,th.config.heat_volts);
+  int err=0;
+  if (save) {
+    if (battery_replay_save(save,&th.lut,&th.config)!=0) { printf("Can't write %s\n",save); err=1; }
+    else printf("Saved parameters to %s\n",save);
+  }
+  battery_thermal_free(&th);
+  battery_validate_free(&v);
+  return (err || failed)?1:0;
+}
+
+/* Print entries in order, with their elasticities */
+void battery_tool_print_ranked(const char *output,const struct battery_replay_lut *lut,const double *derivative,int top)
+{
+  int order[battery_sensitivity_entries];
+  battery_sensitivity_rank(lut,derivative,order);
+  printf("    %s per 1%%:",output);
+  for (int i=0;i<top && i<battery_sensitivity_entries;i++) {
+    int k=order[i];
+    int s=k%battery_model_table_SOCs, t=(k/battery_model_table_SOCs)%battery_model_table_temps;
+    int p=k/(battery_model_table_SOCs*battery_model_table_temps);
+    printf("%s %s(%g degC, SOC %.1f) %+.3g",i?",":"",battery_replay_param_names[p],
+      battery_model_temperatures[t],s/(double)(battery_model_table_SOCs-1),
+      battery_sensitivity_elasticity(lut,k,derivative[k]));
+  }
+  printf("\n");
+}
+
+/* Rank the table entries by their effect on each test's outputs */
+int battery_tool_sensitivity(int argc,char *argv[])
+{
+  const char *usage="Usage: battery_tool sensitivity <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [cutoff V] [top N] [threads N]\n";
+  if (argc<1) { printf("%s",usage); return 1; }
+  struct battery_replay_lut lut;
+  struct battery_replay_config config;
+  struct battery_catalog_query q;
+  battery_tool_test_defaults(&lut,&config,&q);
+  int nthreads=0, top=5;
+  float cutoff=battery_sensitivity_cutoff;
+  for (int a=1;a<argc;a++) {
+    int used=battery_tool_test_option(argc,argv,&a,&lut,&config,&q,&nthreads);
+    if (used<0) return 1;
+    if (used) continue;
+    if (!strcmp(argv[a],"cutoff") && a+1<argc) cutoff=strtof(argv[++a],0);
+    else if (!strcmp(argv[a],"top") && a+1<argc) top=atoi(argv[++a]);
+    else { printf("%s",usage); return 1; }
+  }
+
+  struct battery_validate v;
+  int failed=battery_tool_load_tests(&v,argv[0],&q,nthreads,1);
+  if (failed<0) return 1;
+
+  double start=battery_tool_time();
+  battery_validate_evaluate(&v,&lut,&config);
+  double plain=battery_tool_time()-start;
+  struct battery_sensitivity *sens=(struct battery_sensitivity *)malloc(v.nrun*sizeof(struct battery_sensitivity));
+  start=battery_tool_time();
+  battery_sensitivity_all(&v,&lut,&config,cutoff,sens,nthreads);
+  double elapsed=battery_tool_time()-start;
+
+  double mean_d_mse[battery_sensitivity_entries];
+  memset(mean_d_mse,0,sizeof(mean_d_mse));
+  for (int r=0;r<v.nrun;r++) {
+    const struct battery_sensitivity *s=&sens[r];
+    printf("%s run %d: MSE %.6f, ",v.dataset[v.run[r].dataset].entry.name,r,s->mse);
+    if (s->runtime==s->runtime) printf("runtime to %.2f V %.0f s\n",cutoff,s->runtime);
+    else printf("never below %.2f V\n",cutoff);
+    battery_tool_print_ranked("MSE",&lut,s->d_mse,top);
+    if (s->runtime==s->runtime) battery_tool_print_ranked("runtime (s)",&lut,s->d_runtime,top);
+    for (int k=0;k<battery_sensitivity_entries;k++) mean_d_mse[k]+=s->d_mse[k]/v.nrun;
+  }
+  printf("All runs:\n");
+  battery_tool_print_ranked("mean run MSE",&lut,mean_d_mse,top);
+  printf("Sensitivities of %d runs (%ld samples) to %d entries in %.3f s, %.1fx a plain replay (%.3f s)\n",
+    v.nrun,v.samples,battery_sensitivity_entries,elapsed,elapsed/plain,plain);
+  free(sens);
+  battery_validate_free(&v);
+  return failed?1:0;
+}
+
+/* Extract first-guess R0, R1 and C1 tables from the pulse tests */
+int battery_tool_pulses(int argc,char *argv[])
+{
+  const char *usage="Usage: battery_tool pulses <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [list] [threads N] [save <file>]\n";
+  if (argc<1) { printf("%s",usage); return 1; }
+  struct battery_replay_lut lut;
+  struct battery_replay_config config;
+  struct battery_catalog_query q;
+  battery_tool_test_defaults(&lut,&config,&q);
+  int nthreads=0, list=0;
+  const char *save=0;
+  for (int a=1;a<argc;a++) {
+    int used=battery_tool_test_option(argc,argv,&a,&lut,&config,&q,&nthreads);
+    if (used<0) return 1;
+    if (used) continue;
+    if (!strcmp(argv[a],"list")) list=1;
+    else if (!strcmp(argv[a],"save") && a+1<argc) save=argv[++a];
+    else { printf("%s",usage); return 1; }
+  }
+
+  struct battery_validate v;
+  int failed=battery_tool_load_tests(&v,argv[0],&q,nthreads,1);
+  if (failed<0) return 1;
+
+  double start=battery_tool_time();
+  struct battery_pulse_grid grid;
+  battery_pulse_grid_init(&grid);
+  for (int r=0;r<v.nrun;r++) {
+    const struct battery_log *log=v.run[r].log;
+    if (!(log->info.on_s>0)) continue;
+    int max=log->n/2+1;
+    struct battery_pulse *pulse=(struct battery_pulse *)malloc(max*sizeof(struct battery_pulse));
+    if (!pulse) { printf("Out of memory\n"); break; }
+    int n=battery_pulse_extract(log,v.run[r].ambientT,pulse,max);
+    printf("%s run %d: %d pulses\n",v.dataset[v.run[r].dataset].entry.name,r,n);
+    for (int k=0;k<n;k++) {
+      const struct battery_pulse *p=&pulse[k];
+      if (list) printf("  SOC %.3f %5.1f degC %6.3f A: R0 %.4f R1 %.4f ohm, C1 %.0f F, tau %.1f s, fit RMS %.2f mV\n",
+        p->SOC,p->cellT,p->amps,p->R0,p->R1,p->C1,p->tau,p->rms*1000.0f);
+      battery_pulse_grid_add(&grid,&lut,p);
+    }
+    free(pulse);
+  }
+  struct battery_replay_lut extracted=lut;
+  int replaced=battery_pulse_grid_apply(&grid,&extracted);
+  double elapsed=battery_tool_time()-start;
+  printf("%d pulses in %.3f s replace %d of %d table nodes:\n",grid.npulse,elapsed,replaced,
+    battery_model_table_temps*battery_model_table_SOCs);
+  for (int p=battery_replay_R0;p<battery_replay_params;p++) {
+    printf("  %s\n",battery_replay_param_names[p]);
+    for (int t=0;t<battery_model_table_temps;t++) {
+      printf("  %5g degC:",battery_model_temperatures[t]);
+      for (int s=0;s<battery_model_table_SOCs;s++)
+        if (grid.weight[t][s]<battery_pulse_min_weight) printf("       -");
+        else printf(" %7.4g",extracted.v[t][s][p]);
+      printf("\n");
+    }
+  }
+
+  struct battery_fit fit;
+  battery_fit_init(&fit,&v,&lut,&config,nthreads);
+  double before=fit.objective, after;
+  battery_fit_evaluate(&fit,&extracted,1,&after);
+  printf("Mean run MSE of %d runs: %.6f with the starting tables, %.6f with the extracted ones\n",v.nrun,before,after);
+  battery_fit_free(&fit);
+  int err=0;
+  if (save) {
+    if (!(after<=before)) { printf("Not saving %s: the extracted tables replay worse than the starting ones\n",save); err=1; }
+    else if (battery_replay_save(save,&extracted,&config)!=0) { printf("Can't write %s\n",save); err=1; }
+    else printf("Saved parameters to %s\n",save);
+  }
+  battery_validate_free(&v);
+  return (err || failed)?1:0;
+}
+
+/* Measure the Em tables from slow sweeps and long rests */
+int battery_tool_ocv(int argc,char *argv[])
+{
+  const char *usage="Usage: battery_tool ocv <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [threads N] [save <file>]\n";
+  if (argc<1) { printf("%s",usage); return 1; }
+  struct battery_replay_lut lut;
+  struct battery_replay_config config;
+  struct battery_catalog_query q;
+  battery_tool_test_defaults(&lut,&config,&q);
+  int nthreads=0;
+  const char *save=0;
+  for (int a=1;a<argc;a++) {
+    int used=battery_tool_test_option(argc,argv,&a,&lut,&config,&q,&nthreads);
+    if (used<0) return 1;
+    if (used) continue;
+    if (!strcmp(argv[a],"save") && a+1<argc) save=argv[++a];
+    else { printf("%s",usage); return 1; }
+  }
+
+  struct battery_validate v;
+  int failed=battery_tool_load_tests(&v,argv[0],&q,nthreads,1);
+  if (failed<0) return 1;
+
+  double start=battery_tool_time();
+  struct battery_ocv ocv;
+  battery_ocv_init(&ocv);
+  for (int r=0;r<v.nrun;r++) {
+    long sweep=ocv.sweep_samples;
+    int rests=ocv.rests;
+    battery_ocv_run(&ocv,&lut,&config,v.run[r].log,v.run[r].ambientT);
+    printf("%s run %d: %ld sweep samples, %d long rests\n",v.dataset[v.run[r].dataset].entry.name,r,
+      ocv.sweep_samples-sweep,ocv.rests-rests);
+  }
+  struct battery_replay_lut measured=lut;
+  int replaced=battery_ocv_apply(&ocv,&measured);
+  double elapsed=battery_tool_time()-start;
+  printf("%ld samples in %.3f s (%.1f M samples/s): %ld sweep samples and %d rests replace %d of %d Em entries:\n",
+    v.samples,elapsed,v.samples/elapsed*1.0e-6,ocv.sweep_samples,ocv.rests,replaced,
+    battery_model_table_temps*battery_model_table_SOCs);
+  for (int t=0;t<battery_model_table_temps;t++) {
+    printf("  %5g degC:",battery_model_temperatures[t]);
+    for (int s=0;s<battery_model_table_SOCs;s++)
+      if (ocv.weight[t][s]<battery_ocv_min_weight) printf("      -");
+      else printf(" %6.4f",measured.v[t][s][battery_replay_Em]);
+    printf("\n");
+  }
+
+  struct battery_fit fit;
+  battery_fit_init(&fit,&v,&lut,&config,nthreads);
+  double before=fit.objective, after;
+  battery_fit_evaluate(&fit,&measured,1,&after);
+  printf("Mean run MSE of %d runs: %.6f with the starting tables, %.6f with the measured Em\n",v.nrun,before,after);
+  battery_fit_free(&fit);
+  int err=0;
+  if (save) {
+    if (battery_replay_save(save,&measured,&config)!=0) { printf("Can't write %s\n",save); err=1; }
+    else printf("Saved parameters to %s\n",save);
+  }
+  battery_validate_free(&v);
+  return (err || failed)?1:0;
+}
+
+/* Track each test's SOC with the Kalman filter, and time it on a fleet of cells */
+int battery_tool_ekf(int argc,char *argv[])
+{
+  const char *usage="Usage: battery_tool ekf <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [start SOC] [cells N] [threads N]\n";
+  if (argc<1) { printf("%s",usage); return 1; }
+  struct battery_replay_lut lut;
+  struct battery_replay_config config;
+  struct battery_catalog_query q;
+  battery_tool_test_defaults(&lut,&config,&q);
+  struct battery_ekf_config ekf;
+  battery_ekf_config_init(&ekf);
+  int nthreads=0, cells=4096;
+  for (int a=1;a<argc;a++) {
+    int used=battery_tool_test_option(argc,argv,&a,&lut,&config,&q,&nthreads);
+    if (used<0) return 1;
+    if (used) continue;
+    if (!strcmp(argv[a],"start") && a+1<argc) ekf.SOC=strtof(argv[++a],0);
+    else if (!strcmp(argv[a],"cells") && a+1<argc) cells=atoi(argv[++a]);
+    else { printf("%s",usage); return 1; }
+  }
+
+  struct battery_validate v;
+  int failed=battery_tool_load_tests(&v,argv[0],&q,nthreads,1);
+  if (failed<0) return 1;
+
+  struct battery_ekf_tables tables;
+  battery_ekf_tables_init(&tables,&lut);
+  // cell temperature: the logged one where it's plausible, else the chamber's
+  float **cellT=(float **)malloc(v.nrun*sizeof(float *));
+  for (int r=0;r<v.nrun;r++) {
+    const struct battery_log *log=v.run[r].log;
+    float T=battery_log_nominal_temp(log->col[battery_log_tempC],log->n,v.run[r].ambientT,config.ambientT);
+    cellT[r]=(float *)malloc((log->n>0?log->n:1)*sizeof(float));
+    battery_log_cell_temps(log,T,cellT[r]);
+  }
+
+  printf("Filtering %d runs from SOC %.2f (sigma %.2f), against coulomb counting from full:\n",v.nrun,ekf.SOC,ekf.SOC_sigma);
+  double sum_sq_all=0;
+  long count_all=0;
+  for (int r=0;r<v.nrun;r++) {
+    const struct battery_log *log=v.run[r].log;
+    int n=log->n;
+    if (n<2) continue;
+    const float *time=log->col[battery_log_time], *amps=log->col[battery_log_amps], *cellV=log->col[battery_log_cellV];
+    float *truth=(float *)malloc(n*sizeof(float));
+    battery_coulomb_soc(time,amps,n,1.0f,log->info.rated_Ah*3600.0f,truth,1);
+    struct battery_ekf f;
+    battery_ekf_init(&f,1,&tables,log->info.rated_Ah,&ekf);
+    double sum_sq=0;
+    float settled=-1.0f; // time after which the error stays under 5%
+    for (int i=0;i<n;i++) {
+      battery_ekf_step(&f,i?time[i]-time[i-1]:0.0f,amps+i,cellV+i,cellT[r]+i);
+      float e=f.SOC[0]-truth[i];
+      sum_sq+=e*e;
+      if (fabsf(e)>=0.05f) settled=-1.0f;
+      else if (settled<0.0f) settled=time[i]-time[0];
+    }
+    printf("%s run %d: SOC RMS error %.4f, final %+.4f, ",v.dataset[v.run[r].dataset].entry.name,r,
+      sqrt(sum_sq/n),f.SOC[0]-truth[n-1]);
+    if (settled>=0.0f) printf("within 0.05 from %.0f s of %.0f s\n",settled,time[n-1]-time[0]);
+    else printf("not within 0.05 at the end\n");
+    sum_sq_all+=sum_sq;
+    count_all+=n;
+    battery_ekf_free(&f);
+    free(truth);
+  }
+  printf("All runs: SOC RMS error %.4f\n",count_all?sqrt(sum_sq_all/count_all):0.0);
+
+  // fleet: cell c replays run c%nrun, from a staggered start
+  int steps=1000;
+  struct battery_ekf f;
+  float *amps=(float *)malloc(3*(size_t)(cells>0?cells:1)*sizeof(float)), *volts=amps+cells, *tempC=volts+cells;
+  if (cells>0 && battery_ekf_init(&f,cells,&tables,1.8f,&ekf)==0) {
+    double elapsed=0;
+    for (int k=0;k<steps;k++) {
+      for (int c=0;c<cells;c++) {
+        int r=c%v.nrun, n=v.run[r].log->n, i=n>0?(k+c*7)%n:0;
+        amps[c]=v.run[r].log->col[battery_log_amps][i];
+        volts[c]=v.run[r].log->col[battery_log_cellV][i];
+        tempC[c]=cellT[r][i];
+      }
+      double start=battery_tool_time();
+      battery_ekf_step(&f,1.0f,amps,volts,tempC);
+      elapsed+=battery_tool_time()-start;
+    }
+    printf("Fleet of %d cells, %d steps: %.1f ns per cell per step (%.3f ms per step)\n",
+      cells,steps,elapsed/((double)cells*steps)*1.0e9,elapsed/steps*1.0e3);
+    battery_ekf_free(&f);
+  }
+  free(amps);
+  for (int r=0;r<v.nrun;r++) free(cellT[r]);
+  free(cellT);
+  battery_validate_free(&v);
+  return failed?1:0;
+}
+
+/* Track the state of charge with a particle filter, next to the Kalman filter */
+int battery_tool_particle(int argc,char *argv[])
+{
+  const char *usage="Usage: battery_tool particle <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [start SOC] [particles N] [cells N] [threads N]\n";
+  if (argc<1) { printf("%s",usage); return 1; }
+  struct battery_replay_lut lut;
+  struct battery_replay_config config;
+  struct battery_catalog_query q;
+  battery_tool_test_defaults(&lut,&config,&q);
+  struct battery_ekf_config ekf;
+  battery_ekf_config_init(&ekf);
+  int nthreads=0, particles=1000, cells=16;
+  for (int a=1;a<argc;a++) {
+    int used=battery_tool_test_option(argc,argv,&a,&lut,&config,&q,&nthreads);
+    if (used<0) return 1;
+    if (used) continue;
+    if (!strcmp(argv[a],"start") && a+1<argc) ekf.SOC=strtof(argv[++a],0);
+    else if (!strcmp(argv[a],"particles") && a+1<argc) particles=atoi(argv[++a]);
+    else if (!strcmp(argv[a],"cells") && a+1<argc) cells=atoi(argv[++a]);
+    else { printf("%s",usage); return 1; }
+  }
+  if (particles<1) particles=1;
+
+  struct battery_validate v;
+  int failed=battery_tool_load_tests(&v,argv[0],&q,nthreads,1);
+  if (failed<0) return 1;
+
+  struct battery_ekf_tables tables;
+  battery_ekf_tables_init(&tables,&lut);
+  // cell temperature: the logged one where it's plausible, else the chamber's
+  float **cellT=(float **)malloc(v.nrun*sizeof(float *));
+  for (int r=0;r<v.nrun;r++) {
+    const struct battery_log *log=v.run[r].log;
+    float T=battery_log_nominal_temp(log->col[battery_log_tempC],log->n,v.run[r].ambientT,config.ambientT);
+    cellT[r]=(float *)malloc((log->n>0?log->n:1)*sizeof(float));
+    battery_log_cell_temps(log,T,cellT[r]);
+  }
+
+  printf("Filtering %d runs from SOC %.2f (sigma %.2f) with %d particles, against coulomb counting from full:\n",
+    v.nrun,ekf.SOC,ekf.SOC_sigma,particles);
+  double sum_sq_all[2]={0,0}, elapsed_all=0;
+  long count_all=0, steps_all=0;
+  for (int r=0;r<v.nrun;r++) {
+    const struct battery_log *log=v.run[r].log;
+    int n=log->n;
+    if (n<2) continue;
+    const float *time=log->col[battery_log_time], *amps=log->col[battery_log_amps], *cellV=log->col[battery_log_cellV];
+    float *truth=(float *)malloc(n*sizeof(float));
+    battery_coulomb_soc(time,amps,n,1.0f,log->info.rated_Ah*3600.0f,truth,1);
+    struct battery_ekf f;
+    struct battery_particle pf;
+    battery_ekf_init(&f,1,&tables,log->info.rated_Ah,&ekf);
+    if (battery_particle_init(&pf,1,particles,&lut,log->info.rated_Ah,&ekf,r)!=0) {
+      printf("Out of memory\n");
+      battery_ekf_free(&f);
+      free(truth);
+      failed++;
+      break;
+    }
+    double sum_sq[2]={0,0};
+    float settled=-1.0f; // time after which the particle filter's error stays under 5%
+    double start=battery_tool_time();
+    for (int i=0;i<n;i++) {
+      float dt=i?time[i]-time[i-1]:0.0f;
+      battery_particle_step(&pf,dt,amps+i,cellV+i,cellT[r]+i);
+      float e=pf.est_SOC[0]-truth[i];
+      sum_sq[1]+=e*e;
+      if (fabsf(e)>=0.05f) settled=-1.0f;
+      else if (settled<0.0f) settled=time[i]-time[0];
+    }
+    elapsed_all+=battery_tool_time()-start;
+    steps_all+=n;
+    for (int i=0;i<n;i++) {
+      battery_ekf_step(&f,i?time[i]-time[i-1]:0.0f,amps+i,cellV+i,cellT[r]+i);
+      float e=f.SOC[0]-truth[i];
+      sum_sq[0]+=e*e;
+    }
+    printf("%s run %d: SOC RMS error %.4f (Kalman %.4f), final %+.4f, ",v.dataset[v.run[r].dataset].entry.name,r,
+      sqrt(sum_sq[1]/n),sqrt(sum_sq[0]/n),pf.est_SOC[0]-truth[n-1]);
+    if (settled>=0.0f) printf("within 0.05 from %.0f s of %.0f s\n",settled,time[n-1]-time[0]);
+    else printf("not within 0.05 at the end\n");
+    for (int k=0;k<2;k++) sum_sq_all[k]+=sum_sq[k];
+    count_all+=n;
+    battery_particle_free(&pf);
+    battery_ekf_free(&f);
+    free(truth);
+  }
+  if (count_all) printf("All runs: SOC RMS error %.4f (Kalman %.4f), %.1f us per step\n",
+    sqrt(sum_sq_all[1]/count_all),sqrt(sum_sq_all[0]/count_all),elapsed_all/steps_all*1.0e6);
+
+  // fleet: cell c replays run c%nrun, from a staggered start.  Cell 0
+  // draws the same noise as a lone filter with the same seed, so it must
+  // track that exactly, whenever the other cells resample.
+  int steps=100;
+  struct battery_particle pf, one;
+  float *amps=(float *)malloc(3*(size_t)(cells>0?cells:1)*sizeof(float)), *volts=amps+cells, *tempC=volts+cells;
+  if (cells>0 && battery_particle_init(&pf,cells,particles,&lut,1.8f,&ekf,1)==0) {
+    if (battery_particle_init(&one,1,particles,&lut,1.8f,&ekf,1)!=0) one.mem=0;
+    double elapsed=0, apart=0;
+    for (int k=0;k<steps;k++) {
+      for (int c=0;c<cells;c++) {
+        int r=c%v.nrun, n=v.run[r].log->n, i=n>0?(k+c*7)%n:0;
+        amps[c]=v.run[r].log->col[battery_log_amps][i];
+        volts[c]=v.run[r].log->col[battery_log_cellV][i];
+        tempC[c]=cellT[r][i];
+      }
+      double start=battery_tool_time();
+      battery_particle_step(&pf,1.0f,amps,volts,tempC);
+      elapsed+=battery_tool_time()-start;
+      if (one.mem) {
+        battery_particle_step(&one,1.0f,amps,volts,tempC);
+        apart=fmax(apart,fabsf(pf.est_SOC[0]-one.est_SOC[0]));
+      }
+    }
+    printf("Fleet of %d cells x %d particles, %d steps: %.3f ms per cell per step, %.1f ns per particle, %ld resamples\n",
+      cells,particles,steps,elapsed/((double)cells*steps)*1.0e3,elapsed/((double)cells*particles*steps)*1.0e9,pf.resamples);
+    if (one.mem) {
+      printf("  cell 0 against a lone filter (%ld resamples): SOC differs by up to %g\n",one.resamples,apart);
+      if (apart>0) failed++;
+      battery_particle_free(&one);
+    }
+    battery_particle_free(&pf);
+  }
+  free(amps);
+  for (int r=0;r<v.nrun;r++) free(cellT[r]);
+  free(cellT);
+  battery_validate_free(&v);
+  return failed?1:0;
+}
+
+/* Sort order for floats, ascending */
+int battery_tool_compare_float(const void *a,const void *b)
+{
+  float x=*(const float *)a, y=*(const float *)b;
+  return x<y?-1:x>y?1:0;
+}
+
+/* Estimate each run's state of charge and capacity over sliding windows */
+int battery_tool_mhe(int argc,char *argv[])
+{
+  const char *usage="Usage: battery_tool mhe <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [start SOC] [horizon N] [stride N] [iterations N] [cold] [threads N]\n";
+  if (argc<1) { printf("%s",usage); return 1; }
+  struct battery_replay_lut lut;
+  struct battery_replay_config config;
+  struct battery_catalog_query q;
+  battery_tool_test_defaults(&lut,&config,&q);
+  struct battery_mhe_config mhe;
+  battery_mhe_config_init(&mhe);
+  int nthreads=0;
+  for (int a=1;a<argc;a++) {
+    int used=battery_tool_test_option(argc,argv,&a,&lut,&config,&q,&nthreads);
+    if (used<0) return 1;
+    if (used) continue;
+    if (!strcmp(argv[a],"start") && a+1<argc) mhe.SOC=strtof(argv[++a],0);
+    else if (!strcmp(argv[a],"horizon") && a+1<argc) mhe.horizon=atoi(argv[++a]);
+    else if (!strcmp(argv[a],"stride") && a+1<argc) mhe.stride=atoi(argv[++a]);
+    else if (!strcmp(argv[a],"iterations") && a+1<argc) mhe.iterations=atoi(argv[++a]);
+    else if (!strcmp(argv[a],"cold")) mhe.warm=0;
+    else { printf("%s",usage); return 1; }
+  }
+
+  struct battery_validate v;
+  int failed=battery_tool_load_tests(&v,argv[0],&q,nthreads,1);
+  if (failed<0) return 1;
+
+  printf("Estimating %d runs from SOC %.2f, %d sample windows every %d samples (%s starts), against coulomb counting from full:\n",
+    v.nrun,mhe.SOC,mhe.horizon,mhe.stride,mhe.warm?"warm":"cold");
+  double sum_sq_all=0, elapsed_all=0;
+  long windows_all=0, iterations_all=0;
+  for (int r=0;r<v.nrun;r++) {
+    const struct battery_log *log=v.run[r].log;
+    int n=log->n;
+    if (n<2) continue;
+    const float *time=log->col[battery_log_time], *amps=log->col[battery_log_amps];
+    float *truth=(float *)malloc(n*sizeof(float));
+    battery_coulomb_soc(time,amps,n,1.0f,log->info.rated_Ah*3600.0f,truth,1);
+    int max=n/(mhe.stride>0?mhe.stride:1)+2;
+    struct battery_mhe_estimate *est=(struct battery_mhe_estimate *)malloc(max*sizeof(*est));
+    double start=battery_tool_time();
+    int nwin=battery_mhe_run(&lut,&config,&mhe,log,v.run[r].ambientT,est,max);
+    elapsed_all+=battery_tool_time()-start;
+    double sum_sq=0;
+    long iterations=0;
+    float *rms=(float *)malloc((nwin>0?nwin:1)*sizeof(float));
+    for (int w=0;w<nwin;w++) {
+      float e=est[w].SOC-truth[est[w].end];
+      sum_sq+=e*e;
+      iterations+=est[w].iterations;
+      rms[w]=est[w].rms;
+    }
+    // median window fit: the model's voltage spikes as C1 vanishes past empty
+    qsort(rms,nwin,sizeof(float),battery_tool_compare_float);
+    if (nwin>0) printf("%s run %d: %d windows, SOC RMS error %.4f, final %+.4f, capacity x%.3f, %.2f replays per window, median fit %.1f mV RMS\n",
+      v.dataset[v.run[r].dataset].entry.name,r,nwin,sqrt(sum_sq/nwin),est[nwin-1].SOC-truth[n-1],
+      est[nwin-1].capacity,(double)iterations/nwin,rms[nwin/2]*1.0e3);
+    free(rms);
+    sum_sq_all+=sum_sq;
+    windows_all+=nwin;
+    iterations_all+=iterations;
+    free(est);
+    free(truth);
+  }
+  if (windows_all) printf("All runs: SOC RMS error %.4f over %ld windows, %.2f replays per window, %.2f ms per window\n",
+    sqrt(sum_sq_all/windows_all),windows_all,(double)iterations_all/windows_all,elapsed_all/windows_all*1.0e3);
+  battery_validate_free(&v);
+  return failed?1:0;
+}
+
+/* Track each cell's R0, R1 and capacity drift from the tables */
+int battery_tool_rls(int argc,char *argv[])
+{
+  const char *usage="Usage: battery_tool rls <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [age R0 R1 capacity] [forget f] [cells N] [threads N]\n";
+  if (argc<1) { printf("%s",usage); return 1; }
+  struct battery_replay_lut lut;
+  struct battery_replay_config config;
+  struct battery_catalog_query q;
+  battery_tool_test_defaults(&lut,&config,&q);
+  struct battery_rls_config rls;
+  battery_rls_config_init(&rls);
+  int nthreads=0, cells=4096;
+  float age[battery_rls_factors]={0,0,0};
+  for (int a=1;a<argc;a++) {
+    int used=battery_tool_test_option(argc,argv,&a,&lut,&config,&q,&nthreads);
+    if (used<0) return 1;
+    if (used) continue;
+    if (!strcmp(argv[a],"age") && a+3<argc)
+      for (int k=0;k<battery_rls_factors;k++) age[k]=strtof(argv[++a],0);
+    else if (!strcmp(argv[a],"forget") && a+1<argc) rls.forget=strtof(argv[++a],0);
+    else if (!strcmp(argv[a],"cells") && a+1<argc) cells=atoi(argv[++a]);
+    else { printf("%s",usage); return 1; }
+  }
+  int aged=age[0]>0 && age[1]>0 && age[2]>0;
+
+  struct battery_validate v;
+  int failed=battery_tool_load_tests(&v,argv[0],&q,nthreads,1);
+  if (failed<0) return 1;
+
+  struct battery_ekf_tables tables;
+  battery_ekf_tables_init(&tables,&lut);
+  // each run's measurements: the log's, or an aged cell's voltage and temperature from the replay
+  float **volts=(float **)malloc(v.nrun*sizeof(float *)), **cellT=(float **)malloc(v.nrun*sizeof(float *));
+  int *len=(int *)malloc(v.nrun*sizeof(int));
+  struct battery_replay_lut old=lut;
+  for (int t=0;t<battery_model_table_temps;t++)
+    for (int s=0;s<battery_model_table_SOCs;s++) {
+      old.v[t][s][battery_replay_R0]*=age[battery_rls_R0];
+      old.v[t][s][battery_replay_R1]*=age[battery_rls_R1];
+    }
+  for (int r=0;r<v.nrun;r++) {
+    const struct battery_log *log=v.run[r].log;
+    int n=log->n;
+    float T=battery_log_nominal_temp(log->col[battery_log_tempC],log->n,v.run[r].ambientT,config.ambientT);
+    volts[r]=(float *)malloc(2*(size_t)(n>0?n:1)*sizeof(float));
+    cellT[r]=volts[r]+n;
+    len[r]=n;
+    if (aged) {
+      struct battery_replay_config c=config;
+      c.ambientT=T;
+      c.capacityAh=age[battery_rls_capacity]*log->info.rated_Ah;
+      struct battery_replay rp;
+      battery_replay_start(&rp,&old,&c,&log->info);
+      for (int i=0;i<n;i++) {
+        const float *col[4]={log->col[battery_log_time]+i,log->col[battery_log_amps]+i,log->col[battery_log_tempC]+i,log->col[battery_log_cellV]+i};
+        battery_replay_run(&rp,col[0],col[1],col[2],col[3],1,volts[r]+i,0,0);
+        cellT[r][i]=rp.battery.cellT;
+        if (rp.battery.SOC<0.0f) { len[r]=i; break; } // the aged cell is empty
+      }
+    }
+    else {
+      memcpy(volts[r],log->col[battery_log_cellV],n*sizeof(float));
+      battery_log_cell_temps(log,T,cellT[r]);
+    }
+  }
+
+  if (aged) printf("Tracking %d runs of a cell aged R0 x%.2f, R1 x%.2f, capacity x%.2f (forgetting %.4f):\n",
+    v.nrun,age[0],age[1],age[2],rls.forget);
+  else printf("Tracking %d runs against the tables (forgetting %.4f):\n",v.nrun,rls.forget);
+  for (int r=0;r<v.nrun;r++) {
+    const struct battery_log *log=v.run[r].log;
+    int n=len[r];
+    if (n<2) continue;
+    const float *time=log->col[battery_log_time], *amps=log->col[battery_log_amps];
+    struct battery_rls f;
+    battery_rls_init(&f,1,&tables,log->info.rated_Ah,&rls);
+    for (int i=0;i<n;i++) battery_rls_step(&f,i?time[i]-time[i-1]:0.0f,amps+i,volts[r]+i,cellT[r]+i);
+    printf("%s run %d: R0 x%.3f, R1 x%.3f, capacity x%.3f after %.0f s\n",v.dataset[v.run[r].dataset].entry.name,r,
+      f.factor[battery_rls_R0][0],f.factor[battery_rls_R1][0],f.factor[battery_rls_capacity][0],time[n-1]-time[0]);
+    battery_rls_free(&f);
+  }
+
+  // fleet: cell c replays run c%nrun, from a staggered start
+  int steps=1000;
+  struct battery_rls f;
+  float *in=(float *)malloc(3*(size_t)(cells>0?cells:1)*sizeof(float)), *V=in+cells, *T=V+cells;
+  if (cells>0 && battery_rls_init(&f,cells,&tables,1.8f,&rls)==0) {
+    double elapsed=0;
+    for (int k=0;k<steps;k++) {
+      for (int c=0;c<cells;c++) {
+        int r=c%v.nrun, n=len[r], i=n>0?(k+c*7)%n:0;
+        in[c]=v.run[r].log->col[battery_log_amps][i];
+        V[c]=volts[r][i];
+        T[c]=cellT[r][i];
+      }
+      double start=battery_tool_time();
+      battery_rls_step(&f,1.0f,in,V,T);
+      elapsed+=battery_tool_time()-start;
+    }
+    printf("Fleet of %d cells, %d steps: %.1f ns per cell per step (%.3f ms per step)\n",
+      cells,steps,elapsed/((double)cells*steps)*1.0e9,elapsed/steps*1.0e3);
+    battery_rls_free(&f);
+  }
+  free(in);
+  for (int r=0;r<v.nrun;r++) free(volts[r]);
+  free(volts);
+  free(cellT);
+  free(len);
+  battery_validate_free(&v);
+  return failed?1:0;
+}
+
+/* SOC where lut's Em reaches volts, by bisection on the lookup */
+float battery_tool_bisect_SOC(const struct battery_replay_lut *lut,float volts,float tempC)
+{
+  float lo=0.0f, hi=1.0f, param[battery_replay_params];
+  for (int k=0;k<20;k++) {
+    float mid=0.5f*(lo+hi);
+    battery_replay_lookup(lut,mid,tempC,param);
+    if (param[battery_replay_Em]<volts) lo=mid; else hi=mid;
+  }
+  return 0.5f*(lo+hi);
+}
+
+/* Initialize SOC from rested voltages, and time a fleet cold start */
+int battery_tool_rest(int argc,char *argv[])
+{
+  const char *usage="Usage: battery_tool rest <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [cells N] [threads N]\n";
+  if (argc<1) { printf("%s",usage); return 1; }
+  struct battery_replay_lut lut;
+  struct battery_replay_config config;
+  struct battery_catalog_query q;
+  battery_tool_test_defaults(&lut,&config,&q);
+  int nthreads=0, cells=1000000;
+  for (int a=1;a<argc;a++) {
+    int used=battery_tool_test_option(argc,argv,&a,&lut,&config,&q,&nthreads);
+    if (used<0) return 1;
+    if (used) continue;
+    if (!strcmp(argv[a],"cells") && a+1<argc) cells=atoi(argv[++a]);
+    else { printf("%s",usage); return 1; }
+  }
+
+  static struct battery_inverse inv;
+  double start=battery_tool_time();
+  int raised=battery_inverse_init(&inv,&lut);
+  printf("Inverse Em table %dx%d built in %.3f ms (%d table nodes raised to make Em rise with SOC)\n",
+    battery_inverse_temps,battery_inverse_volts,(battery_tool_time()-start)*1.0e3,raised);
+  // round trip through the tables, and the grid against the exact inverse
+  double worst=0, worst_exact=0, sum=0;
+  long count=0;
+  for (int t=0;t<=400;t++)
+    for (int s=0;s<=1000;s++) {
+      float T=-20.0f+0.1f*t, SOC=0.001f*s, param[battery_replay_params];
+      battery_replay_lookup(&lut,SOC,T,param);
+      float guess=battery_inverse_SOC(&inv,param[battery_replay_Em],T);
+      double e=fabs(guess-battery_inverse_exact(&inv,param[battery_replay_Em],T));
+      if (e>worst_exact) worst_exact=e;
+      if (!raised) {
+        e=fabs(guess-SOC);
+        if (e>worst) worst=e;
+        sum+=e*e;
+        count++;
+      }
+    }
+  if (count) printf("  SOC -> Em -> SOC over -20..20 C: RMS error %.5f, worst %.5f\n",sqrt(sum/count),worst);
+  printf("  grid against the exact inverse: worst %.5f\n",worst_exact);
+
+  struct battery_validate v;
+  int failed=battery_tool_load_tests(&v,argv[0],&q,nthreads,0);
+  if (failed<0) return 1;
+
+  // each test starts full and rested: its first voltage, and the end of
+  // each long rest after, against its Coulomb count
+  printf("SOC from rested voltage, against the Coulomb count from full:\n");
+  for (int r=0;r<v.nrun;r++) {
+    const struct battery_log *log=v.run[r].log;
+    int n=log->n;
+    if (n<2) continue;
+    const float *time=log->col[battery_log_time], *amps=log->col[battery_log_amps];
+    const float *cellV=log->col[battery_log_cellV];
+    float T=battery_log_nominal_temp(log->col[battery_log_tempC],log->n,v.run[r].ambientT,config.ambientT);
+    float *counted=(float *)malloc(2*(size_t)n*sizeof(float)), *cellT=counted+n;
+    battery_coulomb_soc(time,amps,n,1.0f,log->info.rated_Ah*3600.0f,counted,nthreads);
+    battery_log_cell_temps(log,T,cellT);
+    float first=battery_inverse_SOC(&inv,cellV[0],cellT[0]);
+    float peak=0;
+    for (int i=0;i<n;i++) if (amps[i]>peak) peak=amps[i];
+    float rest=peak*battery_ocv_rest_fraction, rest_start=time[0];
+    int resting=0, rests=0;
+    double err=0;
+    for (int i=1;i<n;i++) {
+      if (amps[i]<rest) {
+        if (!resting) rest_start=time[i];
+        resting=1;
+        continue;
+      }
+      // load came back on: the sample before ended a rest
+      if (resting && time[i-1]-rest_start>=battery_ocv_min_rest && counted[i-1]>=0.0f) {
+        float e=battery_inverse_SOC(&inv,cellV[i-1],cellT[i-1])-counted[i-1];
+        err+=e*e;
+        rests++;
+      }
+      resting=0;
+    }
+    printf("%s run %d: starts at SOC %.3f (%.3f V)",v.dataset[v.run[r].dataset].entry.name,r,first,cellV[0]);
+    if (rests) printf(", %d rests: RMS error %.3f",rests,sqrt(err/rests));
+    printf("\n");
+    free(counted);
+  }
+
+  // a fleet's voltage snapshot: random SOC and temperature per cell
+  if (cells>0) {
+    float *volts=(float *)malloc(4*(size_t)cells*sizeof(float)), *cellT=volts+cells, *truth=cellT+cells, *SOC=truth+cells;
+    unsigned seed=1;
+    for (int c=0;c<cells;c++) {
+      float param[battery_replay_params];
+      seed=seed*1664525u+1013904223u;
+      truth[c]=(seed>>8)*(1.0f/16777216.0f);
+      seed=seed*1664525u+1013904223u;
+      cellT[c]=-20.0f+40.0f*((seed>>8)*(1.0f/16777216.0f));
+      battery_replay_lookup(&lut,truth[c],cellT[c],param);
+      volts[c]=param[battery_replay_Em];
+    }
+    double batch=1e30, single=1e30;
+    for (int k=0;k<5;k++) {
+      start=battery_tool_time();
+      battery_inverse_batch(&inv,cells,volts,cellT,SOC);
+      double t=battery_tool_time()-start;
+      if (t<batch) batch=t;
+    }
+    for (int k=0;k<5;k++) {
+      start=battery_tool_time();
+      for (int c=0;c<cells;c++) SOC[c]=battery_inverse_SOC(&inv,volts[c],cellT[c]);
+      double t=battery_tool_time()-start;
+      if (t<single) single=t;
+    }
+    double worst_fleet=0;
+    for (int c=0;c<cells;c++) if (fabs(SOC[c]-truth[c])>worst_fleet) worst_fleet=fabs(SOC[c]-truth[c]);
+    start=battery_tool_time();
+    for (int c=0;c<cells;c++) SOC[c]=battery_tool_bisect_SOC(&lut,volts[c],cellT[c]);
+    double bisect=battery_tool_time()-start;
+    printf("Cold start of %d cells: %.2f ms batched, %.2f ms one at a time, %.1f ms by bisection (worst SOC error %.5f)\n",
+      cells,batch*1.0e3,single*1.0e3,bisect*1.0e3,worst_fleet);
+    free(volts);
+  }
+  battery_validate_free(&v);
+  return failed?1:0;
+}
+
+/* Batch read and parse directories of logs */
+int battery_tool_ingest(int argc,char *argv[])
+{
+  int nthreads=0, backend=battery_ingest_uring;
+  int n=0, max=0;
+  char **paths=0;
+  for (int a=0;a<argc;a++) {
+    if (!strcmp(argv[a],"threads") && a+1<argc) { nthreads=atoi(argv[++a]); continue; }
+    if (!strcmp(argv[a],"pread")) { backend=battery_ingest_pread; continue; }
+    struct stat st;
+    if (stat(argv[a],&st)!=0) { printf("Can't read %s\n",argv[a]); return 1; }
+    char **list=0;
+    int nlist=1;
+    if (S_ISDIR(st.st_mode)) {
+      nlist=battery_ingest_list(argv[a],&list);
+      if (nlist<0) { printf("Can't read directory %s\n",argv[a]); return 1; }
+    }
+    if (n+nlist>max) { max=2*(n+nlist); paths=(char **)realloc(paths,max*sizeof(char *)); }
+    if (list) { memcpy(paths+n,list,nlist*sizeof(char *)); free(list); }
+    else paths[n]=strdup(argv[a]);
+    n+=nlist;
+  }
+  if (n==0) { printf("Usage: battery_tool ingest <directory or file.csv> ... [threads N] [pread]\n"); return 1; }
+
+  double start=battery_tool_time();
+  struct battery_ingest_result *results;
+  backend=battery_ingest_files((const char **)paths,n,nthreads,backend,&results);
+  double elapsed=battery_tool_time()-start;
+
+  long samples=0, runs=0, failed=0;
+  double bytes=0;
+  for (int f=0;f<n;f++) {
+    if (results[f].nrun<0) { printf("Can't read %s\n",results[f].path); failed++; continue; }
+    runs+=results[f].nrun;
+    bytes+=results[f].bytes;
+    for (int r=0;r<results[f].nrun;r++) samples+=results[f].runs[r].n;
+  }
+  printf("Ingested %d files (%ld runs, %ld samples, %.1f MB) with %s in %.3f seconds\n",
+    n-(int)failed,runs,samples,bytes*1.0e-6,backend==battery_ingest_uring?"io_uring":"pread",elapsed);
+  printf("  %.1f MB/s, %.1f M samples/s, %.0f files/s\n",
+    bytes*1.0e-6/elapsed,samples*1.0e-6/elapsed,n/elapsed);
+  battery_ingest_free(results,n);
+  for (int f=0;f<n;f++) free(paths[f]);
+  free(paths);
+  return failed?1:0;
+}
+
+/* Parse, simulate and score logs as a pipeline */
+int battery_tool_pipeline(int argc,char *argv[])
+{
+  if (argc<1) { printf("Usage: battery_tool pipeline <file.csv or .zip> ... [bands]\n"); return 1; }
+  struct battery_pipeline p;
+  battery_pipeline_init(&p);
+  int verbose=0;
+  for (int a=0;a<argc;a++) {
+    if (!strcmp(argv[a],"bands")) { verbose=1; continue; }
+    if (battery_pipeline_add(&p,argv[a])!=0) { printf("Can't read zip %s\n",argv[a]); battery_pipeline_close(&p); return 1; }
+  }
+  struct battery_score total;
+  battery_score_init(&total,&p.bands);
+
+  double start=battery_tool_time();
+  battery_pipeline_run(&p);
+  double elapsed=battery_tool_time()-start;
+
+  int failed=0;
+  for (int s=0;s<p.nsource;s++)
+    if (p.source[s].status!=0) { printf("Can't read %s\n",p.source[s].name); failed=1; }
+  for (int r=0;r<p.nrun;r++) {
+    const struct battery_pipeline_run *run=&p.runs[r];
+    printf("%s run %d: \"%s\"\n",p.source[run->source].name,run->run,run->info.test);
+    battery_tool_print_stats("all",&run->score.all);
+    if (verbose) battery_tool_print_score(&run->score);
+    else for (int b=0;b<=run->score.config.nsoc;b++) {
+      printf("%s",b?",":"    SOC band MSE");
+      if (run->score.soc[b].n==0) printf(" -");
+      else printf(" %.6f",battery_score_mse(&run->score.soc[b]));
+    }
+    if (!verbose) printf("\n");
+    battery_score_merge(&total,&run->score);
+  }
+  printf("All runs:\n");
+  battery_tool_print_stats("all",&total.all);
+  battery_tool_print_score(&total);
+  printf("Scored %ld samples in %.3f seconds (%.1f M samples/s)\n",
+    p.samples,elapsed,p.samples*1.0e-6/elapsed);
+  printf("  backpressure waits: parse %lu, simulate %lu; idle waits: simulate %lu, score %lu\n",
+    p.parsed.full_waits,p.simulated.full_waits,p.parsed.empty_waits,p.simulated.empty_waits);
+  battery_pipeline_close(&p);
+  return failed;
+}
+
+int main(int argc,char *argv[])
+{
+  if (argc>=2 && !strcmp(argv[1],"parse")) return battery_tool_parse(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"cache")) return battery_tool_cache(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"show")) return battery_tool_show(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"slice")) return battery_tool_slice(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"catalog")) return battery_tool_catalog(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"pipeline")) return battery_tool_pipeline(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"replay")) return battery_tool_replay(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"validate")) return battery_tool_validate(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"fit")) return battery_tool_fit(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"thermal")) return battery_tool_thermal(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"sensitivity")) return battery_tool_sensitivity(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"pulses")) return battery_tool_pulses(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"ocv")) return battery_tool_ocv(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"ekf")) return battery_tool_ekf(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"particle")) return battery_tool_particle(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"mhe")) return battery_tool_mhe(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"rls")) return battery_tool_rls(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"rest")) return battery_tool_rest(argc-2,argv+2);
+  if (argc>=2 && !strcmp(argv[1],"ingest")) return battery_tool_ingest(argc-2,argv+2);
+
+  printf("Usage:\n"
+    "  battery_tool parse <file.csv or .zip> ...\n"
+    "  battery_tool cache <outdir> <file.csv or .zip> ...\n"
+    "  battery_tool show <file.bcache> ...\n"
+    "  battery_tool slice <file.bcache> [run r] time <t0> <t1> | soc <hi> <lo> | pulse <k> | rest <k>\n"
+    "  battery_tool catalog <licoo2_data.zip or .bcat> [Ah lo hi] [temp lo hi] [rate lo hi] [csv] [conflicted] [save <file.bcat>]\n"
+    "  battery_tool pipeline <file.csv or .zip> ... [bands]\n"
+    "  battery_tool replay <file.csv or .zip> ... [repeat N] [out <residuals.csv>]\n"
+    "  battery_tool validate <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [threads N] [gate <mse>]\n"
+    "  battery_tool fit <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [iterations N] [descent | sweep] [rows] [threads N] [check] [save <file>]\n"
+    "  battery_tool thermal <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [generations N] [population N] [threads N] [save <file>]\n"
+    "  battery_tool sensitivity <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [cutoff V] [top N] [threads N]\n"
+    "  battery_tool pulses <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [list] [threads N] [save <file>]\n"
+    "  battery_tool ocv <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [threads N] [save <file>]\n"
+    "  battery_tool ekf <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [start SOC] [cells N] [threads N]\n"
+    "  battery_tool particle <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [start SOC] [particles N] [cells N] [threads N]\n"
+    "  battery_tool mhe <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [start SOC] [horizon N] [stride N] [iterations N] [cold] [threads N]\n"
+    "  battery_tool rls <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [age R0 R1 capacity] [forget f] [cells N] [threads N]\n"
+    "  battery_tool rest <licoo2_data.zip> [params <file>] [Ah lo hi] [temp lo hi] [rate lo hi] [scenarios] [cells N] [threads N]\n"
+    "  battery_tool ingest <directory or file.csv> ... [threads N] [pread]\n");
+  return 1;
+}
@@ -0,0 +1,280 @@
+/**
+  Validation matrix: replay every catalogued discharge test against one
+  parameter set, and tabulate the model error by test temperature,
+  C-rate and SOC band (the thesis MSE_Matrix, for the whole corpus).
+
+  The datasets are parsed into memory once, and each evaluation replays
+  all their runs in parallel, one run per thread at a time, each run
+  scoring into its own battery_score, so threads share nothing until the
+  scores are merged into matrix cells.  A parameter fitter evaluates
+  candidate tables the same way.
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_VALIDATE_H
+#define BATTERY_VALIDATE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "battery_log.h"
+#include "battery_zip.h"
+#include "battery_threads.h"
+#include "battery_catalog.h"
+#include "battery_replay.h"
+#include "battery_score.h"
+
+/* One run of one dataset, ready to replay */
+struct battery_validate_run {
+  int dataset; /* index into battery_validate.dataset */
+  const struct battery_log *log;
+  float ambientT; /* the chamber's nominal temperature (deg C), NAN if the name doesn't give it */
+};
+
+/* One catalogued test, parsed */
+struct battery_validate_dataset {
+  struct battery_catalog_entry entry; /* conditions it was run under */
+  int nrun;  /* runs parsed, or -1 if it couldn't be read */
+  struct battery_log *runs;
+};
+
+/* A set of datasets, and the scores from its last evaluation */
+struct battery_validate {
+  int ndataset;
+  struct battery_validate_dataset *dataset;
+  int nrun;
+  struct battery_validate_run *run;
+  long samples;
+
+  struct battery_score_config bands;
+  struct battery_score *score; /* per run, from the last evaluation */
+  int nthreads;
+};
+
+/* One cell of the matrix: all datasets at one temperature and C-rate */
+struct battery_validate_cell {
+  float tempC, crate; /* nominal test conditions (NAN if unknown) */
+  int ndataset;
+  struct battery_score score;
+};
+
+/* Scores gathered into cells, sorted by temperature then C-rate */
+struct battery_validate_matrix {
+  int ncell;
+  struct battery_validate_cell *cell;
+};
+
+
+/********* Loading ***********/
+
+struct battery_validate_load_work {
+  struct battery_validate *v;
+  const struct battery_zip *zip;
+  int next; /* next dataset to claim (atomic) */
+};
+
+void *battery_validate_load_worker(void *arg)
+{
+  struct battery_validate_load_work *w=(struct battery_validate_load_work *)arg;
+  int d;
+  while ((d=__atomic_fetch_add(&w->next,1,__ATOMIC_RELAXED))<w->v->ndataset) {
+    struct battery_validate_dataset *ds=&w->v->dataset[d];
+    if (ds->entry.member>=0) ds->nrun=battery_zip_read_log(w->zip,ds->entry.member,&ds->runs);
+    else ds->nrun=battery_log_read(ds->entry.path,&ds->runs);
+  }
+  return 0;
+}
+
+/* Number of worker threads to run: nthreads, or one per core if that's 0 */
+int battery_validate_threads(int nthreads,int work)
+{
+  if (nthreads<1) nthreads=battery_threads_default();
+  if (nthreads>work) nthreads=work;
+  return nthreads>0?nthreads:1;
+}
+
+/* Parse the CSV datasets from this catalog that match the query.
+   Archive members are read from the zip file the catalog was built from
+   (zipname may be 0 if every entry is a plain file).
+   Returns the number of datasets that couldn't be read, or -1 if the
+   archive can't be opened. */
+int battery_validate_load(struct battery_validate *v,const struct battery_catalog *cat,
+  const char *zipname,const struct battery_catalog_query *q,int nthreads)
+{
+  memset(v,0,sizeof(*v));
+  battery_score_config_init(&v->bands);
+  v->nthreads=nthreads;
+  struct battery_catalog_query csv=*q;
+  csv.csv_only=1;
+  int *match=(int *)malloc((cat->n>0?cat->n:1)*sizeof(int));
+  int n=battery_catalog_query(cat,&csv,match,cat->n);
+  v->dataset=(struct battery_validate_dataset *)calloc(n>0?n:1,sizeof(struct battery_validate_dataset));
+  v->ndataset=n;
+  for (int i=0;i<n;i++) v->dataset[i].entry=cat->entry[match[i]];
+  free(match);
+
+  struct battery_zip zip;
+  memset(&zip,0,sizeof(zip));
+  if (zipname && battery_zip_open(&zip,zipname)!=0) {
+    free(v->dataset);
+    v->dataset=0;
+    v->ndataset=0;
+    return -1;
+  }
+  struct battery_validate_load_work w={v,&zip,0};
+  nthreads=battery_validate_threads(nthreads,n);
+  pthread_t thread[nthreads];
+  for (int t=1;t<nthreads;t++) pthread_create(&thread[t],0,battery_validate_load_worker,&w);
+  battery_validate_load_worker(&w);
+  for (int t=1;t<nthreads;t++) pthread_join(thread[t],0);
+  if (zipname) battery_zip_close(&zip);
+
+  int failed=0;
+  for (int d=0;d<n;d++) {
+    struct battery_validate_dataset *ds=&v->dataset[d];
+    if (ds->nrun<0) { failed++; continue; }
+    v->run=(struct battery_validate_run *)realloc(v->run,(v->nrun+ds->nrun)*sizeof(struct battery_validate_run));
+    for (int r=0;r<ds->nrun;r++) {
+      v->run[v->nrun].dataset=d;
+      v->run[v->nrun].log=&ds->runs[r];
+      v->run[v->nrun].ambientT=ds->entry.tempC;
+      v->nrun++;
+      v->samples+=ds->runs[r].n;
+    }
+  }
+  v->score=(struct battery_score *)calloc(v->nrun>0?v->nrun:1,sizeof(struct battery_score));
+  return failed;
+}
+
+void battery_validate_free(struct battery_validate *v)
+{
+  for (int d=0;d<v->ndataset;d++)
+    if (v->dataset[d].nrun>0) battery_log_free(v->dataset[d].runs,v->dataset[d].nrun);
+  free(v->dataset);
+  free(v->run);
+  free(v->score);
+  memset(v,0,sizeof(*v));
+}
+
+
+/********* Evaluation ***********/
+
+struct battery_validate_work {
+  struct battery_validate *v;
+  const struct battery_replay_lut *lut;
+  const struct battery_replay_config *config;
+  int next; /* next run to claim (atomic) */
+};
+
+/* Set *out to config, with run r's chamber temperature as the ambient:
+   its nominal one, or its first valid reading if the name doesn't give one */
+static inline void battery_validate_run_config(const struct battery_validate *v,int r,
+  const struct battery_replay_config *config,struct battery_replay_config *out)
+{
+  *out=*config;
+  const struct battery_log *log=v->run[r].log;
+  out->ambientT=battery_log_nominal_temp(log->col[battery_log_tempC],log->n,v->run[r].ambientT,config->ambientT);
+}
+
+/* Replay one run, scoring it into v->score[r] */
+void battery_validate_replay(struct battery_validate *v,int r,
+  const struct battery_replay_lut *lut,const struct battery_replay_config *config)
+{
+  const struct battery_log *log=v->run[r].log;
+  struct battery_replay_config c;
+  battery_validate_run_config(v,r,config,&c);
+  struct battery_replay replay;
+  battery_replay_start(&replay,lut,&c,&log->info);
+  battery_score_init(&v->score[r],&v->bands);
+  battery_replay_run(&replay,log->col[battery_log_time],log->col[battery_log_amps],
+    log->col[battery_log_tempC],log->col[battery_log_cellV],log->n,0,0,&v->score[r]);
+}
+
+void *battery_validate_worker(void *arg)
+{
+  struct battery_validate_work *w=(struct battery_validate_work *)arg;
+  int r;
+  while ((r=__atomic_fetch_add(&w->next,1,__ATOMIC_RELAXED))<w->v->nrun)
+    battery_validate_replay(w->v,r,w->lut,w->config);
+  return 0;
+}
+
+/* Replay every run with these parameters, filling in v->score */
+void battery_validate_evaluate(struct battery_validate *v,
+  const struct battery_replay_lut *lut,const struct battery_replay_config *config)
+{
+  struct battery_validate_work w={v,lut,config,0};
+  int nthreads=battery_validate_threads(v->nthreads,v->nrun);
+  pthread_t thread[nthreads];
+  for (int t=1;t<nthreads;t++) pthread_create(&thread[t],0,battery_validate_worker,&w);
+  battery_validate_worker(&w);
+  for (int t=1;t<nthreads;t++) pthread_join(thread[t],0);
+}
+
+/* Merge the scores of every run from the last evaluation */
+void battery_validate_total(const struct battery_validate *v,struct battery_score *total)
+{
+  battery_score_init(total,&v->bands);
+  for (int r=0;r<v->nrun;r++) battery_score_merge(total,&v->score[r]);
+}
+
+
+/********* Matrix ***********/
+
+/* Same nominal condition, treating unknown (NAN) as equal to itself */
+static inline int battery_validate_same(float a,float b)
+{
+  return a==b || (a!=a && b!=b);
+}
+
+/* Sort order for cells: temperature, then C-rate, unknowns last */
+static inline int battery_validate_less(float a,float b)
+{
+  if (a!=a) return 0;
+  if (b!=b) return 1;
+  return a<b;
+}
+
+int battery_validate_cell_compare(const void *a,const void *b)
+{
+  const struct battery_validate_cell *x=(const struct battery_validate_cell *)a, *y=(const struct battery_validate_cell *)b;
+  if (!battery_validate_same(x->tempC,y->tempC)) return battery_validate_less(x->tempC,y->tempC)?-1:1;
+  if (!battery_validate_same(x->crate,y->crate)) return battery_validate_less(x->crate,y->crate)?-1:1;
+  return 0;
+}
+
+/* Gather the last evaluation's scores into temperature x C-rate cells */
+void battery_validate_matrix(const struct battery_validate *v,struct battery_validate_matrix *m)
+{
+  m->ncell=0;
+  m->cell=(struct battery_validate_cell *)malloc((v->ndataset>0?v->ndataset:1)*sizeof(struct battery_validate_cell));
+  for (int d=0;d<v->ndataset;d++) {
+    const struct battery_catalog_entry *e=&v->dataset[d].entry;
+    if (v->dataset[d].nrun<=0) continue;
+    int c=0;
+    while (c<m->ncell && !(battery_validate_same(m->cell[c].tempC,e->tempC)
+                        && battery_validate_same(m->cell[c].crate,e->crate))) c++;
+    if (c==m->ncell) {
+      m->cell[c].tempC=e->tempC;
+      m->cell[c].crate=e->crate;
+      m->cell[c].ndataset=0;
+      battery_score_init(&m->cell[c].score,&v->bands);
+      m->ncell++;
+    }
+    m->cell[c].ndataset++;
+    for (int r=0;r<v->nrun;r++)
+      if (v->run[r].dataset==d) battery_score_merge(&m->cell[c].score,&v->score[r]);
+  }
+  qsort(m->cell,m->ncell,sizeof(struct battery_validate_cell),battery_validate_cell_compare);
+}
+
+void battery_validate_matrix_free(struct battery_validate_matrix *m)
+{
+  free(m->cell);
+  m->cell=0;
+  m->ncell=0;
+}
+
+#endif
@@ -0,0 +1,278 @@
+/**
+  Read discharge logs straight out of the zip archive they ship in.
+
+  The archive is memory mapped, its central directory lists the members,
+  and each member is inflated in small chunks that go directly into the
+  CSV parser, so parsing starts on the first bytes and nothing is ever
+  extracted to disk.  Members are spread across threads, one per thread.
+
+  Needs zlib (-lz) and pthreads (-lpthread).
+
+  Part of the C language lipo battery simulator (Public Domain)
+*/
+#ifndef BATTERY_ZIP_H
+#define BATTERY_ZIP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "battery_log.h"
+#include "battery_threads.h"
+
+/* One member file of a zip archive */
+struct battery_zip_entry {
+  char name[256];  /* path within the archive */
+  int method;      /* 0: stored, 8: deflated */
+  uint32_t crc;    /* CRC-32 of the uncompressed data */
+  uint32_t csize;  /* compressed size (bytes) */
+  uint32_t usize;  /* uncompressed size (bytes) */
+  uint32_t offset; /* offset of the member's local header */
+};
+
+/* An open zip archive */
+struct battery_zip {
+  const unsigned char *data; /* the whole archive, memory mapped */
+  size_t len;
+  int n; /* number of members */
+  struct battery_zip_entry *entry;
+};
+
+#define battery_zip_chunk 65536 /* bytes inflated per step */
+
+/* Little-endian field readers */
+static inline uint32_t battery_zip_u16(const unsigned char *p) { return p[0]|(p[1]<<8); }
+static inline uint32_t battery_zip_u32(const unsigned char *p) { return p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24); }
+
+void battery_zip_close(struct battery_zip *zip)
+{
+  if (zip->data) munmap((void *)zip->data,zip->len);
+  free(zip->entry);
+  memset(zip,0,sizeof(*zip));
+}
+
+/* Open this zip archive and read its central directory.
+   Returns 0 on success, or -1 if the file can't be read or isn't a zip. */
+int battery_zip_open(struct battery_zip *zip,const char *filename)
+{
+  memset(zip,0,sizeof(*zip));
+  int fd=open(filename,O_RDONLY);
+  if (fd<0) return -1;
+  struct stat st;
+  if (fstat(fd,&st)!=0 || st.st_size<22) { close(fd); return -1; }
+  void *map=mmap(0,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  if (map==MAP_FAILED) return -1;
+  zip->data=(const unsigned char *)map;
+  zip->len=st.st_size;
+
+  // The end of central directory record sits before an optional comment
+  const unsigned char *end=0;
+  for (size_t back=22;back<=zip->len && back<=22+65535;back++) {
+    const unsigned char *p=zip->data+zip->len-back;
+    if (battery_zip_u32(p)==0x06054b50) { end=p; break; }
+  }
+  if (!end) { battery_zip_close(zip); return -1; }
+  int count=battery_zip_u16(end+10);
+  uint32_t dir_size=battery_zip_u32(end+12), dir_offset=battery_zip_u32(end+16);
+  if ((size_t)dir_offset+dir_size>zip->len) { battery_zip_close(zip); return -1; }
+
+  zip->entry=(struct battery_zip_entry *)calloc(count>0?count:1,sizeof(struct battery_zip_entry));
+  const unsigned char *p=zip->data+dir_offset, *dir_end=p+dir_size;
+  for (int e=0;e<count;e++) {
+    if (p+46>dir_end || battery_zip_u32(p)!=0x02014b50) { battery_zip_close(zip); return -1; }
+    struct battery_zip_entry *z=&zip->entry[zip->n++];
+    z->method=battery_zip_u16(p+10);
+    z->crc=battery_zip_u32(p+16);
+    z->csize=battery_zip_u32(p+20);
+    z->usize=battery_zip_u32(p+24);
+    int name_len=battery_zip_u16(p+28), extra_len=battery_zip_u16(p+30), comment_len=battery_zip_u16(p+32);
+    z->offset=battery_zip_u32(p+42);
+    int copy=name_len<(int)sizeof(z->name)-1?name_len:(int)sizeof(z->name)-1;
+    memcpy(z->name,p+46,copy);
+    z->name[copy]=0;
+    p+=46+name_len+extra_len+comment_len;
+  }
+  return 0;
+}
+
+/* Find the member with this name, or return -1 */
+int battery_zip_find(const struct battery_zip *zip,const char *name)
+{
+  for (int e=0;e<zip->n;e++)
+    if (!strcmp(zip->entry[e].name,name)) return e;
+  return -1;
+}
+
+/* Return the base file name of this member, without its directory */
+const char *battery_zip_basename(const struct battery_zip_entry *z)
+{
+  const char *slash=strrchr(z->name,'/');
+  return slash?slash+1:z->name;
+}
+
+/* Return 1 if this member is a CSV discharge log */
+int battery_zip_is_csv(const struct battery_zip_entry *z)
+{
+  size_t len=strlen(z->name);
+  return len>4 && !strcasecmp(z->name+len-4,".csv");
+}
+
+/* Called with each chunk of a member's uncompressed data.
+   Returns nonzero to stop reading the member early. */
+typedef int (*battery_zip_chunk_fn)(void *user,const char *buf,size_t len);
+
+/* Stream the uncompressed contents of member e to fn in chunks.
+   Returns 0 on success (including when fn stops early),
+   or -1 on a damaged member or bad CRC. */
+int battery_zip_read(const struct battery_zip *zip,int e,battery_zip_chunk_fn fn,void *user)
+{
+  const struct battery_zip_entry *z=&zip->entry[e];
+  const unsigned char *local=zip->data+z->offset;
+  if ((size_t)z->offset+30>zip->len || battery_zip_u32(local)!=0x04034b50) return -1;
+  size_t start=(size_t)z->offset+30+battery_zip_u16(local+26)+battery_zip_u16(local+28);
+  if (start+z->csize>zip->len) return -1;
+  const unsigned char *src=zip->data+start;
+
+  uLong crc=crc32(0,Z_NULL,0);
+  if (z->method==0)
+  { // stored: hand over the mapped bytes directly
+    for (uint32_t done=0;done<z->csize;done+=battery_zip_chunk) {
+      uint32_t len=z->csize-done<battery_zip_chunk?z->csize-done:battery_zip_chunk;
+      crc=crc32(crc,src+done,len);
+      if (fn(user,(const char *)src+done,len)) return 0;
+    }
+  }
+  else if (z->method==8)
+  { // deflated: raw deflate stream, no zlib header
+    z_stream strm;
+    memset(&strm,0,sizeof(strm));
+    if (inflateInit2(&strm,-MAX_WBITS)!=Z_OK) return -1;
+    strm.next_in=(Bytef *)src;
+    strm.avail_in=z->csize;
+    unsigned char out[battery_zip_chunk];
+    int ret;
+    do {
+      strm.next_out=out;
+      strm.avail_out=sizeof(out);
+      ret=inflate(&strm,Z_NO_FLUSH);
+      if (ret!=Z_OK && ret!=Z_STREAM_END) { inflateEnd(&strm); return -1; }
+      size_t len=sizeof(out)-strm.avail_out;
+      crc=crc32(crc,out,len);
+      if (len>0 && fn(user,(const char *)out,len)) { inflateEnd(&strm); return 0; }
+    } while (ret!=Z_STREAM_END);
+    inflateEnd(&strm);
+  }
+  else return -1; // unsupported compression method
+  return crc==z->crc?0:-1;
+}
+
+
+/********* Parsing logs from the archive ***********/
+
+/* Feeds inflated chunks to the CSV parser, carrying any partial last line */
+struct battery_zip_stream {
+  struct battery_log_parser parser;
+  char *buf;    /* partial line left over from the previous chunk, then new data */
+  size_t len, max;
+};
+
+int battery_zip_stream_chunk(void *user,const char *chunk,size_t len)
+{
+  struct battery_zip_stream *s=(struct battery_zip_stream *)user;
+  if (s->len==0)
+  { // parse straight from the chunk, keeping only the unfinished line
+    size_t done=battery_log_parse_lines(&s->parser,chunk,len);
+    chunk+=done; len-=done;
+  }
+  if (s->len+len>s->max) {
+    s->max=2*(s->len+len);
+    s->buf=(char *)realloc(s->buf,s->max);
+  }
+  memcpy(s->buf+s->len,chunk,len);
+  s->len+=len;
+  if (s->len>len)
+  { // finish the carried line, and whatever whole lines follow it
+    size_t done=battery_log_parse_lines(&s->parser,s->buf,s->len);
+    memmove(s->buf,s->buf+done,s->len-done);
+    s->len-=done;
+  }
+  return 0;
+}
+
+/* Parse the CSV log in member e.
+   Returns the number of runs stored to *runs, or -1 on a damaged member. */
+int battery_zip_read_log(const struct battery_zip *zip,int e,struct battery_log **runs)
+{
+  struct battery_zip_stream *s=(struct battery_zip_stream *)calloc(1,sizeof(struct battery_zip_stream));
+  battery_log_parser_init(&s->parser);
+  int ok=battery_zip_read(zip,e,battery_zip_stream_chunk,s);
+  battery_log_parse(&s->parser,s->buf,s->len); // last line may lack a newline
+  int n=battery_log_parser_finish(&s->parser,runs);
+  free(s->buf);
+  free(s);
+  if (ok!=0) { battery_log_free(*runs,n); *runs=0; return -1; }
+  return n;
+}
+
+/* The logs parsed from one archive member */
+struct battery_zip_log {
+  int entry; /* index of the member in the archive */
+  int nrun;  /* number of runs, or -1 if the member was damaged */
+  struct battery_log *runs;
+};
+
+struct battery_zip_work {
+  const struct battery_zip *zip;
+  struct battery_zip_log *logs;
+  int nlogs;
+  int next; /* next log to claim (atomic) */
+};
+
+void *battery_zip_worker(void *arg)
+{
+  struct battery_zip_work *w=(struct battery_zip_work *)arg;
+  int i;
+  while ((i=__atomic_fetch_add(&w->next,1,__ATOMIC_RELAXED))<w->nlogs)
+    w->logs[i].nrun=battery_zip_read_log(w->zip,w->logs[i].entry,&w->logs[i].runs);
+  return 0;
+}
+
+/* Parse every CSV member of this archive, one member per thread at a time.
+   Returns the number of logs stored to *logs, in archive order. */
+int battery_zip_read_logs(const struct battery_zip *zip,struct battery_zip_log **logs,int nthreads)
+{
+  struct battery_zip_work w;
+  memset(&w,0,sizeof(w));
+  w.zip=zip;
+  w.logs=(struct battery_zip_log *)calloc(zip->n>0?zip->n:1,sizeof(struct battery_zip_log));
+  for (int e=0;e<zip->n;e++)
+    if (battery_zip_is_csv(&zip->entry[e])) w.logs[w.nlogs++].entry=e;
+
+  if (nthreads<1) nthreads=battery_threads_default();
+  if (nthreads>w.nlogs) nthreads=w.nlogs;
+  pthread_t thread[nthreads>0?nthreads:1];
+  for (int t=1;t<nthreads;t++) pthread_create(&thread[t],0,battery_zip_worker,&w);
+  battery_zip_worker(&w); // this thread works too
+  for (int t=1;t<nthreads;t++) pthread_join(thread[t],0);
+
+  *logs=w.logs;
+  return w.nlogs;
+}
+
+/* Free logs from battery_zip_read_logs */
+void battery_zip_free_logs(struct battery_zip_log *logs,int n)
+{
+  for (int i=0;i<n;i++)
+    if (logs[i].nrun>0) battery_log_free(logs[i].runs,logs[i].nrun);
+  free(logs);
+}
+
+#endif